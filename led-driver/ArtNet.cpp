@@ -1,15 +1,20 @@
 #include "ArtNet.h"
+#include "Clock.h"
 
+#include <algorithm>
 #include <endian.h>
 #include <memory.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
-void constructArtNetPacket(uint8_t *packet, const color_t *channelValues, int32_t numValues, uint8_t universe, uint8_t net)
+void initArtNetPacket(uint8_t *packet, uint8_t universe, uint8_t net)
 {
     // Clear the packet array
     memset(packet, 0, ARTNET_FULL_PACKET_SIZE);
 
-    //static uint8_t sequence = 0;
     const uint32_t dataLength = 512;
 
     // Construct the header
@@ -22,19 +27,248 @@ void constructArtNetPacket(uint8_t *packet, const color_t *channelValues, int32_
     packet[ARTNET_NET_OFFSET] = net;
     packet[ARTNET_LENGTH_HI_OFFSET] = (dataLength >> 8) & 0xFF;
     packet[ARTNET_LENGTH_LO_OFFSET] = dataLength & 0xFF;
+}
 
-    color_data_t *packet_colors = reinterpret_cast<color_data_t*>(&packet[ARTNET_HEADER_SIZE]);
-
+void writeArtNetPayload(uint8_t *packet, const color_t *channelValues, int32_t numValues)
+{
     // Copy the data
     int incr = numValues < 0 ? -1 : 1;
     int numChannels = incr * 4 * numValues;
     int valIndex = numValues < 0 ? -numValues - 1 : 0;
     for (int i = 0; i < numChannels; i += 4)
     {
-        packet[ARTNET_HEADER_SIZE + i + 0] = htons(channelValues[valIndex].r);
-        packet[ARTNET_HEADER_SIZE + i + 1] = htons(channelValues[valIndex].g);
-        packet[ARTNET_HEADER_SIZE + i + 2] = htons(channelValues[valIndex].b);
-        packet[ARTNET_HEADER_SIZE + i + 3] = htons(channelValues[valIndex].w);
+        packet[ARTNET_HEADER_SIZE + i + 0] = artNetChannelValue(channelValues[valIndex].r);
+        packet[ARTNET_HEADER_SIZE + i + 1] = artNetChannelValue(channelValues[valIndex].g);
+        packet[ARTNET_HEADER_SIZE + i + 2] = artNetChannelValue(channelValues[valIndex].b);
+        packet[ARTNET_HEADER_SIZE + i + 3] = artNetChannelValue(channelValues[valIndex].w);
         valIndex += incr;
     }
-}
\ No newline at end of file
+}
+
+void constructArtNetPacket(uint8_t *packet, const color_t *channelValues, int32_t numValues, uint8_t universe, uint8_t net,
+                           uint8_t sequence)
+{
+    initArtNetPacket(packet, universe, net);
+    packet[ARTNET_SEQUENCE_OFFSET] = sequence;
+    writeArtNetPayload(packet, channelValues, numValues);
+}
+
+void initArtSyncPacket(uint8_t *packet)
+{
+    memset(packet, 0, ARTNET_SYNC_PACKET_SIZE);
+    memcpy(packet, ARTNET_ID, ARTNET_ID_SIZE);
+    *((uint16_t *)&packet[ARTNET_OPCODE_OFFSET]) = htole16(ARTNET_OPCODE_SYNC);
+    *((uint16_t *)&packet[ARTNET_VERSION_OFFSET]) = htobe16(ARTNET_PROTOCOL_VERSION);
+}
+
+void initArtPollPacket(uint8_t *packet)
+{
+    memset(packet, 0, ARTNET_POLL_PACKET_SIZE);
+    memcpy(packet, ARTNET_ID, ARTNET_ID_SIZE);
+    *((uint16_t *)&packet[ARTNET_OPCODE_OFFSET]) = htole16(ARTNET_OPCODE_POLL);
+    *((uint16_t *)&packet[ARTNET_VERSION_OFFSET]) = htobe16(ARTNET_PROTOCOL_VERSION);
+    // Flags: send ArtPollReply whenever the node's configuration changes
+    packet[12] = 0x02;
+}
+
+namespace
+{
+// Reported as the destination of a universe nobody receives yet
+const sockaddr_in kNoRemote = {.sin_family = AF_INET};
+
+bool sameRemote(const sockaddr_in &a, const sockaddr_in &b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+}
+
+ArtNetOutput::~ArtNetOutput()
+{
+    close();
+}
+
+bool ArtNetOutput::open()
+{
+    _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_sockfd >= 0 && _syncBroadcast)
+    {
+        int enable = 1;
+        if (setsockopt(_sockfd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable)) < 0)
+        {
+            std::cout << "Failed to allow broadcasts for ArtSync! Error: " << errno << std::endl;
+        }
+    }
+    return _sockfd >= 0;
+}
+
+void ArtNetOutput::close()
+{
+    if (_sockfd >= 0)
+    {
+        ::close(_sockfd);
+        _sockfd = -1;
+    }
+}
+
+size_t ArtNetOutput::addUniverse(uint8_t universe, uint8_t net)
+{
+    size_t index = _sequence.size();
+    _destinations.emplace_back();
+    _routed.emplace_back();
+    _sequence.push_back(0);
+    _packets.resize(_sequence.size() * ARTNET_FULL_PACKET_SIZE);
+    initArtNetPacket(packet(index), universe, net);
+    rebuildMessages();
+    return index;
+}
+
+size_t ArtNetOutput::addUniverse(const sockaddr_in &remote, uint8_t universe, uint8_t net)
+{
+    size_t index = addUniverse(universe, net);
+    addDestination(index, remote);
+    return index;
+}
+
+void ArtNetOutput::addDestination(size_t index, const sockaddr_in &remote)
+{
+    _destinations[index].push_back(remote);
+    rebuildMessages();
+}
+
+void ArtNetOutput::route(const ArtNetRoutes &routes)
+{
+    std::vector<bool> routed(ARTNET_MAX_PORT_ADDRESS + 1);
+    for (size_t i = 0; i < _routed.size(); ++i)
+    {
+        _routed[i].clear();
+        uint16_t address = portAddress(i);
+        auto it = routes.find(address);
+        if (it == routes.end() || routed[address])
+        {
+            continue;
+        }
+        routed[address] = true;
+        for (const sockaddr_in &node : it->second)
+        {
+            bool known = std::any_of(_destinations[i].begin(), _destinations[i].end(),
+                                     [&](const sockaddr_in &remote) { return sameRemote(remote, node); });
+            if (!known)
+            {
+                _routed[i].push_back(node);
+            }
+        }
+    }
+    rebuildMessages();
+}
+
+const sockaddr_in &ArtNetOutput::remote(size_t index) const
+{
+    if (!_destinations[index].empty())
+    {
+        return _destinations[index].front();
+    }
+    return _routed[index].empty() ? kNoRemote : _routed[index].front();
+}
+
+void ArtNetOutput::enableSync(const sockaddr_in *address)
+{
+    _sync = true;
+    _syncBroadcast = address != nullptr;
+    if (address)
+    {
+        _syncAddress = *address;
+    }
+    initArtSyncPacket(_syncPacket);
+    rebuildMessages();
+}
+
+void ArtNetOutput::rebuildMessages()
+{
+    _batch.rebuild(_packets.data(), {&_destinations, &_routed});
+    _destinationCount = _batch.messageCount();
+
+    if (!_sync)
+    {
+        return;
+    }
+    _syncRemotes.clear();
+    if (_syncBroadcast)
+    {
+        _syncRemotes.push_back(_syncAddress);
+    }
+    else
+    {
+        for (const sockaddr_in &remote : _batch.remotes())
+        {
+            bool known = std::any_of(_syncRemotes.begin(), _syncRemotes.end(),
+                                     [&](const sockaddr_in &other) { return sameRemote(other, remote); });
+            if (!known)
+            {
+                _syncRemotes.push_back(remote);
+            }
+        }
+    }
+    _syncIovec.iov_base = _syncPacket;
+    _syncIovec.iov_len = ARTNET_SYNC_PACKET_SIZE;
+    _syncMessages.resize(_syncRemotes.size());
+    for (size_t i = 0; i < _syncRemotes.size(); ++i)
+    {
+        memset(&_syncMessages[i], 0, sizeof(mmsghdr));
+        _syncMessages[i].msg_hdr.msg_name = &_syncRemotes[i];
+        _syncMessages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        _syncMessages[i].msg_hdr.msg_iov = &_syncIovec;
+        _syncMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+size_t ArtNetOutput::send()
+{
+    int64_t startNs = monotonicNanos();
+    size_t count = _batch.select(!_batch.refreshEnabled(), startNs);
+    for (size_t i = 0; i < _sequence.size(); ++i)
+    {
+        if (_batch.selected(i))
+        {
+            // Sequence 0 disables reordering on the node, so wrap around to 1
+            _sequence[i] = _sequence[i] == 0xFF ? 1 : _sequence[i] + 1;
+            packet(i)[ARTNET_SEQUENCE_OFFSET] = _sequence[i];
+        }
+    }
+
+    size_t failed = _batch.send(_sockfd, [this](size_t index, const sockaddr_in &remote, bool partial) {
+        if (partial)
+        {
+            std::cout << "Partial ArtNet packet sent for universe " << portAddress(index) << "!" << std::endl;
+        }
+        else
+        {
+            std::cout << "Failed to send ArtNet packet for universe " << portAddress(index) << " to "
+                      << inet_ntoa(remote.sin_addr) << "! Error: " << errno << std::endl;
+        }
+    });
+
+    // Nodes only act on an ArtSync when new data is waiting
+    if (_sync && count > 0)
+    {
+        sendSync();
+        _syncDelay.record(static_cast<uint64_t>(monotonicNanos() - startNs));
+    }
+    return failed;
+}
+
+void ArtNetOutput::sendSync()
+{
+    size_t next = 0;
+    while (next < _syncMessages.size())
+    {
+        int sent = sendmmsg(_sockfd, &_syncMessages[next], _syncMessages.size() - next, 0);
+        if (sent <= 0)
+        {
+            ++_syncFailures;
+            ++next;
+            continue;
+        }
+        _syncPackets += sent;
+        next += sent;
+    }
+}
@@ -2,8 +2,14 @@
 #define _ARTNET_H
 
 #include <stdint.h>
+#include <map>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "LedDefs.h"
+#include "Histogram.h"
+#include "UniverseBatch.h"
 
 // The size of the ArtNet packet ID in bytes
 #define ARTNET_ID_SIZE 8
@@ -14,8 +20,11 @@
 // The size of the ArtNet header in bytes
 #define ARTNET_HEADER_SIZE 18
 
+// The number of DMX values carried by a full ArtDmx packet
+#define ARTNET_PAYLOAD_SIZE 512
+
 // The size of the ArtNet packet containing the full 512 values
-#define ARTNET_FULL_PACKET_SIZE (ARTNET_HEADER_SIZE + 512)
+#define ARTNET_FULL_PACKET_SIZE (ARTNET_HEADER_SIZE + ARTNET_PAYLOAD_SIZE)
 
 // The byte offset of the opcode field in the ArtNet header
 #define ARTNET_OPCODE_OFFSET 8
@@ -44,12 +53,137 @@
 // ArtNet opcode for DMX messages
 #define ARTNET_OPCODE 0x5000
 
+// ArtNet opcode for ArtSync, which makes nodes output the DMX they buffered all at once
+#define ARTNET_OPCODE_SYNC 0x5200
+
+// The size of an ArtSync packet: ID, opcode, version and two zero aux bytes
+#define ARTNET_SYNC_PACKET_SIZE 14
+
+// ArtNet opcodes for node discovery, a controller polls and every node answers with a reply
+#define ARTNET_OPCODE_POLL 0x2000
+#define ARTNET_OPCODE_POLL_REPLY 0x2100
+
+// The size of an ArtPoll packet: ID, opcode, version, flags and diagnostics priority
+#define ARTNET_POLL_PACKET_SIZE 14
+
+// Port addresses are 15 bits: net << 8 | subnet << 4 | universe
+#define ARTNET_MAX_PORT_ADDRESS 0x7FFF
+
 // ArtNet protocol version constant
 #define ARTNET_PROTOCOL_VERSION 0x000e
 
 // ArtNet default port number
 #define ARTNET_PORT 6454
 
-void constructArtNetPacket(uint8_t *packet, const color_t *channelValues, int32_t numChannels, uint8_t universe, uint8_t net);
+// Converts an 8-bit output code (see ColorCurve) to its on-wire DMX value
+inline uint8_t artNetChannelValue(color_data_t value)
+{
+    return static_cast<uint8_t>(value);
+}
+
+// Writes a 16-bit output code as a coarse channel followed by a fine one
+inline void artNetWideChannelValue(uint8_t *channels, color_data_t value)
+{
+    channels[0] = static_cast<uint8_t>(value >> 8);
+    channels[1] = static_cast<uint8_t>(value);
+}
+
+// Fills in the header of a full size ArtDmx packet and zeroes its payload
+void initArtNetPacket(uint8_t *packet, uint8_t universe, uint8_t net);
+
+// Rewrites the payload of a packet prepared by initArtNetPacket from 8-bit output codes, a negative count reverses the order
+void writeArtNetPayload(uint8_t *packet, const color_t *channelValues, int32_t numValues);
+
+// Sequence 0 tells the node not to reorder, 1 to 255 count up per universe
+void constructArtNetPacket(uint8_t *packet, const color_t *channelValues, int32_t numChannels, uint8_t universe, uint8_t net,
+                           uint8_t sequence = 0);
+
+void initArtSyncPacket(uint8_t *packet);
+
+// Asks every node to answer with an ArtPollReply, and to send another one whenever it changes
+void initArtPollPacket(uint8_t *packet);
+
+// Discovered nodes by the port address they output, see ArtNetDiscovery
+using ArtNetRoutes = std::map<uint16_t, std::vector<sockaddr_in>>;
+
+// Keeps one prebuilt ArtDmx packet per universe and flushes all of them with a single sendmmsg call.
+// A packet is encoded once and sent to each of its destinations, the controllers it was registered
+// with plus the discovered nodes routed to its port address. Every universe counts its own
+// sequence. With sync enabled an ArtSync follows each batch, so nodes hold the universes they
+// received and all of them change on the same packet.
+class ArtNetOutput
+{
+public:
+    ~ArtNetOutput();
+
+    bool open();
+    void close();
+    bool isOpen() const { return _sockfd >= 0; }
+
+    // Registers a universe and returns its index, invalidates previously returned payload pointers
+    size_t addUniverse(uint8_t universe, uint8_t net);
+    size_t addUniverse(const sockaddr_in &remote, uint8_t universe, uint8_t net);
+    // Mirrors a universe to another controller
+    void addDestination(size_t index, const sockaddr_in &remote);
+    // Replaces the discovered destinations. Each node gets the first universe registered for a
+    // port address it outputs, unless it is already one of that universe's controllers.
+    void route(const ArtNetRoutes &routes);
+    // Sends ArtSync to the address after every batch, or to every controller with a universe when it is null
+    void enableSync(const sockaddr_in *address);
+    bool syncEnabled() const { return _sync; }
+    size_t universeCount() const { return _sequence.size(); }
+
+    uint8_t *packet(size_t index) { return &_packets[index * ARTNET_FULL_PACKET_SIZE]; }
+    const uint8_t *packet(size_t index) const { return &_packets[index * ARTNET_FULL_PACKET_SIZE]; }
+    // The first destination of a universe, an unspecified address when it has none
+    const sockaddr_in &remote(size_t index) const;
+
+    // Only sends universes whose payload changed, plus every universe once per interval, 0 sends all every frame
+    void setRefreshInterval(int64_t intervalNs) { _batch.setRefreshInterval(intervalNs); }
+
+    // Sends all due universes to all their destinations, returns the number of packets that failed
+    size_t send();
+
+    // Readable from any thread once all universes are registered
+    uint64_t failures(size_t index) const { return _batch.failures(index); }
+    uint64_t sentPackets() const { return _batch.sentPackets(); }
+    // ArtDmx packets sent per frame, one per universe and destination
+    uint64_t destinationCount() const { return _destinationCount; }
+    // Universes held back because nothing changed
+    uint64_t suppressedUniverses() const { return _batch.suppressedUniverses(); }
+    uint64_t syncPackets() const { return _syncPackets; }
+    uint64_t syncFailures() const { return _syncFailures; }
+    // Time from handing the first ArtDmx of a frame to the kernel until its ArtSync is sent, in nanoseconds
+    const AtomicHistogram &syncDelay() const { return _syncDelay; }
+    uint16_t portAddress(size_t index) const
+    {
+        return static_cast<uint16_t>(_packets[index * ARTNET_FULL_PACKET_SIZE + ARTNET_NET_OFFSET] << 8 |
+                                     _packets[index * ARTNET_FULL_PACKET_SIZE + ARTNET_UNIVERSE_OFFSET]);
+    }
+
+private:
+    void rebuildMessages();
+    void sendSync();
+
+    int _sockfd = -1;
+    std::vector<uint8_t> _packets;
+    // Per universe, the controllers it was registered with and the nodes discovery routed to it
+    std::vector<std::vector<sockaddr_in>> _destinations;
+    std::vector<std::vector<sockaddr_in>> _routed;
+    std::vector<uint8_t> _sequence;
+    UniverseBatch _batch{ARTNET_FULL_PACKET_SIZE, ARTNET_HEADER_SIZE, ARTNET_PAYLOAD_SIZE};
+    RelaxedCounter _destinationCount;
+
+    bool _sync = false;
+    bool _syncBroadcast = false;
+    sockaddr_in _syncAddress{};
+    uint8_t _syncPacket[ARTNET_SYNC_PACKET_SIZE];
+    iovec _syncIovec{};
+    std::vector<sockaddr_in> _syncRemotes;
+    std::vector<mmsghdr> _syncMessages;
+    RelaxedCounter _syncPackets;
+    RelaxedCounter _syncFailures;
+    AtomicHistogram _syncDelay;
+};
 
 #endif // _ARTNET_H
\ No newline at end of file
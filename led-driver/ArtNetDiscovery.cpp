@@ -0,0 +1,244 @@
+#include "ArtNetDiscovery.h"
+#include "ControlLoop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <iostream>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Field offsets of an ArtPollReply
+#define POLL_REPLY_ADDRESS_OFFSET 10
+#define POLL_REPLY_NET_OFFSET 18
+#define POLL_REPLY_SUBNET_OFFSET 19
+#define POLL_REPLY_NAME_OFFSET 26
+#define POLL_REPLY_NAME_SIZE 18
+#define POLL_REPLY_PORT_COUNT_OFFSET 173
+#define POLL_REPLY_PORT_TYPES_OFFSET 174
+#define POLL_REPLY_SW_OUT_OFFSET 190
+#define POLL_REPLY_BIND_INDEX_OFFSET 211
+
+// The shortest reply that still carries the output port addresses
+#define POLL_REPLY_MIN_SIZE (POLL_REPLY_SW_OUT_OFFSET + 4)
+
+// Port type bit of a port that outputs DMX received over Art-Net
+#define POLL_REPLY_PORT_OUTPUT 0x80
+
+namespace
+{
+bool sameRoutes(const ArtNetRoutes &a, const ArtNetRoutes &b)
+{
+    auto sameNodes = [](const ArtNetRoutes::value_type &x, const ArtNetRoutes::value_type &y) {
+        return x.first == y.first && x.second.size() == y.second.size() &&
+               std::equal(x.second.begin(), x.second.end(), y.second.begin(), [](const sockaddr_in &m, const sockaddr_in &n) {
+                   return m.sin_addr.s_addr == n.sin_addr.s_addr;
+               });
+    };
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), sameNodes);
+}
+}
+
+ArtNetDiscovery::~ArtNetDiscovery()
+{
+    close();
+}
+
+bool ArtNetDiscovery::applyConfig(const libconfig::Setting &settings)
+{
+    std::string pollAddress = "2.255.255.255";
+    double pollInterval = 3.0;
+    double nodeTimeout = 10.0;
+    settings.lookupValue("enabled", _enabled);
+    settings.lookupValue("listen_address", _listenAddress);
+    settings.lookupValue("poll_address", pollAddress);
+    settings.lookupValue("poll_interval", pollInterval);
+    settings.lookupValue("node_timeout", nodeTimeout);
+
+    _pollAddress = sockaddr_in{};
+    _pollAddress.sin_family = AF_INET;
+    _pollAddress.sin_port = htons(ARTNET_PORT);
+    in_addr listenAddress;
+    if (inet_aton(pollAddress.c_str(), &_pollAddress.sin_addr) == 0 || inet_aton(_listenAddress.c_str(), &listenAddress) == 0)
+    {
+        std::cout << "Invalid Art-Net discovery address: " << pollAddress << " / " << _listenAddress << std::endl;
+        return false;
+    }
+    if (!(pollInterval > 0.0) || !(nodeTimeout > pollInterval))
+    {
+        std::cout << "Art-Net discovery needs a positive poll_interval and a longer node_timeout." << std::endl;
+        return false;
+    }
+    _pollIntervalNs = static_cast<int64_t>(pollInterval * NS_PER_SEC);
+    _nodeTimeoutNs = static_cast<int64_t>(nodeTimeout * NS_PER_SEC);
+    return true;
+}
+
+bool ArtNetDiscovery::open(ControlLoop &loop)
+{
+    sockaddr_in listener{};
+    listener.sin_family = AF_INET;
+    listener.sin_port = htons(ARTNET_PORT);
+    inet_aton(_listenAddress.c_str(), &listener.sin_addr);
+    // Nodes answer to the Art-Net port of the controller, whichever port the poll came from
+    if (!loop.addUdpListener(listener, ARTNET_DISCOVERY_TAG))
+    {
+        return false;
+    }
+
+    _sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    if (_sockfd < 0 || setsockopt(_sockfd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable)) < 0)
+    {
+        std::cout << "Failed to create the ArtPoll socket! Error: " << errno << std::endl;
+        close();
+        return false;
+    }
+    initArtPollPacket(_pollPacket);
+    _nextPollNs = 0;
+    return true;
+}
+
+void ArtNetDiscovery::close()
+{
+    if (_sockfd >= 0)
+    {
+        ::close(_sockfd);
+        _sockfd = -1;
+    }
+}
+
+void ArtNetDiscovery::poll()
+{
+    if (_sockfd < 0)
+    {
+        return;
+    }
+    int64_t now = monotonicNanos();
+    size_t nodeCount = _nodes.size();
+    for (auto it = _nodes.begin(); it != _nodes.end();)
+    {
+        if (now - it->second.lastSeenNs > _nodeTimeoutNs)
+        {
+            std::cout << "Art-Net node " << it->second.name << " at " << inet_ntoa(it->second.address.sin_addr)
+                      << " stopped answering." << std::endl;
+            it = _nodes.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    if (_nodes.size() != nodeCount)
+    {
+        publish();
+    }
+
+    if (now < _nextPollNs)
+    {
+        return;
+    }
+    _nextPollNs = now + _pollIntervalNs;
+    if (sendto(_sockfd, _pollPacket, ARTNET_POLL_PACKET_SIZE, 0, (const sockaddr *)&_pollAddress, sizeof(_pollAddress)) < 0)
+    {
+        std::cout << "Failed to send ArtPoll! Error: " << errno << std::endl;
+        return;
+    }
+    ++_pollsSent;
+}
+
+void ArtNetDiscovery::receive(const uint8_t *data, size_t length, const sockaddr_in &remote)
+{
+    // Our own broadcast polls and any other Art-Net traffic arrive here too
+    if (length < POLL_REPLY_MIN_SIZE || memcmp(data, ARTNET_ID, ARTNET_ID_SIZE) != 0 ||
+        le16toh(*(const uint16_t *)&data[ARTNET_OPCODE_OFFSET]) != ARTNET_OPCODE_POLL_REPLY)
+    {
+        return;
+    }
+    ++_repliesReceived;
+
+    Node node;
+    node.address = sockaddr_in{};
+    node.address.sin_family = AF_INET;
+    node.address.sin_port = htons(ARTNET_PORT);
+    memcpy(&node.address.sin_addr.s_addr, &data[POLL_REPLY_ADDRESS_OFFSET], 4);
+    if (node.address.sin_addr.s_addr == 0)
+    {
+        node.address.sin_addr = remote.sin_addr;
+    }
+    const char *name = reinterpret_cast<const char *>(&data[POLL_REPLY_NAME_OFFSET]);
+    node.name.assign(name, strnlen(name, POLL_REPLY_NAME_SIZE));
+    node.lastSeenNs = monotonicNanos();
+
+    uint16_t base = static_cast<uint16_t>((data[POLL_REPLY_NET_OFFSET] & 0x7F) << 8 | (data[POLL_REPLY_SUBNET_OFFSET] & 0x0F) << 4);
+    size_t portCount = std::min<size_t>(data[POLL_REPLY_PORT_COUNT_OFFSET], 4);
+    for (size_t i = 0; i < portCount; ++i)
+    {
+        if (data[POLL_REPLY_PORT_TYPES_OFFSET + i] & POLL_REPLY_PORT_OUTPUT)
+        {
+            node.portAddresses.push_back(base | (data[POLL_REPLY_SW_OUT_OFFSET + i] & 0x0F));
+        }
+    }
+    std::sort(node.portAddresses.begin(), node.portAddresses.end());
+    node.portAddresses.erase(std::unique(node.portAddresses.begin(), node.portAddresses.end()), node.portAddresses.end());
+
+    // Bind index 0 and 1 both mean the root of the node
+    uint8_t bindIndex = length > POLL_REPLY_BIND_INDEX_OFFSET ? data[POLL_REPLY_BIND_INDEX_OFFSET] : 0;
+    uint64_t key = static_cast<uint64_t>(ntohl(node.address.sin_addr.s_addr)) << 8 | std::max<uint8_t>(bindIndex, 1);
+    auto it = _nodes.find(key);
+    bool changed = it == _nodes.end() || it->second.portAddresses != node.portAddresses;
+    if (it == _nodes.end())
+    {
+        std::cout << "Found Art-Net node " << node.name << " at " << inet_ntoa(node.address.sin_addr) << " with "
+                  << node.portAddresses.size() << " output(s)." << std::endl;
+    }
+    _nodes[key] = std::move(node);
+    if (changed)
+    {
+        publish();
+    }
+}
+
+void ArtNetDiscovery::publish()
+{
+    ArtNetRoutes routes;
+    for (const auto &entry : _nodes)
+    {
+        for (uint16_t portAddress : entry.second.portAddresses)
+        {
+            std::vector<sockaddr_in> &nodes = routes[portAddress];
+            bool known = std::any_of(nodes.begin(), nodes.end(), [&](const sockaddr_in &address) {
+                return address.sin_addr.s_addr == entry.second.address.sin_addr.s_addr;
+            });
+            if (!known)
+            {
+                nodes.push_back(entry.second.address);
+            }
+        }
+    }
+    // Expiring or re-announcing a node often leaves the routes as they were
+    if (sameRoutes(routes, _published))
+    {
+        return;
+    }
+    _published = routes;
+
+    std::lock_guard<std::mutex> lock(_routesMutex);
+    _routes = std::move(routes);
+    _version.store(++_routesVersion, std::memory_order_release);
+}
+
+bool ArtNetDiscovery::fetchRoutes(uint64_t &version, ArtNetRoutes &routes) const
+{
+    if (_version.load(std::memory_order_acquire) == version)
+    {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(_routesMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return false;
+    }
+    routes = _routes;
+    version = _routesVersion;
+    return true;
+}
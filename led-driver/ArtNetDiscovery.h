@@ -0,0 +1,86 @@
+#ifndef _ARTNET_DISCOVERY_H
+#define _ARTNET_DISCOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <libconfig.h++>
+
+#include "ArtNet.h"
+#include "Clock.h"
+
+class ControlLoop;
+
+// Tag of the discovery listener in the control loop, installation tags count up from 0
+#define ARTNET_DISCOVERY_TAG SIZE_MAX
+
+// Finds the Art-Net nodes on the network. The control thread broadcasts an ArtPoll every
+// poll interval and keeps a table of the nodes that answered and the port addresses they
+// output, forgetting nodes that stay silent for the timeout. Whenever the table changes
+// it publishes new routes, which the render thread picks up between frames without ever
+// waiting for the control thread.
+class ArtNetDiscovery
+{
+public:
+    ~ArtNetDiscovery();
+
+    // Reads the artnet_discovery group: enabled, listen_address, poll_address, poll_interval
+    // and node_timeout. Returns false on invalid settings.
+    bool applyConfig(const libconfig::Setting &settings);
+    bool enabled() const { return _enabled; }
+
+    // Listens for ArtPollReply on the Art-Net port and opens the socket the polls are sent from
+    bool open(ControlLoop &loop);
+    void close();
+
+    // Control thread: sends an ArtPoll when one is due and expires silent nodes, called from housekeeping
+    void poll();
+    // Control thread: handles a datagram of the discovery listener
+    void receive(const uint8_t *data, size_t length, const sockaddr_in &remote);
+
+    // Render thread: copies the routes when they changed since version. Returns false when
+    // they did not, or when the control thread is publishing right now.
+    bool fetchRoutes(uint64_t &version, ArtNetRoutes &routes) const;
+
+    // Control thread only
+    size_t nodeCount() const { return _nodes.size(); }
+    uint64_t pollsSent() const { return _pollsSent; }
+    uint64_t repliesReceived() const { return _repliesReceived; }
+
+private:
+    struct Node {
+        std::string name;
+        sockaddr_in address;
+        std::vector<uint16_t> portAddresses;
+        int64_t lastSeenNs;
+    };
+
+    void publish();
+
+    bool _enabled = false;
+    std::string _listenAddress = "0.0.0.0";
+    sockaddr_in _pollAddress{};
+    int64_t _pollIntervalNs = 3 * NS_PER_SEC;
+    int64_t _nodeTimeoutNs = 10 * NS_PER_SEC;
+
+    int _sockfd = -1;
+    uint8_t _pollPacket[ARTNET_POLL_PACKET_SIZE];
+    int64_t _nextPollNs = 0;
+    uint64_t _pollsSent = 0;
+    uint64_t _repliesReceived = 0;
+    // Nodes by address and bind index, nodes with more than four ports answer once per group of four
+    std::map<uint64_t, Node> _nodes;
+    ArtNetRoutes _published;
+
+    mutable std::mutex _routesMutex;
+    ArtNetRoutes _routes;
+    uint64_t _routesVersion = 0;
+    std::atomic<uint64_t> _version{0};
+};
+
+#endif // _ARTNET_DISCOVERY_H
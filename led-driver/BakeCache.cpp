@@ -0,0 +1,359 @@
+#include "BakeCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BAKE_MAGIC "LEDB"
+#define BAKE_VERSION 2
+
+namespace
+{
+struct BakeFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t colorSize;
+    uint32_t ledCount;
+    uint32_t frameCount;
+    float deltaTime;
+    uint64_t key;
+};
+
+bool readFully(int fd, void *data, size_t size)
+{
+    return read(fd, data, size) == static_cast<ssize_t>(size);
+}
+
+bool endsWith(const char *name, const char *suffix)
+{
+    size_t length = strlen(name);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(name + length - suffixLength, suffix) == 0;
+}
+
+// Writes a bake beside its final path and renames it, a crash never leaves a truncated bake behind
+void writeBakeFile(const std::string &path, uint64_t key, const Bake &bake)
+{
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cout << "Failed to persist a baked stage run: " << errno << std::endl;
+        return;
+    }
+    BakeFileHeader header{};
+    memcpy(header.magic, BAKE_MAGIC, 4);
+    header.version = BAKE_VERSION;
+    header.colorSize = sizeof(color_t);
+    header.ledCount = bake.ledCount;
+    header.frameCount = bake.frameCount();
+    header.deltaTime = bake.deltaTime;
+    header.key = key;
+    bool written = write(fd, &header, sizeof(header)) == sizeof(header) &&
+                   write(fd, bake.frames.data(), bake.bytes()) == static_cast<ssize_t>(bake.bytes());
+    close(fd);
+    if (!written || rename(temporary.c_str(), path.c_str()) < 0)
+    {
+        std::cout << "Failed to persist a baked stage run: " << errno << std::endl;
+        unlink(temporary.c_str());
+    }
+}
+}
+
+void BakeCache::applyConfig(const libconfig::Setting &settings)
+{
+    settings.lookupValue("enabled", _enabled);
+    uint32_t maxBytes = _maxBytes;
+    settings.lookupValue("max_bytes", maxBytes);
+    _maxBytes = maxBytes;
+    settings.lookupValue("directory", _directory);
+}
+
+std::string BakeCache::pathFor(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".bake", key);
+    return _directory + name;
+}
+
+void BakeCache::load(uint32_t ledCount)
+{
+    if (!_enabled)
+    {
+        return;
+    }
+    // Recording appends every frame, it never reallocates in the frame loop
+    _recordingBake.frames.reserve(_maxBytes / sizeof(color_t));
+    _spare.reserve(_maxBytes / sizeof(color_t));
+    if (_directory.empty())
+    {
+        return;
+    }
+    DIR *dir = opendir(_directory.c_str());
+    if (!dir)
+    {
+        std::cout << "Bake cache directory " << _directory << " is not readable: " << errno << std::endl;
+        return;
+    }
+    size_t loaded = 0;
+    size_t removed = 0;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string path = _directory + "/" + entry->d_name;
+        if (endsWith(entry->d_name, ".bake.tmp"))
+        {
+            // Left by a write that never finished, the control thread is the only writer
+            unlink(path.c_str());
+            ++removed;
+            continue;
+        }
+        if (!endsWith(entry->d_name, ".bake"))
+        {
+            continue;
+        }
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        BakeFileHeader header;
+        struct stat status;
+        bool keep = false;
+        if (fstat(fd, &status) == 0 && readFully(fd, &header, sizeof(header)) &&
+            memcmp(header.magic, BAKE_MAGIC, 4) == 0 && header.version == BAKE_VERSION &&
+            header.colorSize == sizeof(color_t))
+        {
+            // The header is checked against the file and the budget before anything is allocated
+            uint64_t bytes = static_cast<uint64_t>(header.frameCount) * header.ledCount * sizeof(color_t);
+            bool complete = static_cast<uint64_t>(status.st_size) == sizeof(header) + bytes;
+            // Bakes of another ring size may belong to an installation sharing the directory
+            keep = complete && header.ledCount != ledCount;
+            if (complete && header.ledCount == ledCount && _bytes + bytes <= _maxBytes)
+            {
+                auto bake = std::make_shared<Bake>();
+                bake->ledCount = header.ledCount;
+                bake->deltaTime = header.deltaTime;
+                bake->frames.resize(bytes / sizeof(color_t));
+                if (readFully(fd, bake->frames.data(), bytes))
+                {
+                    _bytes += bytes;
+                    _order.push_back(header.key);
+                    _bakes[header.key] = std::move(bake);
+                    ++loaded;
+                    keep = true;
+                }
+            }
+        }
+        close(fd);
+        if (!keep)
+        {
+            unlink(path.c_str());
+            ++removed;
+        }
+    }
+    closedir(dir);
+    std::cout << "Loaded " << loaded << " baked stage run(s) from " << _directory << ", removed " << removed
+              << " broken or over the budget." << std::endl;
+}
+
+bool BakeCache::begin(uint64_t key, float deltaTime, uint32_t ledCount)
+{
+    if (!_enabled)
+    {
+        return false;
+    }
+    BakeReturn returned;
+    while (_channel && _channel->returns.pop(returned))
+    {
+        if (_spare.capacity() == 0)
+        {
+            _spare = std::move(returned.spare);
+        }
+        else if (_recordingBake.frames.capacity() == 0)
+        {
+            _recordingBake.frames = std::move(returned.spare);
+        }
+        if (returned.bake->ledCount == ledCount)
+        {
+            store(returned.key, std::move(returned.bake));
+        }
+        else
+        {
+            // Recorded before a reload changed the ring
+            drop(returned.key, std::move(returned.bake), true);
+        }
+    }
+
+    _key = key;
+    auto found = _bakes.find(key);
+    if (found != _bakes.end() && found->second->ledCount == ledCount && found->second->deltaTime == deltaTime)
+    {
+        _playback = found->second.get();
+        _playbackFrame = 0;
+        return true;
+    }
+    // Without a buffer back from the control thread this run is not recorded
+    _recording = _recordingBake.frames.capacity() > 0;
+    _recordingBake.ledCount = ledCount;
+    _recordingBake.deltaTime = deltaTime;
+    _recordingBake.frames.clear();
+    return false;
+}
+
+void BakeCache::end()
+{
+    if (_recording && _recordingBake.frameCount() > 0 && _channel)
+    {
+        auto found = _bakes.find(_key);
+        bool longer = found == _bakes.end() || found->second->frameCount() < _recordingBake.frameCount();
+        BakeWrite write;
+        write.key = _key;
+        write.path = _directory.empty() ? std::string() : pathFor(_key);
+        write.recording = std::move(_recordingBake);
+        if (longer && _channel->writes.push(std::move(write)))
+        {
+            _recordingBake.frames = std::move(_spare);
+        }
+        else
+        {
+            _recordingBake = std::move(write.recording);
+        }
+    }
+    abort();
+}
+
+void BakeCache::abort()
+{
+    _recording = false;
+    _playback = nullptr;
+    _recordingBake.frames.clear();
+}
+
+bool BakeCache::nextFramePlays(float deltaTime)
+{
+    if (_playback && deltaTime != _playback->deltaTime)
+    {
+        // The ring already holds the last baked frame, live drawing continues from it
+        _playback = nullptr;
+    }
+    else if (_playback && _playbackFrame >= _playback->frameCount())
+    {
+        // A run cut short by a control command was baked, record the rest of this one
+        _recording = _recordingBake.frames.capacity() >= _playback->frames.size();
+        _recordingBake.ledCount = _playback->ledCount;
+        _recordingBake.deltaTime = _playback->deltaTime;
+        if (_recording)
+        {
+            _recordingBake.frames.assign(_playback->frames.begin(), _playback->frames.end());
+        }
+        _playback = nullptr;
+    }
+    if (_recording && deltaTime != _recordingBake.deltaTime)
+    {
+        abort();
+    }
+    return _playback != nullptr;
+}
+
+void BakeCache::frame(color_t *leds, size_t count)
+{
+    if (_playback)
+    {
+        memcpy(leds, &_playback->frames[_playbackFrame * count], count * sizeof(color_t));
+        ++_playbackFrame;
+    }
+    else if (_recording)
+    {
+        if (_recordingBake.bytes() + count * sizeof(color_t) > _maxBytes)
+        {
+            abort();
+            return;
+        }
+        _recordingBake.frames.insert(_recordingBake.frames.end(), leds, leds + count);
+    }
+}
+
+void BakeCache::store(uint64_t key, std::shared_ptr<const Bake> &&bake)
+{
+    auto found = _bakes.find(key);
+    if (found != _bakes.end())
+    {
+        if (found->second->frameCount() >= bake->frameCount())
+        {
+            // A longer run of the key was stored meanwhile, the file now holds the shorter one
+            drop(key, std::move(bake), false);
+            return;
+        }
+        // The file already holds the new run
+        _bytes -= found->second->bytes();
+        drop(key, std::move(found->second), false);
+        _bakes.erase(found);
+        _order.erase(std::find(_order.begin(), _order.end(), key));
+    }
+    while (!_order.empty() && _bytes + bake->bytes() > _maxBytes)
+    {
+        auto oldest = _bakes.find(_order.front());
+        _bytes -= oldest->second->bytes();
+        drop(oldest->first, std::move(oldest->second), true);
+        _bakes.erase(oldest);
+        _order.pop_front();
+    }
+    if (_bytes + bake->bytes() > _maxBytes)
+    {
+        drop(key, std::move(bake), true);
+        return;
+    }
+    _bytes += bake->bytes();
+    _order.push_back(key);
+    _bakes[key] = std::move(bake);
+}
+
+void BakeCache::drop(uint64_t key, std::shared_ptr<const Bake> &&bake, bool removeFile)
+{
+    BakeWrite write;
+    write.key = key;
+    if (removeFile && !_directory.empty())
+    {
+        write.path = pathFor(key);
+    }
+    write.dropped = std::move(bake);
+    // With a full queue the bake is freed here and a file stays behind until the next load()
+    if (_channel)
+    {
+        _channel->writes.push(std::move(write));
+    }
+}
+
+void serviceBakes(BakeChannel &channel)
+{
+    BakeWrite write;
+    while (!channel.returns.full() && channel.writes.pop(write))
+    {
+        if (write.dropped)
+        {
+            write.dropped.reset();
+            if (!write.path.empty())
+            {
+                unlink(write.path.c_str());
+            }
+            continue;
+        }
+        BakeReturn returned;
+        returned.key = write.key;
+        returned.bake = std::make_shared<const Bake>(write.recording);
+        if (!write.path.empty())
+        {
+            writeBakeFile(write.path, write.key, *returned.bake);
+        }
+        write.recording.frames.clear();
+        returned.spare = std::move(write.recording.frames);
+        channel.returns.push(std::move(returned));
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef _BAKE_CACHE_H
+#define _BAKE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <libconfig.h++>
+
+#include "LedDefs.h"
+#include "SpscQueue.h"
+
+// The ring contents of every frame of one stage run
+struct Bake {
+    uint32_t ledCount = 0;
+    float deltaTime = 0.f;
+    std::vector<color_t> frames;
+
+    size_t frameCount() const { return ledCount ? frames.size() / ledCount : 0; }
+    size_t bytes() const { return frames.size() * sizeof(color_t); }
+};
+
+// Work the render thread hands to the control thread, which does every copy and file access
+struct BakeWrite {
+    uint64_t key = 0;
+    // The bake's file, empty without a bake directory
+    std::string path;
+    // A finished run in the reserved recording buffer, stored as an exact copy and persisted
+    Bake recording;
+    // A bake dropped from memory, freed here and its file removed unless a recording replaces it
+    std::shared_ptr<const Bake> dropped;
+};
+
+// The exact copy of a recording for the render thread's cache, and the recording buffer to reuse
+struct BakeReturn {
+    uint64_t key = 0;
+    std::shared_ptr<const Bake> bake;
+    std::vector<color_t> spare;
+};
+
+struct BakeChannel {
+    SpscQueue<BakeWrite, 16> writes;
+    SpscQueue<BakeReturn, 16> returns;
+};
+
+// Control thread, works off the channel's writes while their results fit into the returns
+void serviceBakes(BakeChannel &channel);
+
+// Memoizes deterministic stage runs. A stage's frames depend only on the ring and the
+// stage state it starts from, the palette and the frame step, so the driver keys a run
+// by a fingerprint of those. The first run of a key is recorded while it renders live,
+// later runs copy the recorded frames into the ring instead of drawing them. The stage
+// logic itself keeps running, so transitions happen on the same frames either way and
+// playback can hand back to live drawing at any frame.
+//
+// Recording or playback stops for the rest of the run whenever something outside the
+// key changes: the palette, pulsing, or a frame step that differs from the first one.
+class BakeCache
+{
+public:
+    // Reads the bake group: enabled, max_bytes and directory (for persistence across restarts)
+    void applyConfig(const libconfig::Setting &settings);
+    bool enabled() const { return _enabled; }
+    // Where finished recordings and dropped bakes go, a recording is lost when the queue is full
+    void setChannel(BakeChannel *channel) { _channel = channel; }
+
+    // Loads the persisted bakes matching the ring size, removes the broken ones and those over
+    // max_bytes, and reserves the recording buffers. Called once from finalize().
+    void load(uint32_t ledCount);
+
+    // A stage run with the given fingerprint begins, returns true when it plays back. Takes
+    // the recordings the control thread copied since the last run into the cache.
+    bool begin(uint64_t key, float deltaTime, uint32_t ledCount);
+    // The current run ends, a recording longer than the stored one goes to the control thread
+    void end();
+    // Stops recording and playback until the next run
+    void abort();
+
+    // Called before each frame's stage update, returns true when the frame comes from the
+    // bake and the stage should skip drawing
+    bool nextFramePlays(float deltaTime);
+    // Called after each frame's stage update. Playback copies the frame into the ring,
+    // recording appends the ring.
+    void frame(color_t *leds, size_t count);
+
+private:
+    void store(uint64_t key, std::shared_ptr<const Bake> &&bake);
+    // Hands a bake leaving memory to the control thread, which also removes its file
+    void drop(uint64_t key, std::shared_ptr<const Bake> &&bake, bool removeFile);
+    std::string pathFor(uint64_t key) const;
+
+    bool _enabled = false;
+    size_t _maxBytes = 16 << 20;
+    std::string _directory;
+
+    // Shared so the control thread frees the dropped ones
+    std::unordered_map<uint64_t, std::shared_ptr<const Bake>> _bakes;
+    // Insertion order, the oldest bakes are evicted first
+    std::deque<uint64_t> _order;
+    size_t _bytes = 0;
+
+    uint64_t _key = 0;
+    const Bake *_playback = nullptr;
+    size_t _playbackFrame = 0;
+    bool _recording = false;
+    // Reserved for max_bytes, a finished run moves to the control thread in it and the spare
+    // takes over until the buffer comes back
+    Bake _recordingBake;
+    std::vector<color_t> _spare;
+    BakeChannel *_channel = nullptr;
+};
+
+// FNV-1a, used for the stage run fingerprints
+inline uint64_t fingerprint(const void *data, size_t size, uint64_t hash = 1469598103934665603ULL)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif // _BAKE_CACHE_H
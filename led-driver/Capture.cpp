@@ -0,0 +1,249 @@
+#include "Capture.h"
+#include "Clock.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+inline size_t alignedRecordSize(size_t length)
+{
+    size_t size = sizeof(CaptureRecord) + length;
+    return (size + CAPTURE_RECORD_ALIGN - 1) / CAPTURE_RECORD_ALIGN * CAPTURE_RECORD_ALIGN;
+}
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+bool CaptureWriter::open(const std::string &path)
+{
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (_fd < 0)
+    {
+        std::cerr << "Failed to open the capture file " << path << ": " << errno << std::endl;
+        return false;
+    }
+    CaptureHeader header{};
+    memcpy(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    header.version = CAPTURE_VERSION;
+    header.headerSize = sizeof(CaptureHeader);
+    header.startRealtimeNs = realtimeNanos();
+    header.startMonotonicNs = monotonicNanos();
+    if (write(_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        std::cerr << "Failed to write the capture file header: " << errno << std::endl;
+        close();
+        return false;
+    }
+    _frame = 0;
+    return true;
+}
+
+void CaptureWriter::takeOver(CaptureWriter &other)
+{
+    close();
+    _fd = other._fd;
+    _frame = other._frame;
+    other._fd = -1;
+}
+
+void CaptureWriter::close()
+{
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+void CaptureWriter::append(const ArtNetOutput &output)
+{
+    if (_fd < 0)
+    {
+        return;
+    }
+    size_t recordSize = alignedRecordSize(ARTNET_PAYLOAD_SIZE);
+    // Sized on the first frame, the universes never change after the output is compiled
+    _buffer.resize(recordSize * output.universeCount());
+
+    int64_t timestamp = monotonicNanos();
+    uint8_t *out = _buffer.data();
+    for (size_t i = 0; i < output.universeCount(); ++i, out += recordSize)
+    {
+        CaptureRecord record{};
+        record.size = recordSize;
+        record.frame = _frame;
+        record.timestampNs = timestamp;
+        record.destinationAddress = output.remote(i).sin_addr.s_addr;
+        record.destinationPort = ntohs(output.remote(i).sin_port);
+        record.universe = output.portAddress(i);
+        record.length = ARTNET_PAYLOAD_SIZE;
+        memcpy(out, &record, sizeof(record));
+        memcpy(out + sizeof(record), output.packet(i) + ARTNET_HEADER_SIZE, ARTNET_PAYLOAD_SIZE);
+    }
+    ++_frame;
+
+    if (write(_fd, _buffer.data(), _buffer.size()) != static_cast<ssize_t>(_buffer.size()))
+    {
+        std::cout << "Failed to append to the capture file, stopping the capture: " << errno << std::endl;
+        close();
+    }
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open the capture file " << path << ": " << errno << std::endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(CaptureHeader))
+    {
+        std::cerr << "The capture file " << path << " is too short." << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Failed to map the capture file " << path << ": " << errno << std::endl;
+        return false;
+    }
+    _data = static_cast<const uint8_t *>(data);
+    _size = info.st_size;
+
+    if (memcmp(header().magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0 || header().version != CAPTURE_VERSION ||
+        header().headerSize < sizeof(CaptureHeader) || header().headerSize > _size)
+    {
+        std::cerr << "The file " << path << " is not a supported capture." << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (_data)
+    {
+        munmap(const_cast<uint8_t *>(_data), _size);
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+const CaptureRecord *CaptureReader::next(const CaptureRecord *record) const
+{
+    size_t offset = record ? reinterpret_cast<const uint8_t *>(record) - _data + record->size : header().headerSize;
+    if (offset + sizeof(CaptureRecord) > _size)
+    {
+        return nullptr;
+    }
+    const CaptureRecord *candidate = reinterpret_cast<const CaptureRecord *>(_data + offset);
+    if (candidate->size < sizeof(CaptureRecord) + candidate->length || offset + candidate->size > _size)
+    {
+        return nullptr;
+    }
+    return candidate;
+}
+
+bool replayCapture(const std::string &path, const ReplayOptions &options, const std::atomic_bool &running)
+{
+    CaptureReader reader;
+    if (!reader.open(path))
+    {
+        return false;
+    }
+
+    in_addr target{};
+    if (!options.target.empty() && inet_aton(options.target.c_str(), &target) == 0)
+    {
+        std::cout << "Invalid replay target: " << options.target << std::endl;
+        return false;
+    }
+
+    // One output universe per captured destination and universe, resolved once up front
+    ArtNetOutput output;
+    std::map<std::tuple<uint32_t, uint16_t, uint16_t>, size_t> universes;
+    std::vector<uint32_t> recordUniverses;
+    for (const CaptureRecord *record = reader.first(); record; record = reader.next(record))
+    {
+        auto key = std::make_tuple(record->destinationAddress, record->destinationPort, record->universe);
+        auto found = universes.find(key);
+        if (found == universes.end())
+        {
+            sockaddr_in remote{};
+            remote.sin_family = AF_INET;
+            remote.sin_port = htons(record->destinationPort);
+            remote.sin_addr.s_addr = options.target.empty() ? record->destinationAddress : target.s_addr;
+            size_t index = output.addUniverse(remote, record->universe & 0xFF, (record->universe >> 8) & 0x7F);
+            found = universes.emplace(key, index).first;
+        }
+        recordUniverses.push_back(found->second);
+    }
+    if (recordUniverses.empty())
+    {
+        std::cout << "The capture " << path << " holds no frames." << std::endl;
+        return false;
+    }
+    if (!output.open())
+    {
+        std::cerr << "Failed to create network socket to send ArtNet packets." << std::endl;
+        return false;
+    }
+
+    std::cout << "Replaying " << recordUniverses.size() << " universe packets on " << output.universeCount()
+              << " universe(s)" << (options.fast ? " as fast as possible" : "") << "." << std::endl;
+    for (uint32_t pass = 0; running && (options.loops == 0 || pass < options.loops); ++pass)
+    {
+        int64_t passStart = monotonicNanos();
+        uint64_t frames = 0;
+        const CaptureRecord *record = reader.first();
+        int64_t firstTimestamp = record->timestampNs;
+        size_t recordIndex = 0;
+        while (record && running)
+        {
+            uint32_t frame = record->frame;
+            if (!options.fast)
+            {
+                int64_t due = passStart + (record->timestampNs - firstTimestamp);
+                timespec deadline{static_cast<time_t>(due / NS_PER_SEC), static_cast<long>(due % NS_PER_SEC)};
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR && running)
+                {
+                }
+            }
+            // Universes missing from a frame are sent again with their previous payload
+            for (; record && record->frame == frame; record = reader.next(record), ++recordIndex)
+            {
+                uint8_t *packet = output.packet(recordUniverses[recordIndex]);
+                memcpy(packet + ARTNET_HEADER_SIZE, record->payload(), std::min<size_t>(record->length, ARTNET_PAYLOAD_SIZE));
+            }
+            output.send();
+            ++frames;
+        }
+        double seconds = (monotonicNanos() - passStart) * 1e-9;
+        std::cout << "Replay pass " << pass + 1 << ": " << frames << " frames in " << seconds << " s ("
+                  << (seconds > 0 ? frames / seconds : 0) << " fps)." << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+#include "ArtNet.h"
+
+// Capture files hold the DMX frames an Art-Net output sent, in an append-only layout
+// that can be memory-mapped and walked in place:
+//
+//   CaptureHeader
+//   CaptureRecord + payload, padded to CAPTURE_RECORD_ALIGN
+//   CaptureRecord + payload, ...
+//
+// Every universe of a frame gets a record carrying the same frame number. Fields are in
+// host byte order except the destination, which is kept as in sockaddr_in. A record cut
+// short by a crash is ignored by the reader.
+
+#define CAPTURE_MAGIC "LEDCAP\0\0"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_ALIGN 8
+
+struct CaptureHeader {
+    char magic[CAPTURE_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t headerSize;
+    // Wall clock at the start of the capture, record timestamps are CLOCK_MONOTONIC
+    int64_t startRealtimeNs;
+    int64_t startMonotonicNs;
+};
+
+struct CaptureRecord {
+    // Record length including header, payload and padding
+    uint32_t size;
+    uint32_t frame;
+    int64_t timestampNs;
+    uint32_t destinationAddress;
+    uint16_t destinationPort;
+    // 15-bit Art-Net port address
+    uint16_t universe;
+    uint16_t length;
+    uint16_t reserved;
+    uint32_t reserved2;
+
+    const uint8_t *payload() const { return reinterpret_cast<const uint8_t *>(this + 1); }
+};
+
+static_assert(sizeof(CaptureHeader) % CAPTURE_RECORD_ALIGN == 0, "records must start aligned");
+static_assert(sizeof(CaptureRecord) % CAPTURE_RECORD_ALIGN == 0, "payloads must start aligned");
+
+// Appends the universes of an output to a capture file, one write per frame
+class CaptureWriter
+{
+public:
+    ~CaptureWriter();
+
+    bool open(const std::string &path);
+    // Continues the file the other writer has open, which is left closed
+    void takeOver(CaptureWriter &other);
+    void close();
+    bool isOpen() const { return _fd >= 0; }
+
+    // Records the current payloads of all universes, called right after the output sent them
+    void append(const ArtNetOutput &output);
+
+private:
+    int _fd = -1;
+    uint32_t _frame = 0;
+    std::vector<uint8_t> _buffer;
+};
+
+// Read-only mapping of a capture file
+class CaptureReader
+{
+public:
+    ~CaptureReader();
+
+    bool open(const std::string &path);
+    void close();
+
+    const CaptureHeader &header() const { return *reinterpret_cast<const CaptureHeader *>(_data); }
+
+    // Walks the records in file order, returns nullptr after the last complete one
+    const CaptureRecord *first() const { return next(nullptr); }
+    const CaptureRecord *next(const CaptureRecord *record) const;
+
+private:
+    const uint8_t *_data = nullptr;
+    size_t _size = 0;
+};
+
+struct ReplayOptions {
+    // Send every frame as soon as the previous one left instead of at the captured times
+    bool fast = false;
+    // Number of passes over the capture, 0 repeats until stopped
+    uint32_t loops = 1;
+    // Sends everything to this address instead of the captured destinations when set
+    std::string target;
+};
+
+// Streams a capture through an Art-Net output without running any animation.
+// Returns when the capture (and its repetitions) is done or running turns false.
+bool replayCapture(const std::string &path, const ReplayOptions &options, const std::atomic_bool &running);
+
+#endif // _CAPTURE_H
@@ -0,0 +1,25 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000LL
+
+// CLOCK_MONOTONIC in nanoseconds, for measuring durations and frame deadlines
+inline int64_t monotonicNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * NS_PER_SEC + ts.tv_nsec;
+}
+
+// CLOCK_REALTIME in nanoseconds, the clock of kernel socket timestamps
+inline int64_t realtimeNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * NS_PER_SEC + ts.tv_nsec;
+}
+
+#endif // _CLOCK_H
@@ -0,0 +1,152 @@
+#include "ColorCurve.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace
+{
+// Built by the compiler, configurations without a color group never build a table at runtime
+constexpr PaletteTable kDefaultPalette = makePaletteTable(COLOR_CURVE_DEFAULT_GAMMA);
+constexpr OutputTable kDefaultOutput = makeOutputTable(1.0, 1.0);
+
+const char *const kChannelNames[4] = {"r", "g", "b", "w"};
+
+inline uint32_t lookup(const OutputTable &table, uint32_t value)
+{
+    uint32_t index = value >> COLOR_CURVE_FRACTION_BITS;
+    uint32_t fraction = value & ((1 << COLOR_CURVE_FRACTION_BITS) - 1);
+    // Rounding up keeps the identity curve exact, including the short top segment
+    return table[index] + (((table[index + 1] - table[index]) * fraction + (1 << COLOR_CURVE_FRACTION_BITS) - 1) >>
+                           COLOR_CURVE_FRACTION_BITS);
+}
+
+template <bool Dither>
+inline color_data_t narrowCode(uint32_t code, uint16_t &residual)
+{
+    if (!Dither)
+    {
+        return static_cast<color_data_t>((code + COLOR_CURVE_NARROW_STEP / 2) / COLOR_CURVE_NARROW_STEP);
+    }
+    // Full scale plus the largest residual still divides to 255
+    uint32_t total = code + residual;
+    uint32_t level = total / COLOR_CURVE_NARROW_STEP;
+    residual = static_cast<uint16_t>(total - level * COLOR_CURVE_NARROW_STEP);
+    return static_cast<color_data_t>(level);
+}
+}
+
+template <bool Dither, bool Wide>
+void ColorCurve::applyCurve(const color_t *leds, color_t *narrow, color_t *wide, size_t count)
+{
+    const OutputTable &red = _outputs[0];
+    const OutputTable &green = _outputs[1];
+    const OutputTable &blue = _outputs[2];
+    const OutputTable &white = _outputs[3];
+    uint16_t *residuals = _residuals.data();
+    for (size_t i = 0; i < count; ++i, residuals += 4)
+    {
+        const color_t &led = leds[i];
+        // Most of a frame is usually dark, black stays black and leaves the residuals alone
+        if ((led.r | led.g | led.b | led.w) == 0)
+        {
+            narrow[i] = color_t{};
+            if (Wide)
+            {
+                wide[i] = color_t{};
+            }
+            continue;
+        }
+        color_t code = {
+            .r = static_cast<color_data_t>(lookup(red, led.r)),
+            .g = static_cast<color_data_t>(lookup(green, led.g)),
+            .b = static_cast<color_data_t>(lookup(blue, led.b)),
+            .w = static_cast<color_data_t>(lookup(white, led.w))};
+        if (Wide)
+        {
+            wide[i] = code;
+        }
+        narrow[i] = color_t{
+            .r = narrowCode<Dither>(code.r, residuals[0]),
+            .g = narrowCode<Dither>(code.g, residuals[1]),
+            .b = narrowCode<Dither>(code.b, residuals[2]),
+            .w = narrowCode<Dither>(code.w, residuals[3])};
+    }
+}
+
+ColorCurve::ColorCurve()
+    : _palette(kDefaultPalette)
+{
+    _outputs.fill(kDefaultOutput);
+}
+
+bool ColorCurve::applyConfig(const libconfig::Setting &settings)
+{
+    double gamma = COLOR_CURVE_DEFAULT_GAMMA;
+    double controllerGamma = 1.0;
+    std::array<double, 4> whiteBalance = {1.0, 1.0, 1.0, 1.0};
+    settings.lookupValue("gamma", gamma);
+    settings.lookupValue("controller_gamma", controllerGamma);
+    for (size_t channel = 0; channel < whiteBalance.size(); ++channel)
+    {
+        settings.lookupValue(std::string("white_balance.") + kChannelNames[channel], whiteBalance[channel]);
+    }
+
+    if (!(gamma > 0.0) || !(controllerGamma > 0.0))
+    {
+        std::cout << "Color gamma and controller_gamma must be positive." << std::endl;
+        return false;
+    }
+    for (size_t channel = 0; channel < whiteBalance.size(); ++channel)
+    {
+        if (!(whiteBalance[channel] >= 0.0 && whiteBalance[channel] <= 1.0))
+        {
+            std::cout << "Color white_balance." << kChannelNames[channel] << " must be between 0 and 1." << std::endl;
+            return false;
+        }
+    }
+
+    _palette = makePaletteTable(gamma);
+    for (size_t channel = 0; channel < _outputs.size(); ++channel)
+    {
+        _outputs[channel] = makeOutputTable(whiteBalance[channel], 1.0 / controllerGamma);
+    }
+    settings.lookupValue("dither", _dither);
+    return true;
+}
+
+void ColorCurve::resize(size_t ledCount)
+{
+    if (_residuals.size() == ledCount * 4)
+    {
+        return;
+    }
+    // Neighbouring channels start at different points of their cycle, so a dithered
+    // level flickers across the ring instead of blinking in unison
+    _residuals.resize(ledCount * 4);
+    for (size_t i = 0; i < _residuals.size(); ++i)
+    {
+        _residuals[i] = static_cast<uint16_t>((static_cast<uint32_t>(i) * 2654435761u >> 16) % COLOR_CURVE_NARROW_STEP);
+    }
+}
+
+color_t ColorCurve::decode(const color_t &color) const
+{
+    return color_t{
+        .r = _palette[std::min<color_data_t>(color.r, COLOR_PALETTE_SIZE - 1)],
+        .g = _palette[std::min<color_data_t>(color.g, COLOR_PALETTE_SIZE - 1)],
+        .b = _palette[std::min<color_data_t>(color.b, COLOR_PALETTE_SIZE - 1)],
+        .w = _palette[std::min<color_data_t>(color.w, COLOR_PALETTE_SIZE - 1)]};
+}
+
+void ColorCurve::apply(const color_t *leds, color_t *narrow, color_t *wide, size_t count, bool dither)
+{
+    count = std::min(count, _residuals.size() / 4);
+    if (_dither && dither)
+    {
+        wide ? applyCurve<true, true>(leds, narrow, wide, count) : applyCurve<true, false>(leds, narrow, wide, count);
+    }
+    else
+    {
+        wide ? applyCurve<false, true>(leds, narrow, wide, count) : applyCurve<false, false>(leds, narrow, wide, count);
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef _COLOR_CURVE_H
+#define _COLOR_CURVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#include <vector>
+#include <libconfig.h++>
+
+#include "LedDefs.h"
+
+// Palette and configuration colors are 8-bit display values
+#define COLOR_PALETTE_SIZE 256
+
+// The output tables are indexed by the top 12 bits of a ring value and interpolated in between
+#define COLOR_CURVE_INDEX_BITS 12
+#define COLOR_CURVE_FRACTION_BITS (16 - COLOR_CURVE_INDEX_BITS)
+#define COLOR_CURVE_SIZE ((1 << COLOR_CURVE_INDEX_BITS) + 1)
+
+// The dithered 8-bit code is the 16-bit code divided by this, so 255 * 257 is full scale
+#define COLOR_CURVE_NARROW_STEP 257
+
+// Just enough math to build the tables in constant expressions, arguments are positive
+constexpr double curveLog(double x)
+{
+    // ln(x) = k ln(2) + ln(m) with m in [0.5, 1), then the atanh series converges quickly
+    constexpr double ln2 = 0.693147180559945309417;
+    int k = 0;
+    while (x >= 1.0)
+    {
+        x *= 0.5;
+        ++k;
+    }
+    while (x < 0.5)
+    {
+        x *= 2.0;
+        --k;
+    }
+    double z = (x - 1.0) / (x + 1.0);
+    double term = z;
+    double sum = 0.0;
+    for (int n = 1; n < 60; n += 2)
+    {
+        sum += term / n;
+        term *= z * z;
+    }
+    return k * ln2 + 2.0 * sum;
+}
+
+constexpr double curveExp(double x)
+{
+    // e^x = 2^k e^r with |r| <= ln(2) / 2
+    constexpr double ln2 = 0.693147180559945309417;
+    int k = static_cast<int>(x / ln2 + (x < 0.0 ? -0.5 : 0.5));
+    double r = x - k * ln2;
+    double term = 1.0;
+    double sum = 1.0;
+    for (int n = 1; n < 30; ++n)
+    {
+        term *= r / n;
+        sum += term;
+    }
+    for (; k > 0; --k)
+    {
+        sum *= 2.0;
+    }
+    for (; k < 0; ++k)
+    {
+        sum *= 0.5;
+    }
+    return sum;
+}
+
+constexpr double curvePow(double base, double exponent)
+{
+    return base <= 0.0 ? 0.0 : (exponent == 1.0 ? base : curveExp(exponent * curveLog(base)));
+}
+
+// Display value to linear light
+using PaletteTable = std::array<color_data_t, COLOR_PALETTE_SIZE>;
+
+constexpr PaletteTable makePaletteTable(double gamma)
+{
+    PaletteTable table{};
+    for (size_t i = 0; i < COLOR_PALETTE_SIZE; ++i)
+    {
+        double linear = curvePow(i / double(COLOR_PALETTE_SIZE - 1), gamma);
+        table[i] = static_cast<color_data_t>(linear * COLOR_DATA_MAX + 0.5);
+    }
+    return table;
+}
+
+// Linear light to the 16-bit code a controller expects, one per channel. Entry i is ring value
+// i << COLOR_CURVE_FRACTION_BITS, the last one only serves as the upper end of the interpolation.
+using OutputTable = std::array<uint16_t, COLOR_CURVE_SIZE>;
+
+constexpr OutputTable makeOutputTable(double scale, double exponent)
+{
+    OutputTable table{};
+    for (size_t i = 0; i < COLOR_CURVE_SIZE; ++i)
+    {
+        double linear = static_cast<double>(i << COLOR_CURVE_FRACTION_BITS) / COLOR_DATA_MAX;
+        double code = scale * curvePow(linear > 1.0 ? 1.0 : linear, exponent) * COLOR_DATA_MAX + 0.5;
+        table[i] = static_cast<uint16_t>(code > COLOR_DATA_MAX ? COLOR_DATA_MAX : code);
+    }
+    return table;
+}
+
+// Palette values count as linear unless a color group says otherwise, so untouched
+// configurations keep their look and only gain the finer fades
+#define COLOR_CURVE_DEFAULT_GAMMA 1.0
+
+// The color handling at both ends of the ring. The ring holds 16-bit linear light: palette
+// colors are decoded into it with the gamma, and every frame one fused pass turns it into
+// output codes through the white balance and controller curve tables, then temporally
+// dithers them down to 8 bits. Each channel carries its rounding error over to the next
+// frame, so a level between two codes is shown as the right mix of both over time.
+class ColorCurve
+{
+public:
+    ColorCurve();
+
+    // Reads the color group: gamma, white_balance { r, g, b, w }, controller_gamma and dither.
+    // Returns false and keeps the current tables when a value is out of range.
+    bool applyConfig(const libconfig::Setting &settings);
+
+    // Sizes the dither state, resets it when the ring size changes
+    void resize(size_t ledCount);
+
+    color_t decode(const color_t &color) const;
+
+    // One pass over the ring writing the 8-bit codes, plus the 16-bit codes when wide is given.
+    // Without dither the codes are rounded, for frames too far apart to blend into a level.
+    void apply(const color_t *leds, color_t *narrow, color_t *wide, size_t count, bool dither = true);
+
+private:
+    template <bool Dither, bool Wide>
+    void applyCurve(const color_t *leds, color_t *narrow, color_t *wide, size_t count);
+
+    PaletteTable _palette;
+    std::array<OutputTable, 4> _outputs;
+    bool _dither = true;
+    // Error carried over per channel, below COLOR_CURVE_NARROW_STEP
+    std::vector<uint16_t> _residuals;
+};
+
+#endif // _COLOR_CURVE_H
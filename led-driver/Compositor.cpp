@@ -0,0 +1,127 @@
+#include "Compositor.h"
+#include "LedKernels.h"
+
+namespace
+{
+inline bool isLit(const color_t &color)
+{
+    return (color.r | color.g | color.b | color.w) != 0;
+}
+}
+
+void Compositor::configure(const std::vector<LayerSettings> &layers, size_t ledCount)
+{
+    if (layers.size() != _layers.size() || ledCount != _ledCount)
+    {
+        _ledCount = ledCount;
+        _leds.assign(layers.size() * ledCount, color_t{});
+    }
+    _layers.resize(layers.size());
+    for (size_t i = 0; i < layers.size(); ++i)
+    {
+        _layers[i].settings = layers[i];
+    }
+    invalidate();
+}
+
+void Compositor::touch(size_t index, uint32_t begin, uint32_t end)
+{
+    Layer &layer = _layers[index];
+    layer.lit.add(begin, end);
+    layer.damage.add(begin, end);
+}
+
+void Compositor::dim(size_t index, float multiplier, color_data_t addition)
+{
+    Layer &layer = _layers[index];
+    if (addition != 0)
+    {
+        layer.lit = LedSpan{0, static_cast<uint32_t>(_ledCount)};
+    }
+    if (layer.lit.empty())
+    {
+        return;
+    }
+    color_t *leds = this->layer(index);
+    ::dimLeds(leds + layer.lit.begin, layer.lit.end - layer.lit.begin, multiplier, addition);
+    layer.damage.add(layer.lit);
+
+    // Trails fade out from their ends, so trimming black LEDs off both sides keeps the span tight
+    while (!layer.lit.empty() && !isLit(leds[layer.lit.begin]))
+    {
+        ++layer.lit.begin;
+    }
+    while (!layer.lit.empty() && !isLit(leds[layer.lit.end - 1]))
+    {
+        --layer.lit.end;
+    }
+}
+
+void Compositor::invalidate()
+{
+    for (Layer &layer : _layers)
+    {
+        layer.lit = LedSpan{0, static_cast<uint32_t>(_ledCount)};
+        layer.damage = layer.lit;
+    }
+}
+
+void Compositor::composite(color_t *output)
+{
+    LedSpan region;
+    for (const Layer &layer : _layers)
+    {
+        region.add(layer.damage);
+    }
+    if (region.empty())
+    {
+        return;
+    }
+
+    // Max over black is a copy, which spares the usual single layer stack a pass
+    size_t first = 0;
+    if (_layers[0].settings.blend == BlendMode::kMax)
+    {
+        const color_t *leds = layer(0);
+        std::copy(leds + region.begin, leds + region.end, output + region.begin);
+        _layers[0].damage = LedSpan();
+        first = 1;
+    }
+    else
+    {
+        fillSpan(output, region.begin, region.end, color_t{});
+    }
+    for (size_t i = first; i < _layers.size(); ++i)
+    {
+        Layer &layer = _layers[i];
+        layer.damage = LedSpan();
+        const color_t *leds = this->layer(i);
+        // Black is neutral for every mode but multiply, which darkens everything under the layer
+        uint32_t begin = region.begin;
+        uint32_t end = region.end;
+        if (layer.settings.blend != BlendMode::kMultiply)
+        {
+            begin = std::max(begin, layer.lit.begin);
+            end = std::min(end, layer.lit.end);
+        }
+        if (begin >= end)
+        {
+            continue;
+        }
+        switch (layer.settings.blend)
+        {
+        case BlendMode::kMax:
+            maxBlend(output + begin, leds + begin, end - begin);
+            break;
+        case BlendMode::kAdd:
+            addBlend(output + begin, leds + begin, end - begin);
+            break;
+        case BlendMode::kAlpha:
+            alphaBlend(output + begin, leds + begin, end - begin, layer.settings.opacity);
+            break;
+        case BlendMode::kMultiply:
+            multiplyBlend(output + begin, leds + begin, end - begin);
+            break;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef _COMPOSITOR_H
+#define _COMPOSITOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "LedDefs.h"
+
+#define COMPOSITOR_MAX_LAYERS 8
+
+enum class BlendMode {
+    kMax = 0,
+    kAdd = 1,
+    kAlpha = 2,
+    kMultiply = 3,
+};
+
+struct LayerSettings {
+    BlendMode blend = BlendMode::kMax;
+    // Only used by alpha blending
+    float opacity = 1.f;
+};
+
+// A half-open range of LEDs, empty when begin == end
+struct LedSpan {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+
+    bool empty() const { return begin >= end; }
+    void add(uint32_t from, uint32_t to)
+    {
+        if (from >= to)
+        {
+            return;
+        }
+        begin = empty() ? from : std::min(begin, from);
+        end = empty() ? to : std::max(end, to);
+    }
+    void add(const LedSpan &span) { add(span.begin, span.end); }
+};
+
+// A stack of layers the animation draws into, blended bottom to top over black into the
+// output ring. Every layer remembers the span that can hold lit LEDs and the span that
+// changed this frame, so compositing only revisits the LEDs some layer changed.
+class Compositor
+{
+public:
+    // Drops the layer contents when the layer count or ring size changes
+    void configure(const std::vector<LayerSettings> &layers, size_t ledCount);
+
+    size_t layerCount() const { return _layers.size(); }
+    size_t ledCount() const { return _ledCount; }
+    color_t *layer(size_t index) { return _leds.data() + index * _ledCount; }
+
+    // All layers back to back, the state a bake records and restores
+    color_t *data() { return _leds.data(); }
+    const color_t *data() const { return _leds.data(); }
+    size_t size() const { return _leds.size(); }
+
+    // Drawing wrote [begin, end) of a layer
+    void touch(size_t index, uint32_t begin, uint32_t end);
+    // Dims the lit part of a layer, an addition lights the whole layer
+    void dim(size_t index, float multiplier, color_data_t addition);
+    // The layers were overwritten from outside, the next composite covers everything
+    void invalidate();
+
+    // Recomposites the LEDs changed since the last call into the output ring
+    void composite(color_t *output);
+
+private:
+    struct Layer {
+        LayerSettings settings;
+        // May hold lit LEDs, everything outside is black
+        LedSpan lit;
+        // Changed since the last composite
+        LedSpan damage;
+    };
+
+    std::vector<Layer> _layers;
+    std::vector<color_t> _leds;
+    size_t _ledCount = 0;
+};
+
+#endif // _COMPOSITOR_H
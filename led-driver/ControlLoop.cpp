@@ -0,0 +1,307 @@
+#include "ControlLoop.h"
+#include "Clock.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+namespace
+{
+// Listener indices are stored in the epoll data, these two mark the internal descriptors
+constexpr uint64_t kStopEvent = UINT64_MAX;
+constexpr uint64_t kTimerEvent = UINT64_MAX - 1;
+// TCP responder sockets carry their index and accepted connections carry the responder index
+// in the high half and the connection's descriptor in the low half
+constexpr uint64_t kResponderEvent = 1ULL << 62;
+constexpr uint64_t kConnectionEvent = 1ULL << 61;
+
+bool watch(int epollfd, int fd, uint64_t data)
+{
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = data;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+}
+
+ControlLoop::~ControlLoop()
+{
+    close();
+}
+
+bool ControlLoop::open()
+{
+    _epollfd = epoll_create1(EPOLL_CLOEXEC);
+    _stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_epollfd < 0 || _stopfd < 0 || !watch(_epollfd, _stopfd, kStopEvent))
+    {
+        std::cout << "Failed to set up the control event loop: " << errno << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ControlLoop::close()
+{
+    for (const auto &listener : _listeners)
+    {
+        ::close(listener.fd);
+    }
+    _listeners.clear();
+    for (int fd : _responderFds)
+    {
+        ::close(fd);
+    }
+    _responderFds.clear();
+    for (int *fd : {&_timerfd, &_stopfd, &_epollfd})
+    {
+        if (*fd >= 0)
+        {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+bool ControlLoop::addUdpListener(const sockaddr_in &address, size_t tag)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cout << "FAIL! error creating a socket: " << errno << std::endl;
+        return false;
+    }
+    int enable = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0)
+    {
+        std::cout << "Warning: kernel receive timestamps unavailable: " << errno << std::endl;
+    }
+    if (bind(fd, (const sockaddr *)&address, sizeof(address)) < 0)
+    {
+        std::cout << "FAIL! error in bind: " << errno << std::endl;
+        ::close(fd);
+        return false;
+    }
+    if (!watch(_epollfd, fd, _listeners.size()))
+    {
+        std::cout << "FAIL! error in epoll_ctl: " << errno << std::endl;
+        ::close(fd);
+        return false;
+    }
+    _listeners.push_back(Listener{.fd = fd, .tag = tag});
+    return true;
+}
+
+bool ControlLoop::addTcpResponder(const sockaddr_in &address, std::function<std::string()> body)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cout << "FAIL! error creating a socket: " << errno << std::endl;
+        return false;
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(fd, (const sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 8) < 0)
+    {
+        std::cout << "FAIL! error in bind/listen: " << errno << std::endl;
+        ::close(fd);
+        return false;
+    }
+    if (!watch(_epollfd, fd, kResponderEvent | _responders.size()))
+    {
+        std::cout << "FAIL! error in epoll_ctl: " << errno << std::endl;
+        ::close(fd);
+        return false;
+    }
+    _responderFds.push_back(fd);
+    _responders.push_back(std::move(body));
+    return true;
+}
+
+void ControlLoop::setHousekeeping(double intervalSeconds, std::function<void()> callback)
+{
+    _onHousekeeping = std::move(callback);
+    if (_timerfd < 0)
+    {
+        _timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (_timerfd < 0 || !watch(_epollfd, _timerfd, kTimerEvent))
+        {
+            std::cout << "Failed to create the housekeeping timer: " << errno << std::endl;
+            return;
+        }
+    }
+    int64_t interval = static_cast<int64_t>(intervalSeconds * 1e9);
+    itimerspec spec{};
+    spec.it_interval.tv_sec = interval / 1000000000;
+    spec.it_interval.tv_nsec = interval % 1000000000;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(_timerfd, 0, &spec, nullptr);
+}
+
+void ControlLoop::run()
+{
+    epoll_event events[8];
+    while (true)
+    {
+        int ready = epoll_wait(_epollfd, events, 8, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cout << "Error waiting for control events: " << errno << std::endl;
+            return;
+        }
+        for (int i = 0; i < ready; ++i)
+        {
+            uint64_t data = events[i].data.u64;
+            if (data == kStopEvent)
+            {
+                return;
+            }
+            if (data == kTimerEvent)
+            {
+                uint64_t expirations;
+                if (read(_timerfd, &expirations, sizeof(expirations)) > 0 && _onHousekeeping)
+                {
+                    _onHousekeeping();
+                }
+                continue;
+            }
+            if (data & kConnectionEvent)
+            {
+                respond(static_cast<int>(data & UINT32_MAX), (data & ~kConnectionEvent) >> 32);
+                continue;
+            }
+            if (data & kResponderEvent)
+            {
+                accept(data & ~kResponderEvent);
+                continue;
+            }
+            drain(_listeners[data]);
+        }
+    }
+}
+
+void ControlLoop::stop()
+{
+    uint64_t one = 1;
+    if (write(_stopfd, &one, sizeof(one)) < 0)
+    {
+        // Nothing sensible to do here, we might be inside a signal handler
+    }
+}
+
+void ControlLoop::drain(const Listener &listener)
+{
+    while (true)
+    {
+        for (int i = 0; i < CONTROL_RECV_BATCH; ++i)
+        {
+            _iovecs[i].iov_base = _buffers[i];
+            _iovecs[i].iov_len = CONTROL_MAX_DATAGRAM;
+            memset(&_messages[i], 0, sizeof(mmsghdr));
+            _messages[i].msg_hdr.msg_name = &_remotes[i];
+            _messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            _messages[i].msg_hdr.msg_iov = &_iovecs[i];
+            _messages[i].msg_hdr.msg_iovlen = 1;
+            _messages[i].msg_hdr.msg_control = _controls[i];
+            _messages[i].msg_hdr.msg_controllen = sizeof(_controls[i]);
+        }
+
+        int received = recvmmsg(listener.fd, _messages, CONTROL_RECV_BATCH, MSG_DONTWAIT, nullptr);
+        if (received < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                std::cout << "Error receiving a control message: " << errno << std::endl;
+            }
+            return;
+        }
+
+        for (int i = 0; i < received; ++i)
+        {
+            int64_t receivedNs = 0;
+            msghdr &header = _messages[i].msg_hdr;
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                {
+                    timespec ts;
+                    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                    receivedNs = static_cast<int64_t>(ts.tv_sec) * NS_PER_SEC + ts.tv_nsec;
+                }
+            }
+            if (receivedNs == 0)
+            {
+                receivedNs = realtimeNanos();
+            }
+            if (_onDatagram)
+            {
+                _onDatagram(listener.tag, listener.fd, _buffers[i], _messages[i].msg_len, _remotes[i], receivedNs);
+            }
+        }
+
+        if (received < CONTROL_RECV_BATCH)
+        {
+            return;
+        }
+    }
+}
+
+void ControlLoop::accept(size_t responder)
+{
+    while (true)
+    {
+        int fd = accept4(_responderFds[responder], nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                std::cout << "Error accepting a connection: " << errno << std::endl;
+            }
+            return;
+        }
+        // Answer once the request arrived, closing with unread data would reset the connection
+        if (!watch(_epollfd, fd, kConnectionEvent | (static_cast<uint64_t>(responder) << 32) | static_cast<uint32_t>(fd)))
+        {
+            ::close(fd);
+        }
+    }
+}
+
+void ControlLoop::respond(int fd, size_t responder)
+{
+    // The request itself is not interpreted, every path gets the same document
+    char request[1024];
+    while (read(fd, request, sizeof(request)) > 0)
+    {
+    }
+
+    std::string body = _responders[responder]();
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t written = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // A client too slow to take a few kilobytes from a local socket is not worth waiting for
+            break;
+        }
+        sent += written;
+    }
+    ::close(fd);
+}
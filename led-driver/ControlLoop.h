@@ -0,0 +1,78 @@
+#ifndef _CONTROL_LOOP_H
+#define _CONTROL_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ControlProtocol.h"
+
+// Number of datagrams drained from a socket with one recvmmsg call
+#define CONTROL_RECV_BATCH 16
+
+// epoll based loop serving any number of UDP control listeners. Datagrams are
+// drained in batches and stamped with the kernel receive time (CLOCK_REALTIME).
+// An eventfd wakes the loop for shutdown and a timerfd drives periodic housekeeping.
+// TCP responders answer every connection with a generated text document, used for metrics.
+class ControlLoop
+{
+public:
+    // Called for every datagram; tag is the value given to addUdpListener and fd the
+    // listener's socket, which can be used to answer the remote
+    using DatagramHandler = std::function<void(size_t tag, int fd, const uint8_t *data, size_t length,
+                                               const sockaddr_in &remote, int64_t receivedNs)>;
+
+    ~ControlLoop();
+
+    bool open();
+    void close();
+
+    // Binds a non-blocking UDP socket with receive timestamps enabled
+    bool addUdpListener(const sockaddr_in &address, size_t tag);
+
+    // Listens for TCP connections and answers each request with an HTTP/1.0 text/plain
+    // response whose body is produced by the callback, then closes the connection
+    bool addTcpResponder(const sockaddr_in &address, std::function<std::string()> body);
+
+    void setDatagramHandler(DatagramHandler handler) { _onDatagram = std::move(handler); }
+    void setHousekeeping(double intervalSeconds, std::function<void()> callback);
+
+    // Runs until stop() is called
+    void run();
+
+    // Async-signal-safe, may be called from a signal handler or any thread
+    void stop();
+
+private:
+    struct Listener {
+        int fd;
+        size_t tag;
+    };
+
+    void drain(const Listener &listener);
+    void accept(size_t responder);
+    void respond(int fd, size_t responder);
+
+    int _epollfd = -1;
+    int _stopfd = -1;
+    int _timerfd = -1;
+    std::vector<Listener> _listeners;
+    std::vector<int> _responderFds;
+    std::vector<std::function<std::string()>> _responders;
+
+    DatagramHandler _onDatagram;
+    std::function<void()> _onHousekeeping;
+
+    // Receive buffers for one recvmmsg batch, allocated once
+    uint8_t _buffers[CONTROL_RECV_BATCH][CONTROL_MAX_DATAGRAM];
+    uint8_t _controls[CONTROL_RECV_BATCH][CMSG_SPACE(sizeof(timespec))];
+    sockaddr_in _remotes[CONTROL_RECV_BATCH];
+    iovec _iovecs[CONTROL_RECV_BATCH];
+    mmsghdr _messages[CONTROL_RECV_BATCH];
+};
+
+#endif // _CONTROL_LOOP_H
@@ -0,0 +1,261 @@
+#include "ControlProtocol.h"
+
+#include <cstring>
+
+namespace
+{
+inline uint16_t readU16(const uint8_t *data)
+{
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+inline float readF32(const uint8_t *data)
+{
+    uint32_t bits = (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+                    (static_cast<uint32_t>(data[2]) << 8) | static_cast<uint32_t>(data[3]);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline bool isValidStage(long stage)
+{
+    return stage >= AnimStage::kDark && stage <= AnimStage::kFade;
+}
+
+inline color_t readColor(const uint8_t *data)
+{
+    return color_t{
+        .r = readU16(data),
+        .g = readU16(data + 2),
+        .b = readU16(data + 4),
+        .w = readU16(data + 6)};
+}
+
+ControlParseResult parseBinary(const uint8_t *data, size_t length, LedCommand *commands, size_t capacity, size_t &commandCount)
+{
+    if (length < CONTROL_HEADER_SIZE)
+    {
+        return ControlParseResult::kMalformed;
+    }
+    if (data[CONTROL_MAGIC_SIZE] != CONTROL_PROTOCOL_VERSION)
+    {
+        return ControlParseResult::kUnsupportedVersion;
+    }
+    size_t count = data[CONTROL_MAGIC_SIZE + 1];
+    if (count > CONTROL_MAX_COMMANDS || count > capacity)
+    {
+        return ControlParseResult::kTooManyCommands;
+    }
+
+    ControlParseResult result = ControlParseResult::kOk;
+    size_t offset = CONTROL_HEADER_SIZE;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (offset + CONTROL_COMMAND_HEADER_SIZE > length)
+        {
+            return ControlParseResult::kMalformed;
+        }
+        ControlOpcode opcode = static_cast<ControlOpcode>(data[offset]);
+        size_t payloadLength = data[offset + 1];
+        const uint8_t *payload = data + offset + CONTROL_COMMAND_HEADER_SIZE;
+        offset += CONTROL_COMMAND_HEADER_SIZE + payloadLength;
+        if (offset > length)
+        {
+            return ControlParseResult::kMalformed;
+        }
+
+        // Longer payloads than expected are allowed, so new fields can be appended later
+        LedCommand command{};
+        bool valid = false;
+        switch (opcode)
+        {
+        case ControlOpcode::kAdvanceStage:
+        case ControlOpcode::kAdvanceStagePulsing:
+            valid = payloadLength >= 1 && isValidStage(payload[0]);
+            command.type = opcode == ControlOpcode::kAdvanceStage ? CommandType::kAdvanceStage : CommandType::kAdvanceStagePulsing;
+            command.stage = static_cast<AnimStage>(payload[0]);
+            break;
+        case ControlOpcode::kPalette:
+            valid = payloadLength >= 3 * sizeof(color_t);
+            command.type = CommandType::kSetPalette;
+            if (valid)
+            {
+                command.primary = readColor(payload);
+                command.secondary = readColor(payload + sizeof(color_t));
+                command.fill = readColor(payload + 2 * sizeof(color_t));
+            }
+            break;
+        case ControlOpcode::kSetPulsing:
+            valid = payloadLength >= 1;
+            command.type = CommandType::kSetPulsing;
+            command.pulsing = valid && payload[0] != 0;
+            break;
+        case ControlOpcode::kSetParameter:
+            valid = payloadLength >= 5 && payload[0] < static_cast<uint8_t>(ControlParameter::kCount);
+            command.type = CommandType::kSetParameter;
+            if (valid)
+            {
+                command.parameter = static_cast<ControlParameter>(payload[0]);
+                command.value = readF32(payload + 1);
+                valid = validParameterValue(command.parameter, command.value);
+            }
+            break;
+        case ControlOpcode::kQueryLatency:
+            valid = true;
+            command.type = CommandType::kQueryLatency;
+            break;
+        default:
+            result = ControlParseResult::kUnknownCommand;
+            continue;
+        }
+
+        if (valid)
+        {
+            commands[commandCount++] = command;
+        }
+        else
+        {
+            result = ControlParseResult::kMalformed;
+        }
+    }
+    return result;
+}
+
+const char *skipSpaces(const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n'))
+    {
+        ++pos;
+    }
+    return pos;
+}
+
+bool tokenEquals(const char *begin, const char *end, const char *literal)
+{
+    size_t length = strlen(literal);
+    return static_cast<size_t>(end - begin) == length && memcmp(begin, literal, length) == 0;
+}
+
+bool parseInteger(const char *&pos, const char *end, long &value)
+{
+    pos = skipSpaces(pos, end);
+    bool negative = pos < end && *pos == '-';
+    if (negative || (pos < end && *pos == '+'))
+    {
+        ++pos;
+    }
+    if (pos >= end || *pos < '0' || *pos > '9')
+    {
+        return false;
+    }
+    value = 0;
+    while (pos < end && *pos >= '0' && *pos <= '9' && value < 1000000)
+    {
+        value = value * 10 + (*pos - '0');
+        ++pos;
+    }
+    if (negative)
+    {
+        value = -value;
+    }
+    return true;
+}
+
+bool parseTextColor(const char *&pos, const char *end, color_t &color)
+{
+    long r, g, b, w;
+    if (!parseInteger(pos, end, r) || !parseInteger(pos, end, g) || !parseInteger(pos, end, b) || !parseInteger(pos, end, w))
+    {
+        return false;
+    }
+    color = color_t{
+        .r = static_cast<uint8_t>(r),
+        .g = static_cast<uint8_t>(g),
+        .b = static_cast<uint8_t>(b),
+        .w = static_cast<uint8_t>(w)};
+    return true;
+}
+
+// The original text protocol: one command per datagram, "<Command> <arguments>"
+ControlParseResult parseText(const char *text, size_t length, LedCommand *commands, size_t capacity, size_t &commandCount)
+{
+    // Senders may or may not include the terminating zero
+    const char *end = static_cast<const char *>(memchr(text, '\0', length));
+    if (!end)
+    {
+        end = text + length;
+    }
+    const char *cmdBegin = skipSpaces(text, end);
+    const char *cmdEnd = cmdBegin;
+    while (cmdEnd < end && *cmdEnd != ' ')
+    {
+        ++cmdEnd;
+    }
+    const char *pos = cmdEnd;
+    if (capacity == 0)
+    {
+        return ControlParseResult::kTooManyCommands;
+    }
+
+    LedCommand command{};
+    if (tokenEquals(cmdBegin, cmdEnd, "AdvanceStage") || tokenEquals(cmdBegin, cmdEnd, "AdvanceStagePulsing"))
+    {
+        long stage;
+        if (!parseInteger(pos, end, stage) || !isValidStage(stage))
+        {
+            return ControlParseResult::kMalformed;
+        }
+        command.type = tokenEquals(cmdBegin, cmdEnd, "AdvanceStage") ? CommandType::kAdvanceStage : CommandType::kAdvanceStagePulsing;
+        command.stage = static_cast<AnimStage>(stage);
+    }
+    else if (tokenEquals(cmdBegin, cmdEnd, "Palette"))
+    {
+        command.type = CommandType::kSetPalette;
+        if (!parseTextColor(pos, end, command.primary) || !parseTextColor(pos, end, command.secondary) ||
+            !parseTextColor(pos, end, command.fill))
+        {
+            return ControlParseResult::kMalformed;
+        }
+    }
+    else if (tokenEquals(cmdBegin, cmdEnd, "QueryLatency"))
+    {
+        command.type = CommandType::kQueryLatency;
+    }
+    else
+    {
+        return ControlParseResult::kUnknownCommand;
+    }
+    commands[commandCount++] = command;
+    return ControlParseResult::kOk;
+}
+}
+
+ControlParseResult parseControlMessage(const uint8_t *data, size_t length,
+                                       LedCommand *commands, size_t capacity, size_t &commandCount)
+{
+    commandCount = 0;
+    if (length >= CONTROL_MAGIC_SIZE && memcmp(data, CONTROL_MAGIC, CONTROL_MAGIC_SIZE) == 0)
+    {
+        return parseBinary(data, length, commands, capacity, commandCount);
+    }
+    return parseText(reinterpret_cast<const char *>(data), length, commands, capacity, commandCount);
+}
+
+const char *controlParseResultName(ControlParseResult result)
+{
+    switch (result)
+    {
+    case ControlParseResult::kOk:
+        return "ok";
+    case ControlParseResult::kMalformed:
+        return "malformed";
+    case ControlParseResult::kUnsupportedVersion:
+        return "unsupported version";
+    case ControlParseResult::kUnknownCommand:
+        return "unknown command";
+    case ControlParseResult::kTooManyCommands:
+        return "too many commands";
+    }
+    return "unknown";
+}
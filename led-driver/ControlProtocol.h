@@ -0,0 +1,59 @@
+#ifndef _CONTROL_PROTOCOL_H
+#define _CONTROL_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "LedDriver.h"
+
+// Binary control datagrams start with this magic, text commands never do
+#define CONTROL_MAGIC "LEDC"
+#define CONTROL_MAGIC_SIZE 4
+
+#define CONTROL_PROTOCOL_VERSION 1
+
+// magic[4], version u8, command count u8, reserved u16
+#define CONTROL_HEADER_SIZE 8
+
+// Every command starts with type u8 and payload length u8, followed by the payload.
+// Multi-byte fields are big-endian.
+#define CONTROL_COMMAND_HEADER_SIZE 2
+
+// The most commands a single datagram may carry
+#define CONTROL_MAX_COMMANDS 64
+
+// The largest datagram accepted on the control socket
+#define CONTROL_MAX_DATAGRAM 1472
+
+enum class ControlOpcode : uint8_t {
+    // stage u8
+    kAdvanceStage = 0x01,
+    // stage u8
+    kAdvanceStagePulsing = 0x02,
+    // primary, secondary and fill, each as r, g, b, w u16 display values from 0 to 255
+    kPalette = 0x03,
+    // pulsing u8
+    kSetPulsing = 0x04,
+    // parameter u8, value as IEEE 754 float32
+    kSetParameter = 0x05,
+    // no payload, answered with a text latency report
+    kQueryLatency = 0x06,
+};
+
+enum class ControlParseResult {
+    kOk = 0,
+    kMalformed,
+    kUnsupportedVersion,
+    kUnknownCommand,
+    kTooManyCommands,
+};
+
+// Parses one control datagram, binary or text, into commands without allocating.
+// Returns kOk when every command was understood; commandCount holds the number of valid
+// commands written to the array either way, so a bad command does not drop its neighbours.
+ControlParseResult parseControlMessage(const uint8_t *data, size_t length,
+                                       LedCommand *commands, size_t capacity, size_t &commandCount);
+
+const char *controlParseResultName(ControlParseResult result);
+
+#endif // _CONTROL_PROTOCOL_H
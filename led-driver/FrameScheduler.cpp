@@ -0,0 +1,232 @@
+#include "FrameScheduler.h"
+#include "Clock.h"
+
+#include <cerrno>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace
+{
+constexpr int64_t kNsPerSec = NS_PER_SEC;
+
+inline void sleepUntil(int64_t deadline)
+{
+    timespec ts{
+        .tv_sec = static_cast<time_t>(deadline / kNsPerSec),
+        .tv_nsec = static_cast<long>(deadline % kNsPerSec)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+    {
+    }
+}
+
+// Sleeps until the deadline or until the eventfd is signalled, returns true in the latter case
+inline bool sleepUntilWoken(int64_t deadline, int wakefd)
+{
+    pollfd descriptor{.fd = wakefd, .events = POLLIN, .revents = 0};
+    while (true)
+    {
+        int64_t remaining = deadline - monotonicNanos();
+        if (remaining <= 0)
+        {
+            return false;
+        }
+        timespec ts{
+            .tv_sec = static_cast<time_t>(remaining / kNsPerSec),
+            .tv_nsec = static_cast<long>(remaining % kNsPerSec)};
+        int ready = ppoll(&descriptor, 1, &ts, nullptr);
+        if (ready > 0)
+        {
+            uint64_t count;
+            (void)read(wakefd, &count, sizeof(count));
+            return true;
+        }
+        if (ready == 0 || errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+int64_t periodOf(double frameRate)
+{
+    return static_cast<int64_t>(kNsPerSec / frameRate);
+}
+}
+
+FrameScheduler::FrameScheduler()
+{
+    _periods.fill(periodOf(_frameRate));
+    _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+FrameScheduler::~FrameScheduler()
+{
+    if (_wakefd >= 0)
+    {
+        close(_wakefd);
+    }
+}
+
+void FrameScheduler::applyConfig(const libconfig::Config &config)
+{
+    double frameRate = _frameRate;
+    config.lookupValue("render.frame_rate", frameRate);
+    if (frameRate > 0.0)
+    {
+        _frameRate = frameRate;
+    }
+    else
+    {
+        std::cout << "Invalid render.frame_rate " << frameRate << ", keeping " << _frameRate << std::endl;
+    }
+    double activeRate = _frameRate;
+    double idleRate = 0.0;
+    config.lookupValue("render.active_frame_rate", activeRate);
+    config.lookupValue("render.idle_frame_rate", idleRate);
+    if (!(activeRate > 0.0) || idleRate < 0.0)
+    {
+        std::cout << "Invalid render.active_frame_rate or idle_frame_rate, using frame_rate for both." << std::endl;
+        activeRate = _frameRate;
+        idleRate = 0.0;
+    }
+    if (std::max(_frameRate, activeRate) > 44.0)
+    {
+        std::cout << "Warning: render frame rates above " << 44.0 << " Hz exceed the DMX refresh limit." << std::endl;
+    }
+    _periods[static_cast<size_t>(FrameRate::kNormal)] = periodOf(_frameRate);
+    _periods[static_cast<size_t>(FrameRate::kActive)] = periodOf(activeRate);
+    _periods[static_cast<size_t>(FrameRate::kIdle)] = idleRate > 0.0 ? periodOf(idleRate) : periodOf(_frameRate);
+
+    std::string policy;
+    if (config.lookupValue("render.overrun_policy", policy))
+    {
+        if (policy == "catchup")
+        {
+            _policy = OverrunPolicy::kCatchUp;
+        }
+        else if (policy == "skip")
+        {
+            _policy = OverrunPolicy::kSkip;
+        }
+        else
+        {
+            std::cout << "Unknown render.overrun_policy \"" << policy << "\", using skip." << std::endl;
+            _policy = OverrunPolicy::kSkip;
+        }
+    }
+
+    config.lookupValue("render.max_catchup_frames", _maxCatchUpFrames);
+    config.lookupValue("render.stats_interval", _statsInterval);
+}
+
+void FrameScheduler::start()
+{
+    int64_t now = monotonicNanos();
+    _deadline = now;
+    _lastFrameStart = now;
+    _lastReport = now;
+}
+
+void FrameScheduler::setRate(FrameRate rate)
+{
+    _rate = rate;
+    _idle.store(rate == FrameRate::kIdle && _wakefd >= 0, std::memory_order_relaxed);
+}
+
+void FrameScheduler::wake()
+{
+    if (_idle.load(std::memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        (void)write(_wakefd, &one, sizeof(one));
+    }
+}
+
+float FrameScheduler::waitNextFrame()
+{
+    const int64_t period = _periods[static_cast<size_t>(_rate)];
+    const int64_t previous = _deadline;
+    _deadline += period;
+
+    int64_t now = monotonicNanos();
+    if (now > _deadline)
+    {
+        ++_overruns;
+        ++_metrics.overruns;
+        int64_t behind = (now - _deadline) / period;
+        if (_policy == OverrunPolicy::kSkip)
+        {
+            // Realign to the next deadline still in the future and fold the dropped frames into this step
+            _deadline += (behind + 1) * period;
+            _skippedFrames += behind + 1;
+            _metrics.skippedFrames += behind + 1;
+        }
+        else if (behind >= _maxCatchUpFrames)
+        {
+            // Too far behind to catch up without a visible burst, resynchronize instead
+            _deadline += behind * period;
+            _skippedFrames += behind;
+            _metrics.skippedFrames += behind;
+        }
+    }
+
+    bool woken = false;
+    if (_idle.load(std::memory_order_relaxed))
+    {
+        woken = sleepUntilWoken(_deadline, _wakefd);
+        ++_metrics.idleFrames;
+    }
+    else
+    {
+        sleepUntil(_deadline);
+    }
+
+    now = monotonicNanos();
+    if (woken)
+    {
+        // The schedule continues from the early frame
+        _deadline = std::min(now, _deadline);
+        ++_metrics.wakeups;
+    }
+    else
+    {
+        uint64_t lateness = static_cast<uint64_t>(now > _deadline ? now - _deadline : 0);
+        uint64_t jitter = static_cast<uint64_t>(std::llabs(now - _lastFrameStart - period));
+        _lateness.record(lateness);
+        _jitter.record(jitter);
+        _metrics.lateness.record(lateness);
+        _metrics.jitter.record(jitter);
+    }
+    _lastFrameStart = now;
+    ++_frames;
+    ++_metrics.frames;
+
+    if (_statsInterval > 0.0 && now - _lastReport >= static_cast<int64_t>(_statsInterval * kNsPerSec))
+    {
+        reportStats(now);
+    }
+
+    return static_cast<float>(static_cast<double>(_deadline - previous) / kNsPerSec);
+}
+
+void FrameScheduler::reportStats(int64_t now)
+{
+    std::cout << "Frame timing: " << _frames << " frames at " << _frameRate << " Hz, "
+              << _overruns << " overruns, " << _skippedFrames << " skipped" << std::endl;
+    std::cout << "\tLateness us p50/p99/max: " << _lateness.percentile(50) / 1000 << " / "
+              << _lateness.percentile(99) / 1000 << " / " << _lateness.max() / 1000 << std::endl;
+    std::cout << "\tJitter us p50/p99/max: " << _jitter.percentile(50) / 1000 << " / "
+              << _jitter.percentile(99) / 1000 << " / " << _jitter.max() / 1000 << std::endl;
+
+    _frames = 0;
+    _overruns = 0;
+    _skippedFrames = 0;
+    _lateness.reset();
+    _jitter.reset();
+    _lastReport = now;
+}
@@ -0,0 +1,95 @@
+#ifndef _FRAME_SCHEDULER_H
+#define _FRAME_SCHEDULER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <array>
+#include <atomic>
+#include <libconfig.h++>
+
+#include "Histogram.h"
+
+enum class OverrunPolicy {
+    // Run the missed frames back to back until the schedule is met again
+    kCatchUp = 0,
+    // Drop the missed frames and simulate their time in the next one
+    kSkip = 1,
+};
+
+// How fast the rings need frames, the render loop runs at the fastest any ring asks for
+enum class FrameRate {
+    // Nothing changes, only keep the nodes from timing out
+    kIdle = 0,
+    kNormal = 1,
+    // Fast moving stages
+    kActive = 2,
+};
+
+#define FRAME_RATE_COUNT 3
+
+// Paces the render loop on absolute CLOCK_MONOTONIC deadlines, so the
+// schedule never drifts regardless of how long a single frame takes.
+// The period follows the requested rate from the next frame on. Idle frames
+// can be cut short by wake(), so a command never waits for a keepalive tick.
+class FrameScheduler
+{
+public:
+    FrameScheduler();
+    ~FrameScheduler();
+
+    // Reads render.frame_rate, active_frame_rate, idle_frame_rate (0 keeps the normal rate
+    // when idle), overrun_policy, max_catchup_frames and stats_interval
+    void applyConfig(const libconfig::Config &config);
+
+    void start();
+
+    // Blocks until the next frame deadline and returns the simulation step in seconds.
+    float waitNextFrame();
+
+    // Render thread: the rate of the following frames
+    void setRate(FrameRate rate);
+    // Ends a wait for an idle frame now, safe from any thread
+    void wake();
+
+    double getFrameRate() const { return _frameRate; }
+
+    // Totals since start, safe to read from any thread
+    struct Metrics {
+        RelaxedCounter frames;
+        RelaxedCounter overruns;
+        RelaxedCounter skippedFrames;
+        RelaxedCounter idleFrames;
+        // Idle frames started early by wake()
+        RelaxedCounter wakeups;
+        AtomicHistogram lateness;
+        AtomicHistogram jitter;
+    };
+    const Metrics &getMetrics() const { return _metrics; }
+
+private:
+    void reportStats(int64_t now);
+
+    double _frameRate = 30.0;
+    std::array<int64_t, FRAME_RATE_COUNT> _periods;
+    FrameRate _rate = FrameRate::kNormal;
+    // Set while the next wait may be woken, so wake() only costs a syscall when it matters
+    std::atomic<bool> _idle{false};
+    int _wakefd = -1;
+    OverrunPolicy _policy = OverrunPolicy::kSkip;
+    // Catch-up gives up and resynchronizes when this many frames behind
+    int _maxCatchUpFrames = 5;
+    double _statsInterval = 60.0;
+
+    int64_t _deadline = 0;
+    int64_t _lastFrameStart = 0;
+    int64_t _lastReport = 0;
+
+    uint64_t _frames = 0;
+    uint64_t _overruns = 0;
+    uint64_t _skippedFrames = 0;
+    Histogram _lateness;
+    Histogram _jitter;
+    Metrics _metrics;
+};
+
+#endif // _FRAME_SCHEDULER_H
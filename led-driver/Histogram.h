@@ -0,0 +1,133 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+// Counter for data written by a single thread and read by any number of others.
+// Updates are plain relaxed stores, so the writer never pays for an atomic read-modify-write.
+class RelaxedCounter
+{
+public:
+    RelaxedCounter(uint64_t value = 0) : _value(value) {}
+    RelaxedCounter(const RelaxedCounter &other) : _value(other.load()) {}
+
+    RelaxedCounter &operator=(uint64_t value)
+    {
+        _value.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+    RelaxedCounter &operator+=(uint64_t value)
+    {
+        _value.store(load() + value, std::memory_order_relaxed);
+        return *this;
+    }
+    RelaxedCounter &operator++() { return *this += 1; }
+
+    uint64_t load() const { return _value.load(std::memory_order_relaxed); }
+    operator uint64_t() const { return load(); }
+
+private:
+    std::atomic<uint64_t> _value;
+};
+
+// Log-linear histogram of unsigned 64-bit samples (typically nanoseconds).
+// Every power of two is split into 8 linear sub-buckets, so any reported
+// percentile is within 12.5% of the real value. Recording is O(1) and never allocates.
+// With RelaxedCounter as the counter type other threads can read it while one thread records.
+template <typename Counter>
+class BasicHistogram
+{
+public:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kBucketCount = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    void record(uint64_t value)
+    {
+        ++_buckets[bucketIndex(value)];
+        ++_count;
+        _sum += value;
+        _max = std::max<uint64_t>(_max, value);
+    }
+
+    void reset()
+    {
+        for (auto &bucket : _buckets)
+        {
+            bucket = 0;
+        }
+        _count = 0;
+        _sum = 0;
+        _max = 0;
+    }
+
+    uint64_t count() const { return _count; }
+    uint64_t max() const { return _max; }
+    uint64_t sum() const { return _sum; }
+    uint64_t mean() const
+    {
+        uint64_t count = _count;
+        return count ? _sum / count : 0;
+    }
+
+    // Returns the upper bound of the bucket containing the given percentile (0-100).
+    uint64_t percentile(double p) const
+    {
+        uint64_t count = _count;
+        if (count == 0)
+        {
+            return 0;
+        }
+        uint64_t target = static_cast<uint64_t>(p / 100.0 * count);
+        if (target >= count)
+        {
+            target = count - 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < kBucketCount; ++i)
+        {
+            seen += _buckets[i];
+            if (seen > target)
+            {
+                return std::min<uint64_t>(bucketUpperBound(i), _max);
+            }
+        }
+        return _max;
+    }
+
+    static int bucketIndex(uint64_t value)
+    {
+        if (value < kSubBuckets)
+        {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + static_cast<int>((value >> shift) & (kSubBuckets - 1));
+    }
+
+    static uint64_t bucketUpperBound(int index)
+    {
+        if (index < kSubBuckets)
+        {
+            return static_cast<uint64_t>(index);
+        }
+        int shift = index / kSubBuckets - 1;
+        uint64_t lower = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    std::array<Counter, kBucketCount> _buckets{};
+    Counter _count = 0;
+    Counter _sum = 0;
+    Counter _max = 0;
+};
+
+using Histogram = BasicHistogram<uint64_t>;
+using AtomicHistogram = BasicHistogram<RelaxedCounter>;
+
+#endif // _HISTOGRAM_H
@@ -5,11 +5,20 @@
 
 typedef uint16_t color_data_t;
 
-struct color_t {
+// Full scale of a color channel, the ring holds linear light at 16 bits
+#define COLOR_DATA_MAX 0xFFFF
+
+// One step of an 8-bit configuration value in ring units, 255 steps make full scale
+#define COLOR_DATA_STEP 257
+
+// Padded and aligned so that vector kernels can process whole RGBW quads
+struct alignas(8) color_t {
     color_data_t r;
     color_data_t g;
     color_data_t b;
     color_data_t w;
 };
 
+static_assert(sizeof(color_t) == 4 * sizeof(color_data_t), "color_t must be a tightly packed RGBW quad");
+
 #endif //_LEDDEFS_H
\ No newline at end of file
@@ -1,46 +1,41 @@
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include "LedDriver.h"
 #include "ArtNet.h"
 #include "LedDefs.h"
+#include "LedKernels.h"
+#include "Clock.h"
 
-#ifdef CONTROL_ARTNET
-#include <arpa/inet.h>
-#include <unistd.h>
-#endif // CONTROL_ARTNET
-
-inline uint32_t RGBW(const color_t &color)
+void LedDriver::drawFill(size_t layer, float fillRatio, const color_t &color)
 {
-    return (static_cast<uint32_t>(color.r) << 24) +
-           (static_cast<uint32_t>(color.g) << 16) +
-           (static_cast<uint32_t>(color.b) << 8) +
-           static_cast<uint32_t>(color.w);
-}
-
-void LedDriver::drawFill(float fillRatio, const color_t &color)
-{
-    if (_pulsing)
+    if (!_drawing)
     {
-        fillRatio = fillRatio * _pulseValue;
+        return;
     }
-    for (auto &led : _ledsRing)
+    if (_pulsing)
     {
-        led.r = std::max(led.r, static_cast<color_data_t>(color.r * fillRatio));
-        led.g = std::max(led.g, static_cast<color_data_t>(color.g * fillRatio));
-        led.b = std::max(led.b, static_cast<color_data_t>(color.b * fillRatio));
-        led.w = std::max(led.w, static_cast<color_data_t>(color.w * fillRatio));
+        fillRatio = fillRatio * _pulseValue;
     }
+    maxFill(_compositor.layer(layer), _ledsRing.size(), color, fillRatio);
+    _compositor.touch(layer, 0, _ledsRing.size());
 }
 
-void LedDriver::dimLeds(float multiplier, color_data_t addition)
+void LedDriver::dimLeds(int layer, float multiplier, color_data_t addition)
 {
-    for (int i = 0; i < _ledsRing.size(); ++i)
+    if (!_drawing)
     {
-        _ledsRing[i].r = static_cast<color_data_t>(_ledsRing[i].r * multiplier) + addition;
-        _ledsRing[i].g = static_cast<color_data_t>(_ledsRing[i].g * multiplier) + addition;
-        _ledsRing[i].b = static_cast<color_data_t>(_ledsRing[i].b * multiplier) + addition;
-        _ledsRing[i].w = static_cast<color_data_t>(_ledsRing[i].w * multiplier) + addition;
+        return;
+    }
+    if (layer >= 0)
+    {
+        _compositor.dim(layer, multiplier, addition);
+        return;
+    }
+    for (size_t i = 0; i < _compositor.layerCount(); ++i)
+    {
+        _compositor.dim(i, multiplier, addition);
     }
 }
 
@@ -49,36 +44,6 @@ inline float LedDriver::partialLedFromAngle(float angle)
     return _ledsRing.size() / 360.0f * angle;
 }
 
-#ifdef CONTROL_ARTNET
-void LedDriver::sendArtNet()
-{
-    uint8_t buffer[ARTNET_FULL_PACKET_SIZE];
-
-    constructArtNetPacket(buffer, &_ledsRing[0], (_ledCountStart - _ledPaddingStart), 0, 0);
-    ssize_t sent = sendto(_sockfd, buffer, ARTNET_FULL_PACKET_SIZE, 0, (struct sockaddr *)&_remote, sizeof(_remote));
-    if (sent < 0) goto error;
-
-    constructArtNetPacket(buffer, &_ledsRing[0], (_ledCountStart - _ledPaddingStart), 1, 0);
-    sent = sendto(_sockfd, buffer, ARTNET_FULL_PACKET_SIZE, 0, (struct sockaddr *)&_remote, sizeof(_remote));
-    if (sent < 0) goto error;
-
-    constructArtNetPacket(buffer, &_ledsRing[_ledsRing.size() - _ledCountEnd], -(_ledCountEnd - _ledPaddingEnd), 2, 0);
-    sent = sendto(_sockfd, buffer, ARTNET_FULL_PACKET_SIZE, 0, (struct sockaddr *)&_remote, sizeof(_remote));
-    if (sent < 0) goto error;
-
-    constructArtNetPacket(buffer, &_ledsRing[_ledsRing.size() - _ledCountEnd], -(_ledCountEnd - _ledPaddingEnd), 3, 0);
-    sent = sendto(_sockfd, buffer, ARTNET_FULL_PACKET_SIZE, 0, (struct sockaddr *)&_remote, sizeof(_remote));
-    if (sent < 0) goto error;
-
-    goto success;
-
-error:
-    std::cout << "Failed to send ArtNet packet! Error: " << errno << std::endl;
-success:
-    return;
-}
-#endif // CONTROL_ARTNET
-
 LedDriver::LedDriver()
 {
     _primary =
@@ -96,77 +61,324 @@ LedDriver::LedDriver()
          .g = 250,
          .b = 50,
          .w = 255};
-#ifdef RENDER_DEBUG
-    _ledsRing.resize(10);
+    updatePalette();
+    _bakeCache.setChannel(&_bakeChannel);
+    // Without a config the driver sends the original layout to a local controller
+    _sinks.emplace_back(ArtNetSink());
+    _ledsRing.resize(std::get<ArtNetSink>(_sinks[0]).ledCount());
+}
+
+void LedDriver::finalize()
+{
+    // A sink that fails to open stays in place and drops its frames
+    openOutputs();
+    prepareFrame();
+    enterStage(AnimStage::kDark);
+    _finalized.store(true, std::memory_order_release);
+}
+
+static bool ownsHardware(const OutputSink &sink)
+{
+#ifdef LED_DRIVER_WS281X
+    return std::holds_alternative<Ws281xSink>(sink);
 #else
-#ifdef CONTROL_ARTNET
-    _ledsRing.resize(_ledCountStart + _ledCountEnd);
+    return false;
+#endif // LED_DRIVER_WS281X
+}
+
+bool LedDriver::openOutputs(bool exclusive)
+{
+    bool opened = true;
+    for (auto &sink : _sinks)
+    {
+        if (!exclusive && ownsHardware(sink))
+        {
+            continue;
+        }
+        ArtNetSink *artNet = std::get_if<ArtNetSink>(&sink);
+        if (!exclusive && artNet)
+        {
+            // Opening truncates the file, which the running output may still be writing
+            artNet->deferCapture();
+        }
+        opened = std::visit([this](auto &output) { return output.open(_ledsRing.size()); }, sink) && opened;
+    }
+    return opened;
+}
+
+void LedDriver::closeOutputs(bool terminateStreams)
+{
+    for (auto &sink : _sinks)
+    {
+        SacnSink *sacn = std::get_if<SacnSink>(&sink);
+        if (sacn && !terminateStreams)
+        {
+            sacn->detach();
+            continue;
+        }
+        std::visit([](auto &output) { output.close(); }, sink);
+    }
+}
 
-    _remote.sin_addr.s_addr = inet_addr(_remoteAddress.c_str());
-    _remote.sin_port = htons(ARTNET_PORT);
-    _remote.sin_family = AF_INET;
-#endif // CONTROL_ARTNET
-#endif
+void LedDriver::prepareFrame()
+{
+    prepareOutputs();
+    _compositor.configure(_timeline.layers(), _ledsRing.size());
+    _bakeCache.load(_compositor.size());
 }
 
-void LedDriver::finalize()
+bool LedDriver::prepareReload(const libconfig::Setting &config)
 {
-#ifndef RENDER_DEBUG
-#ifdef CONTROL_ARTNET
-    _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (_sockfd < 0)
+    cancelReload();
+    _staged = std::make_unique<LedDriver>();
+    if (!_staged->applyConfig(config))
     {
-        std::cerr << "Failed to create network socket to send ArtNet packets." << std::endl;
-        return;
+        // Unlike at startup nothing is applied, the running configuration stays as it is
+        std::cout << "The new settings have errors." << std::endl;
+        cancelReload();
+        return false;
+    }
+    _staged->setArtNetDiscovery(_artNetDiscovery);
+    // A second ws2811_init on the running GPIO and DMA channel would take the hardware from
+    // under the live output, those sinks are handed over by the sender at the switch
+    if (!_staged->openOutputs(false))
+    {
+        cancelReload();
+        return false;
+    }
+    _staged->prepareFrame();
+    return true;
+}
+
+void LedDriver::commitReload()
+{
+    _reloadCommitted = true;
+    _reloadSwitched.store(false, std::memory_order_relaxed);
+    _reloadRequest.store(_staged.get(), std::memory_order_release);
+}
+
+void LedDriver::cancelReload()
+{
+    if (_staged)
+    {
+        _staged->closeOutputs(false);
+        _staged.reset();
+    }
+    _reloadCommitted = false;
+}
+
+bool LedDriver::reloadSettled()
+{
+    if (!_reloadCommitted)
+    {
+        return true;
+    }
+    if (!_reloadSwitched.load(std::memory_order_acquire))
+    {
+        return false;
     }
-#endif // CONTROL_ARTNET
-#endif // RENDER_DEBUG
-    initDark();
+    // The staged driver now holds the replaced state
+    cancelReload();
+    return true;
 }
 
-void LedDriver::advanceStage(AnimStage stage, bool force)
+void LedDriver::writeBakes()
 {
-    std::lock_guard<std::mutex> guard(_stageMtx);
+    serviceBakes(_bakeChannel);
+}
 
-    if (!force && stage <= _stageData->forStage() && !_configuration.allow_lower_stage_advance)
+void LedDriver::adoptReload()
+{
+    LedDriver *staged = _reloadRequest.exchange(nullptr, std::memory_order_acquire);
+    if (!staged)
     {
-        std::cout << "Ignoring switch to a lower stage." << std::endl;
         return;
     }
+    _bakeCache.end();
+    std::swap(_configuration, staged->_configuration);
+    std::swap(_activeStages, staged->_activeStages);
+    std::swap(_idleAfter, staged->_idleAfter);
+    std::swap(_primary, staged->_primary);
+    std::swap(_secondary, staged->_secondary);
+    std::swap(_fill, staged->_fill);
+    std::swap(_palette, staged->_palette);
+    std::swap(_timeline, staged->_timeline);
+    std::swap(_compositor, staged->_compositor);
+    std::swap(_bakeCache, staged->_bakeCache);
+    // The queue stays with this driver, which the control thread empties
+    _bakeCache.setChannel(&_bakeChannel);
+    std::swap(_colorCurve, staged->_colorCurve);
+    std::swap(_ledsRing, staged->_ledsRing);
+    std::swap(_ledsLast, staged->_ledsLast);
+    std::swap(_wideOutput, staged->_wideOutput);
+    // The outputs belong to the sender, it switches them on the first frame of the new layout it takes
+    ++_layout;
+    _pendingReload = staged;
+
+    // The stage restarts from its current state with the new program, which may use other layers
+    enterStage(_stagePending ? nextStage().stage : currentStageType());
+    std::cout << "Switched to the reloaded configuration." << std::endl;
+}
+
+void LedDriver::setArtNetDiscovery(const ArtNetDiscovery *discovery)
+{
+    _artNetDiscovery = discovery;
+    for (auto &sink : _sinks)
+    {
+        if (ArtNetSink *artNet = std::get_if<ArtNetSink>(&sink))
+        {
+            artNet->setDiscovery(discovery);
+        }
+    }
+}
 
-    switch (stage)
+void LedDriver::prepareOutputs()
+{
+    bool wide = false;
+    for (const auto &sink : _sinks)
     {
-    case AnimStage::kDark:
-        initDark();
-        break;
-    case AnimStage::kStarting:
-        initStarting();
-        break;
-    case AnimStage::kIdle:
-        initIdle();
-        break;
-    case AnimStage::kWindup:
-        initWindup();
-        break;
-    case AnimStage::kExplosion:
-        initExplosion();
-        break;
-    case AnimStage::kFade:
-        initFade();
-        break;
+        wide = wide || std::visit([](const auto &output) { return output.depth() == 16; }, sink);
+    }
+    _wideOutput = wide;
+    for (auto &frame : _frames.slots())
+    {
+        frame.narrow.assign(_ledsRing.size(), color_t{});
+        frame.wide.assign(wide ? _ledsRing.size() : 0, color_t{});
+    }
+    _ledsLast.assign(_ledsRing.size(), color_t{});
+    _colorCurve.resize(_ledsRing.size());
+}
+
+bool LedDriver::postCommand(const LedCommand &command)
+{
+    return _commands.push(command);
+}
+
+void LedDriver::applyCommands()
+{
+    LedCommand command;
+    while (_commands.pop(command))
+    {
+        switch (command.type)
+        {
+        case CommandType::kAdvanceStage:
+            if (_pulsing)
+            {
+                std::cout << "Ignoring non-pulsing state change until the pulsing cycle finishes." << std::endl;
+                ++_metrics.ignoredCommands;
+                break;
+            }
+            if (!advanceStage(command.stage, false, command.receivedNs))
+            {
+                ++_metrics.ignoredCommands;
+            }
+            break;
+        case CommandType::kAdvanceStagePulsing:
+            std::cout << "Starting pulsing." << std::endl;
+            setPulsing(true);
+            if (!advanceStage(command.stage, false, command.receivedNs))
+            {
+                // The pulsing alone already shows in this frame
+                traceCommand(command.receivedNs);
+            }
+            break;
+        case CommandType::kSetPalette:
+            setColorScheme(command.primary, command.secondary, command.fill);
+            traceCommand(command.receivedNs);
+            break;
+        case CommandType::kSetPulsing:
+            setPulsing(command.pulsing);
+            traceCommand(command.receivedNs);
+            break;
+        case CommandType::kSetParameter:
+            setParameter(command.parameter, command.value);
+            break;
+        case CommandType::kQueryLatency:
+            break;
+        }
+    }
+}
+
+void LedDriver::traceCommand(int64_t receivedNs)
+{
+    OutputFrame &frame = _frames.back();
+    if (receivedNs != 0 && frame.traceCount < frame.traces.size())
+    {
+        frame.traces[frame.traceCount++] = receivedNs;
+    }
+}
+
+bool LedDriver::advanceStage(AnimStage stage, bool force, int64_t tracedNs)
+{
+    if (stage < 0 || stage >= TIMELINE_STAGE_COUNT)
+    {
+        return false;
     }
+    if (!force && stage <= currentStageType() && !_configuration.allow_lower_stage_advance)
+    {
+        std::cout << "Ignoring switch to a lower stage." << std::endl;
+        return false;
+    }
+    // The trace follows the new stage until update() swaps it in
+    _nextStageTraceNs = tracedNs;
+
+    enterStage(stage);
+    return true;
 }
 
 void LedDriver::setPulsing(bool pulsing)
 {
+    if (pulsing != _pulsing)
+    {
+        _bakeCache.abort();
+    }
     _pulsing = pulsing;
 }
 
 void LedDriver::setColorScheme(color_t primary, color_t secondary, color_t fill)
 {
+    _bakeCache.abort();
     this->_primary = primary;
     this->_secondary = secondary;
     this->_fill = fill;
+    updatePalette();
+}
+
+void LedDriver::updatePalette()
+{
+    _palette[static_cast<size_t>(PaletteColor::kPrimary)] = _colorCurve.decode(_primary);
+    _palette[static_cast<size_t>(PaletteColor::kSecondary)] = _colorCurve.decode(_secondary);
+    _palette[static_cast<size_t>(PaletteColor::kFill)] = _colorCurve.decode(_fill);
+}
+
+void LedDriver::setParameter(ControlParameter parameter, float value)
+{
+    switch (parameter)
+    {
+    case ControlParameter::kBlinkRate:
+        _configuration.blink_rate = value;
+        break;
+    case ControlParameter::kIdleSpeed:
+        _configuration.idle_speed = value;
+        break;
+    case ControlParameter::kStartingTime:
+        _configuration.starting_time = value;
+        break;
+    case ControlParameter::kCollisionSpeed:
+        _configuration.collision_speed = value;
+        break;
+    case ControlParameter::kCollisionTime:
+        _configuration.collision_time = value;
+        break;
+    case ControlParameter::kResetTime:
+        _configuration.reset_time = value;
+        break;
+    case ControlParameter::kAutoAdvance:
+        _configuration.auto_advance = value != 0.f;
+        break;
+    case ControlParameter::kCount:
+        break;
+    }
 }
 
 bool LedDriver::getPulsing() const
@@ -174,38 +386,118 @@ bool LedDriver::getPulsing() const
     return _pulsing;
 }
 
-void LedDriver::applyConfig(const libconfig::Config &config)
+bool LedDriver::applyConfig(const libconfig::Setting &config)
 {
-#ifdef CONTROL_ARTNET
-    config.lookupValue("led_driver.artnet.leds.start", _ledCountStart);
-    config.lookupValue("led_driver.artnet.leds.end", _ledCountEnd);
-
-    config.lookupValue("led_driver.artnet.padding.start", _ledPaddingStart);
-    config.lookupValue("led_driver.artnet.padding.end", _ledPaddingEnd);
+    bool valid = true;
+    if (config.exists("timeline"))
+    {
+        valid = _timeline.applyConfig(config.lookup("timeline")) && valid;
+    }
+    if (config.exists("bake"))
+    {
+        _bakeCache.applyConfig(config.lookup("bake"));
+    }
+    if (config.exists("color"))
+    {
+        valid = _colorCurve.applyConfig(config.lookup("color")) && valid;
+    }
 
-    _ledsRing.resize(_ledCountEnd + _ledCountEnd);
+    _sinks.clear();
+    if (config.exists("outputs"))
+    {
+        const libconfig::Setting &outputs = config.lookup("outputs");
+        for (int i = 0; i < outputs.getLength(); ++i)
+        {
+            if (!makeOutputSink(outputs[i], _sinks))
+            {
+                std::cout << "Skipping output " << i << "." << std::endl;
+                valid = false;
+            }
+        }
+    }
+    else
+    {
+        // Older configs have a single Art-Net output described by the artnet group and pixel_map
+        ArtNetSink artnet;
+        valid = artnet.applyConfig(config.exists("artnet") ? config.lookup("artnet") : config,
+                                   config.exists("pixel_map") ? &config.lookup("pixel_map") : nullptr) && valid;
+        _sinks.emplace_back(std::move(artnet));
+    }
 
-    config.lookupValue("led_driver.artnet.controller_ip", _remoteAddress);
-    _remote.sin_addr.s_addr = inet_addr(_remoteAddress.c_str());
-#endif // CONTROL_ARTNET
+    uint32_t mappedCount = 0;
+    for (const auto &sink : _sinks)
+    {
+        mappedCount = std::max(mappedCount, std::visit([](const auto &output) { return output.ledCount(); }, sink));
+    }
+    uint32_t ledCount = mappedCount;
+    config.lookupValue("led_count", ledCount);
+    if (ledCount < mappedCount)
+    {
+        std::cout << "led_count is smaller than the outputs need, using " << mappedCount << std::endl;
+        ledCount = mappedCount;
+    }
+    if (ledCount > 0)
+    {
+        _ledsRing.resize(ledCount);
+    }
 
-    config.lookupValue("led_driver.reset_time", _configuration.reset_time);
-    config.lookupValue("led_driver.auto_advance", _configuration.auto_advance);
-    config.lookupValue("led_driver.blink_rate", _configuration.blink_rate);
-    config.lookupValue("led_driver.idle_speed", _configuration.idle_speed);
-    config.lookupValue("led_driver.starting_time", _configuration.starting_time);
-    config.lookupValue("led_driver.collision_speed", _configuration.collision_speed);
-    config.lookupValue("led_driver.collision_time", _configuration.collision_time);
-    config.lookupValue("led_driver.allow_lower_stage_advance", _configuration.allow_lower_stage_advance);
+    // The same checks as a set parameter command, a rejected value keeps the default
+    auto lookupParameter = [&](const char *name, ControlParameter parameter, double &value)
+    {
+        double configured = value;
+        if (!config.lookupValue(name, configured))
+        {
+            return;
+        }
+        if (!validParameterValue(parameter, configured))
+        {
+            std::cout << "Invalid " << name << " " << configured << ", keeping " << value << std::endl;
+            valid = false;
+            return;
+        }
+        value = configured;
+    };
+    lookupParameter("reset_time", ControlParameter::kResetTime, _configuration.reset_time);
+    config.lookupValue("auto_advance", _configuration.auto_advance);
+    lookupParameter("blink_rate", ControlParameter::kBlinkRate, _configuration.blink_rate);
+    lookupParameter("idle_speed", ControlParameter::kIdleSpeed, _configuration.idle_speed);
+    lookupParameter("starting_time", ControlParameter::kStartingTime, _configuration.starting_time);
+    lookupParameter("collision_speed", ControlParameter::kCollisionSpeed, _configuration.collision_speed);
+    lookupParameter("collision_time", ControlParameter::kCollisionTime, _configuration.collision_time);
+    config.lookupValue("allow_lower_stage_advance", _configuration.allow_lower_stage_advance);
+    config.lookupValue("idle_after", _idleAfter);
+    if (config.exists("active_stages"))
+    {
+        const libconfig::Setting &stages = config.lookup("active_stages");
+        _activeStages.fill(false);
+        for (int i = 0; i < stages.getLength(); ++i)
+        {
+            std::string name = stages[i];
+            bool known = false;
+            for (int stage = 0; stage < TIMELINE_STAGE_COUNT; ++stage)
+            {
+                if (name == Timeline::stageName(static_cast<AnimStage>(stage)))
+                {
+                    _activeStages[stage] = true;
+                    known = true;
+                }
+            }
+            if (!known)
+            {
+                std::cout << "Unknown stage in active_stages: " << name << std::endl;
+                valid = false;
+            }
+        }
+    }
 
     uint32_t r = _primary.r;
     uint32_t g = _primary.g;
     uint32_t b = _primary.b;
     uint32_t w = _primary.w;
-    config.lookupValue("led_driver.colors.primary.r", r);
-    config.lookupValue("led_driver.colors.primary.g", g);
-    config.lookupValue("led_driver.colors.primary.b", b);
-    config.lookupValue("led_driver.colors.primary.w", w);
+    config.lookupValue("colors.primary.r", r);
+    config.lookupValue("colors.primary.g", g);
+    config.lookupValue("colors.primary.b", b);
+    config.lookupValue("colors.primary.w", w);
     _primary.r = static_cast<color_data_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(r)));
     _primary.g = static_cast<color_data_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(g)));
     _primary.b = static_cast<color_data_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(b)));
@@ -215,10 +507,10 @@ void LedDriver::applyConfig(const libconfig::Config &config)
     g = _secondary.g;
     b = _secondary.b;
     w = _secondary.w;
-    config.lookupValue("led_driver.colors.secondary.r", r);
-    config.lookupValue("led_driver.colors.secondary.g", g);
-    config.lookupValue("led_driver.colors.secondary.b", b);
-    config.lookupValue("led_driver.colors.secondary.w", w);
+    config.lookupValue("colors.secondary.r", r);
+    config.lookupValue("colors.secondary.g", g);
+    config.lookupValue("colors.secondary.b", b);
+    config.lookupValue("colors.secondary.w", w);
     _secondary.r = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(r)));
     _secondary.g = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(g)));
     _secondary.b = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(b)));
@@ -228,286 +520,388 @@ void LedDriver::applyConfig(const libconfig::Config &config)
     g = _fill.g;
     b = _fill.b;
     w = _fill.w;
-    config.lookupValue("led_driver.colors.fill.r", r);
-    config.lookupValue("led_driver.colors.fill.g", g);
-    config.lookupValue("led_driver.colors.fill.b", b);
-    config.lookupValue("led_driver.colors.fill.w", w);
+    config.lookupValue("colors.fill.r", r);
+    config.lookupValue("colors.fill.g", g);
+    config.lookupValue("colors.fill.b", b);
+    config.lookupValue("colors.fill.w", w);
     _fill.r = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(r)));
     _fill.g = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(g)));
     _fill.b = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(b)));
     _fill.w = static_cast<uint8_t>(std::min(std::numeric_limits<color_data_t>::max(), static_cast<color_data_t>(w)));
+    updatePalette();
+    return valid;
 }
 
 void LedDriver::update(float deltaTime)
 {
+    int64_t start = monotonicNanos();
+
+    // Configuration and control changes land together on a frame boundary
+    adoptReload();
+    applyCommands();
+
     _pulseTime += M_PI * _configuration.blink_rate * deltaTime;
     _pulseValue = (sin(_pulseTime) + 1.0f) / 2.0f;
-    {
-        std::lock_guard<std::mutex> guard(_stageMtx);
-        if (_stageData != _nextStageData)
+    if (_stagePending)
+    {
+        _currentStage ^= 1;
+        _stagePending = false;
+        AnimStage stage = currentStageType();
+        std::cout << "Switching to stage: " << stage << std::endl;
+        traceCommand(_nextStageTraceNs);
+        _nextStageTraceNs = 0;
+        _metrics.stage.store(stage, std::memory_order_relaxed);
+
+        // Stages that only depend on where they start can be baked, unless pulsing modulates them
+        _bakeCache.end();
+        if (_bakeCache.enabled() && !_pulsing && _timeline.program(stage).bakeable)
         {
-            std::cout << "Switching to stage: " << _nextStageData->forStage() << std::endl;
-            _stageData = _nextStageData;
+            _bakeCache.begin(stageFingerprint(deltaTime), deltaTime, _compositor.size());
         }
     }
+    _drawing = !_bakeCache.nextFramePlays(deltaTime);
 
-    switch (_stageData->forStage())
+    updateStage(currentStage(), deltaTime);
+    // Bakes hold the layers, playback overwrites them wholesale
+    _bakeCache.frame(_compositor.data(), _compositor.size());
+    if (!_drawing)
     {
-    case AnimStage::kDark:
-        updateDark(deltaTime);
-        break;
-    case AnimStage::kStarting:
-        updateStarting(deltaTime);
-        break;
-    case AnimStage::kIdle:
-        updateIdle(deltaTime);
-        break;
-    case AnimStage::kWindup:
-        updateWindup(deltaTime);
-        break;
-    case AnimStage::kExplosion:
-        updateExplosion(deltaTime);
-        break;
-    case AnimStage::kFade:
-        updateFade(deltaTime);
-        break;
+        _compositor.invalidate();
     }
+    _compositor.composite(_ledsRing.data());
+    _metrics.updateTime.record(monotonicNanos() - start);
+    ++_metrics.frames;
 }
 
 void LedDriver::render()
 {
-#ifdef RENDER_DEBUG
-    for (auto color : _ledsRingInner)
-    {
-        std::cout << std::setw(8) << std::setfill('0') << std::hex;
-        std::cout << RGBW(color) << " ";
-    }
-    std::cout << std::endl;
-    for (auto color : _ledsRingOuter)
-    {
-        std::cout << std::setw(8) << std::setfill('0') << std::hex;
-        std::cout << RGBW(color) << " ";
+    compose();
+    transmit();
+}
+
+void LedDriver::compose()
+{
+    int64_t start = monotonicNanos();
+    updateFrameRate(start);
+    // One pass turns the ring into output codes, the sinks only copy them. Keepalive frames
+    // are too far apart for dithering, they show the nearest code instead.
+    OutputFrame &frame = _frames.back();
+    frame.narrow.resize(_ledsRing.size());
+    frame.wide.resize(_wideOutput ? _ledsRing.size() : 0);
+    _colorCurve.apply(_ledsRing.data(), frame.narrow.data(), frame.wide.empty() ? nullptr : frame.wide.data(),
+                      _ledsRing.size(), _frameRate != FrameRate::kIdle);
+    frame.composeNs = monotonicNanos() - start;
+    // Every frame names the outputs it was composed for until the sender switched to them, so
+    // dropping a frame never separates a new layout from its outputs
+    if (_pendingReload && _reloadSwitched.load(std::memory_order_acquire))
+    {
+        _pendingReload = nullptr;
+    }
+    frame.layout = _layout;
+    frame.reload = _pendingReload;
+
+    if (_frames.publish())
+    {
+        // The sender never saw that frame, its commands are now this frame's
+        ++_metrics.droppedFrames;
+        return;
     }
-    std::cout << std::endl
-              << std::dec;
-#else
-#ifdef CONTROL_ARTNET
-    sendArtNet();
-#endif // CONTROL_ARTNET
-#endif
+    _frames.back().traceCount = 0;
 }
 
-void LedDriver::clear()
+void LedDriver::transmit()
 {
-    for (auto &color : _ledsRing)
+    if (!_frames.take())
     {
-        color.r = color.g = color.b = color.w = 0;
+        return;
     }
-    render();
-
-#ifdef CONTROL_ARTNET
-    if (_sockfd > 0)
+    OutputFrame &frame = _frames.front();
+    if (frame.layout != _sinksLayout)
     {
-        close(_sockfd);
+        std::swap(_sinks, frame.reload->_sinks);
+        handOverOutputs(*frame.reload, frame.narrow.size());
+        _sinksLayout = frame.layout;
+        _reloadSwitched.store(true, std::memory_order_release);
     }
-#endif // CONTROL_ARTNET
-}
 
-void LedDriver::initDark()
-{
-    auto dark = std::make_shared<DarkStageData>();
-    dark->reset_time = _configuration.reset_time;
-    _pulsing = false;
-    _nextStageData = std::move(dark);
-}
+    // Every sink encodes before any flushes, so the outputs leave as close together as possible
+    int64_t start = monotonicNanos();
+    for (auto &sink : _sinks)
+    {
+        std::visit([&frame](auto &output) {
+            output.encode(output.depth() == 16 ? frame.wide.data() : frame.narrow.data(), frame.narrow.size());
+        }, sink);
+    }
+    int64_t encoded = monotonicNanos();
+    for (auto &sink : _sinks)
+    {
+        std::visit([](auto &output) { output.flush(); }, sink);
+    }
+    _metrics.renderTime.record(frame.composeNs + encoded - start);
+    _metrics.sendTime.record(monotonicNanos() - encoded);
 
-void LedDriver::initStarting()
-{
-    auto starting = std::make_shared<StartingStageData>();
-    starting->target_speed = _configuration.idle_speed;
-    starting->particle_accel = _configuration.idle_speed / _configuration.starting_time;
-    _nextStageData = std::move(starting);
+    // The commands this frame shows have now reached the wire
+    if (frame.traceCount > 0)
+    {
+        int64_t sentNs = realtimeNanos();
+        for (size_t i = 0; i < frame.traceCount; ++i)
+        {
+            _controlLatency.record(sentNs > frame.traces[i] ? static_cast<uint64_t>(sentNs - frame.traces[i]) : 0);
+        }
+        frame.traceCount = 0;
+    }
 }
 
-void LedDriver::initIdle()
+void LedDriver::handOverOutputs(LedDriver &replaced, size_t ringSize)
 {
-    auto idle = std::make_shared<IdleStageData>();
-    idle->particle_speed = _configuration.idle_speed;
-    if (_stageData->forStage() == AnimStage::kStarting)
+    for (auto &sink : replaced._sinks)
+    {
+        if (ownsHardware(sink))
+        {
+            std::visit([](auto &output) { output.close(); }, sink);
+        }
+    }
+    for (auto &sink : _sinks)
     {
-        auto starting = std::static_pointer_cast<StartingStageData>(_stageData);
-        idle->particle_position = starting->particle_position;
+        if (ownsHardware(sink))
+        {
+            // One that fails stays dark, the replaced one is already gone
+            std::visit([ringSize](auto &output) { output.open(ringSize); }, sink);
+        }
+        ArtNetSink *artNet = std::get_if<ArtNetSink>(&sink);
+        if (artNet && artNet->captureDeferred())
+        {
+            ArtNetSink *previous = nullptr;
+            for (auto &old : replaced._sinks)
+            {
+                ArtNetSink *candidate = std::get_if<ArtNetSink>(&old);
+                if (candidate && !artNet->capturePath().empty() && candidate->capturePath() == artNet->capturePath())
+                {
+                    previous = candidate;
+                }
+            }
+            artNet->openCapture(previous);
+        }
     }
-    idle->auto_advance = _configuration.auto_advance;
-    _nextStageData = std::move(idle);
 }
 
-void LedDriver::initWindup()
+void LedDriver::updateFrameRate(int64_t now)
 {
-    auto windup = std::make_shared<WindupStageData>();
-    if (_stageData->forStage() == AnimStage::kIdle)
+    size_t bytes = std::min(_ledsRing.size(), _ledsLast.size()) * sizeof(color_t);
+    if (memcmp(_ledsRing.data(), _ledsLast.data(), bytes) != 0)
     {
-        auto idle = std::static_pointer_cast<IdleStageData>(_stageData);
-        windup->first_particle_position = idle->particle_position;
-        windup->first_particle_speed = idle->particle_speed;
+        memcpy(_ledsLast.data(), _ledsRing.data(), bytes);
+        _lastChangeNs = now;
     }
-    else if (_stageData->forStage() == AnimStage::kStarting)
+    if (_activeStages[currentStageType()])
     {
-        auto starting = std::static_pointer_cast<StartingStageData>(_stageData);
-        windup->first_particle_position = starting->particle_position;
-        windup->first_particle_speed = starting->particle_speed;
+        _frameRate = FrameRate::kActive;
+    }
+    else
+    {
+        bool idle = now - _lastChangeNs >= static_cast<int64_t>(_idleAfter * NS_PER_SEC);
+        _frameRate = idle ? FrameRate::kIdle : FrameRate::kNormal;
     }
-    windup->second_particle_speed = windup->first_particle_speed / 2.0f;
-    windup->target_speed = _configuration.collision_speed;
-    windup->first_particle_accel = _configuration.collision_speed / _configuration.collision_time;
-    windup->second_particle_accel = _configuration.collision_speed / _configuration.collision_time;
-    _nextStageData = std::move(windup);
 }
 
-void LedDriver::initExplosion()
+void LedDriver::clear()
 {
-    _nextStageData = std::make_shared<ExplosionStageData>();
+    for (auto &color : _ledsRing)
+    {
+        color.r = color.g = color.b = color.w = 0;
+    }
+    render();
+    closeOutputs(true);
 }
 
-void LedDriver::initFade()
+TimelineParameters LedDriver::parameters() const
 {
-    _nextStageData = std::make_shared<FadeStageData>();
+    TimelineParameters parameters;
+    parameters[ControlParameter::kBlinkRate] = _configuration.blink_rate;
+    parameters[ControlParameter::kIdleSpeed] = _configuration.idle_speed;
+    parameters[ControlParameter::kStartingTime] = _configuration.starting_time;
+    parameters[ControlParameter::kCollisionSpeed] = _configuration.collision_speed;
+    parameters[ControlParameter::kCollisionTime] = _configuration.collision_time;
+    parameters[ControlParameter::kResetTime] = _configuration.reset_time;
+    parameters[ControlParameter::kAutoAdvance] = _configuration.auto_advance ? 1.0 : 0.0;
+    return parameters;
 }
 
-void LedDriver::updateDark(float deltaTime)
+void LedDriver::enterStage(AnimStage stage)
 {
-    auto data = std::static_pointer_cast<DarkStageData>(_stageData);
-    data->update(deltaTime);
-
-    if (data->auto_reset && data->elapsed_time > data->reset_time)
+    _timeline.enter(stage, currentStage(), parameters(), nextStage());
+    if (stage == AnimStage::kDark)
     {
-        advanceStage(AnimStage::kStarting);
+        _pulsing = false;
     }
+    _stagePending = true;
 }
 
-void LedDriver::updateStarting(float deltaTime)
+void LedDriver::updateStage(StageState &state, float deltaTime)
 {
-    auto data = std::static_pointer_cast<StartingStageData>(_stageData);
-    data->update(deltaTime);
+    const StageProgram &program = _timeline.program(state.stage);
+    state.elapsed_time += deltaTime;
 
-    dimLeds(0.8f, 0);
-
-    float last_position = data->particle_position;
-    data->particle_position += data->particle_speed * deltaTime;
-    if (data->particle_position > 360.0f)
+    if (program.dim)
     {
-        data->particle_position -= 360.0f;
+        dimLeds(program.dimLayer, program.dimFactor, program.dimAddition);
     }
-    drawCWLine(last_position, data->particle_position, _primary);
 
-    data->particle_speed += data->particle_accel * deltaTime;
-    if (data->particle_speed > data->target_speed)
+    std::array<float, TIMELINE_MAX_PARTICLES> lastPositions;
+    for (size_t i = 0; i < state.particleCount; ++i)
     {
-        advanceStage(AnimStage::kIdle);
+        ParticleState &particle = state.particles[i];
+        lastPositions[i] = particle.position;
+        if (program.particles[i].clockwise)
+        {
+            particle.position += particle.speed * deltaTime;
+            if (particle.position > 360.f)
+            {
+                particle.position -= 360.f;
+            }
+        }
+        else
+        {
+            particle.position -= particle.speed * deltaTime;
+            if (particle.position < 0.f)
+            {
+                particle.position += 360.f;
+            }
+        }
+        particle.speed += particle.accel * deltaTime;
+        if (program.particles[i].clamp && particle.speed > particle.maxSpeed)
+        {
+            particle.speed = particle.maxSpeed;
+        }
+    }
+    if (program.fill)
+    {
+        state.fill_ratio += state.fill_rate * deltaTime;
     }
-}
-
-void LedDriver::updateIdle(float deltaTime)
-{
-    auto data = std::static_pointer_cast<IdleStageData>(_stageData);
-    data->update(deltaTime);
-
-    dimLeds(0.8f, 0);
 
-    float last_position = data->particle_position;
-    data->particle_position += data->particle_speed * deltaTime;
-    if (data->particle_position > 360.0f)
+    const TransitionProgram *transition = _timeline.firedTransition(state);
+    if (transition)
     {
-        data->particle_position -= 360.0f;
+        advanceStage(transition->to, transition->force);
+        if (transition->cut)
+        {
+            return;
+        }
     }
-    drawCWLine(last_position, data->particle_position, _primary);
 
-    if (data->auto_advance && data->elapsed_time > data->advance_time)
+    if (program.fill)
     {
-        advanceStage(AnimStage::kWindup);
+        drawFill(program.fillLayer, ease(program.fillEasing, state.fill_ratio), paletteColor(program.fillColor));
+    }
+    for (size_t i = 0; i < state.particleCount; ++i)
+    {
+        const ParticleProgram &particle = program.particles[i];
+        if (!particle.splat.empty())
+        {
+            drawSplat(particle, lastPositions[i], state.particles[i].position, paletteColor(particle.color));
+        }
+        else if (particle.clockwise)
+        {
+            drawCWLine(particle.layer, lastPositions[i], state.particles[i].position, paletteColor(particle.color));
+        }
+        else
+        {
+            drawCCWLine(particle.layer, lastPositions[i], state.particles[i].position, paletteColor(particle.color));
+        }
     }
 }
 
-void LedDriver::updateWindup(float deltaTime)
+uint64_t LedDriver::stageFingerprint(float deltaTime) const
 {
-    auto data = std::static_pointer_cast<WindupStageData>(_stageData);
-    data->update(deltaTime);
+    AnimStage stage = currentStageType();
+    uint64_t hash = fingerprint(&stage, sizeof(stage));
+    hash = fingerprint(&deltaTime, sizeof(deltaTime), hash);
+    // The decoded palette, so a different gamma bakes separately
+    hash = fingerprint(_palette.data(), _palette.size() * sizeof(color_t), hash);
+    hash = fingerprint(_compositor.data(), _compositor.size() * sizeof(color_t), hash);
+
+    // The stage state right after it started, which already holds the parameters it was built from
+    const StageState &state = currentStage();
+    hash = fingerprint(&_timeline.program(stage).fingerprint, sizeof(uint64_t), hash);
+    float values[] = {state.elapsed_time, state.fill_ratio, state.fill_rate};
+    hash = fingerprint(values, sizeof(values), hash);
+    hash = fingerprint(&state.auto_advance, sizeof(state.auto_advance), hash);
+    hash = fingerprint(state.particles.data(), state.particleCount * sizeof(ParticleState), hash);
+    return fingerprint(state.after.data(), sizeof(state.after), hash);
+}
 
-    dimLeds(0.8f, 0);
+color_t LedDriver::pulsedColor(const color_t &color) const
+{
+    return color_t{
+        .r = _pulsing ? static_cast<color_data_t>(color.r * _pulseValue) : color.r,
+        .g = _pulsing ? static_cast<color_data_t>(color.g * _pulseValue) : color.g,
+        .b = _pulsing ? static_cast<color_data_t>(color.b * _pulseValue) : color.b,
+        .w = _pulsing ? static_cast<color_data_t>(color.w * _pulseValue) : color.w,
+    };
+}
 
-    float first_last_position = data->first_particle_position;
-    data->first_particle_position += data->first_particle_speed * deltaTime;
-    if (data->first_particle_position > 360.f)
+void LedDriver::touchWrapped(size_t layer, long begin, long end)
+{
+    long count = static_cast<long>(_ledsRing.size());
+    if (end - begin >= count)
     {
-        data->first_particle_position -= 360.f;
+        _compositor.touch(layer, 0, count);
+        return;
     }
-
-    float second_last_position = data->second_particle_position;
-    data->second_particle_position -= data->second_particle_speed * deltaTime;
-    if (data->second_particle_position < 0.f)
+    long wrapped = begin % count;
+    if (wrapped < 0)
     {
-        data->second_particle_position += 360.f;
+        wrapped += count;
     }
-
-    data->first_particle_speed += data->first_particle_accel * deltaTime;
-    if (data->first_particle_speed > data->target_speed)
+    end = wrapped + (end - begin);
+    _compositor.touch(layer, wrapped, std::min(end, count));
+    if (end > count)
     {
-        data->first_particle_speed = data->target_speed;
+        _compositor.touch(layer, 0, end - count);
     }
+}
 
-    data->second_particle_speed += data->second_particle_accel * deltaTime;
-    if (data->second_particle_speed > data->target_speed)
+void LedDriver::drawSplat(const ParticleProgram &particle, float angleFrom, float angleTo, const color_t &color)
+{
+    if (!_drawing)
     {
-        data->second_particle_speed = data->target_speed;
+        return;
     }
+    color_t realColor = pulsedColor(color);
+    color_t *leds = _compositor.layer(particle.layer);
+    float count = static_cast<float>(_ledsRing.size());
+    float from = partialLedFromAngle(angleFrom);
+    float to = partialLedFromAngle(angleTo);
 
-    if (data->second_particle_speed == data->target_speed
-        && (data->first_particle_position - data->second_particle_position) < 5.0f
-        && ((data->first_particle_position > 30.f && data->first_particle_position < 180.f - 30.f)
-            || (data->first_particle_position < 360.f - 30.f && data->first_particle_position > 180.f + 30.f)))
+    // The distance travelled this frame, the blurred part of it ends where the particle is now
+    float travel = particle.clockwise ? to - from : from - to;
+    if (travel < 0.f)
     {
-        advanceStage(AnimStage::kExplosion);
+        travel += count;
     }
-    else
+    float streak = travel * particle.blur;
+    float begin = particle.clockwise ? to - streak : to;
+    float end = begin + streak;
+    if (streak > 0.f)
     {
-        drawCWLine(first_last_position, data->first_particle_position, _primary);
-        drawCCWLine(second_last_position, data->second_particle_position, _secondary);
+        particle.splat.sweep(leds, _ledsRing.size(), begin, end, realColor, particle.brightness);
     }
-}
-
-void LedDriver::updateExplosion(float deltaTime)
-{
-    auto data = std::static_pointer_cast<ExplosionStageData>(_stageData);
-    data->update(deltaTime);
-
-    data->fill_ratio += data->fill_rate * deltaTime;
-    if (data->fill_ratio > 1.0f)
+    else
     {
-        advanceStage(AnimStage::kFade);
+        particle.splat.splat(leds, _ledsRing.size(), to, realColor, particle.brightness);
     }
-    drawFill(data->fill_ratio, _fill);
+    float radius = particle.splat.radius();
+    touchWrapped(particle.layer, static_cast<long>(floorf(begin - radius)), static_cast<long>(ceilf(end + radius)) + 1);
 }
 
-void LedDriver::updateFade(float deltaTime)
+void LedDriver::drawCWLine(size_t layer, float angleFrom, float angleTo, const color_t &color)
 {
-    auto data = std::static_pointer_cast<FadeStageData>(_stageData);
-    data->update(deltaTime);
-    dimLeds(0.97f, 0);
-
-    if (data->elapsed_time > data->target_time)
+    if (!_drawing)
     {
-        advanceStage(AnimStage::kDark, true);
+        return;
     }
-}
-
-void LedDriver::drawCWLine(float angleFrom, float angleTo, const color_t &color)
-{
-    color_t realColor = {
-        .r = _pulsing ? static_cast<color_data_t>(color.r * _pulseValue) : color.r,
-        .g = _pulsing ? static_cast<color_data_t>(color.g * _pulseValue) : color.g,
-        .b = _pulsing ? static_cast<color_data_t>(color.b * _pulseValue) : color.b,
-        .w = _pulsing ? static_cast<color_data_t>(color.w * _pulseValue) : color.w,
-    };
+    color_t *leds = _compositor.layer(layer);
+    color_t realColor = pulsedColor(color);
 
     float ledFrom = partialLedFromAngle(angleFrom);
     float ledTo = partialLedFromAngle(angleTo);
@@ -522,48 +916,36 @@ void LedDriver::drawCWLine(float angleFrom, float angleTo, const color_t &color)
     uint32_t iledTo = static_cast<uint32_t>(ledToI);
 
     size_t partialTo = ((iledTo + 1) % _ledsRing.size());
-    _ledsRing[partialTo].r = static_cast<color_data_t>(realColor.r * ledToP);
-    _ledsRing[partialTo].g = static_cast<color_data_t>(realColor.g * ledToP);
-    _ledsRing[partialTo].b = static_cast<color_data_t>(realColor.b * ledToP);
-    _ledsRing[partialTo].w = static_cast<color_data_t>(realColor.w * ledToP);
-
+    leds[partialTo].r = static_cast<color_data_t>(realColor.r * ledToP);
+    leds[partialTo].g = static_cast<color_data_t>(realColor.g * ledToP);
+    leds[partialTo].b = static_cast<color_data_t>(realColor.b * ledToP);
+    leds[partialTo].w = static_cast<color_data_t>(realColor.w * ledToP);
+    _compositor.touch(layer, partialTo, partialTo + 1);
+
+    // An angle of exactly 360 degrees maps one past the last LED
+    size_t spanTo = std::min<size_t>(iledTo + 1, _ledsRing.size());
     if (angleTo > angleFrom)
     {
-        for (uint32_t i = iledFrom; i <= iledTo; ++i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
+        fillSpan(leds, iledFrom, spanTo, realColor);
+        _compositor.touch(layer, iledFrom, spanTo);
     }
     else
     {
-        for (uint32_t i = iledFrom; i < _ledsRing.size(); ++i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
-        for (uint32_t i = 0; i <= iledTo; ++i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
+        fillSpan(leds, iledFrom, _ledsRing.size(), realColor);
+        _compositor.touch(layer, iledFrom, _ledsRing.size());
+        fillSpan(leds, 0, spanTo, realColor);
+        _compositor.touch(layer, 0, spanTo);
     }
 }
 
-void LedDriver::drawCCWLine(float angleFrom, float angleTo, const color_t &color)
+void LedDriver::drawCCWLine(size_t layer, float angleFrom, float angleTo, const color_t &color)
 {
-    color_t realColor = {
-        .r = _pulsing ? static_cast<color_data_t>(color.r * _pulseValue) : color.r,
-        .g = _pulsing ? static_cast<color_data_t>(color.g * _pulseValue) : color.g,
-        .b = _pulsing ? static_cast<color_data_t>(color.b * _pulseValue) : color.b,
-        .w = _pulsing ? static_cast<color_data_t>(color.w * _pulseValue) : color.w,
-    };
+    if (!_drawing)
+    {
+        return;
+    }
+    color_t *leds = _compositor.layer(layer);
+    color_t realColor = pulsedColor(color);
 
     float ledFrom = partialLedFromAngle(angleFrom);
     float ledTo = partialLedFromAngle(angleTo);
@@ -578,36 +960,23 @@ void LedDriver::drawCCWLine(float angleFrom, float angleTo, const color_t &color
     int32_t iledTo = static_cast<int32_t>(ledToI);
 
     size_t partialTo = ((iledTo - 1 + _ledsRing.size()) % _ledsRing.size());
-    _ledsRing[partialTo].r = static_cast<color_data_t>(realColor.r * ledToP);
-    _ledsRing[partialTo].g = static_cast<color_data_t>(realColor.g * ledToP);
-    _ledsRing[partialTo].b = static_cast<color_data_t>(realColor.b * ledToP);
-    _ledsRing[partialTo].w = static_cast<color_data_t>(realColor.w * ledToP);
+    leds[partialTo].r = static_cast<color_data_t>(realColor.r * ledToP);
+    leds[partialTo].g = static_cast<color_data_t>(realColor.g * ledToP);
+    leds[partialTo].b = static_cast<color_data_t>(realColor.b * ledToP);
+    leds[partialTo].w = static_cast<color_data_t>(realColor.w * ledToP);
+    _compositor.touch(layer, partialTo, partialTo + 1);
 
+    size_t spanFrom = std::min<size_t>(iledFrom + 1, _ledsRing.size());
     if (angleTo < angleFrom)
     {
-        for (int32_t i = iledFrom; i >= iledTo; --i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
+        fillSpan(leds, iledTo, spanFrom, realColor);
+        _compositor.touch(layer, iledTo, spanFrom);
     }
     else
     {
-        for (int32_t i = iledFrom; i >= 0; --i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
-        for (int32_t i = _ledsRing.size() - 1; i >= iledTo; --i)
-        {
-            _ledsRing[i].r = realColor.r;
-            _ledsRing[i].g = realColor.g;
-            _ledsRing[i].b = realColor.b;
-            _ledsRing[i].w = realColor.w;
-        }
+        fillSpan(leds, 0, spanFrom, realColor);
+        _compositor.touch(layer, 0, spanFrom);
+        fillSpan(leds, iledTo, _ledsRing.size(), realColor);
+        _compositor.touch(layer, iledTo, _ledsRing.size());
     }
 }
@@ -4,100 +4,45 @@
 #include <stdint.h>
 #include <vector>
 #include <queue>
-#include <mutex>
+#include <array>
+#include <atomic>
 #include <memory>
 #include <libconfig.h++>
 
-//#define RENDER_DEBUG
-//#define CONTROL_SPI
-#define CONTROL_ARTNET
-
 #include "LedDefs.h"
-
-#ifdef CONTROL_SPI
-#include "rpi_ws281x/ws2811.h"
-#endif //CONTROL_SPI
-#ifdef CONTROL_ARTNET
-#include <sys/socket.h>
-#include <netinet/in.h>
-#endif //CONTROL_ARTNET
-
-enum AnimStage {
-    kDark = 0,
-    kStarting = 1,
-    kIdle = 2,
-    kWindup = 3,
-    kExplosion = 4,
-    kFade = 5,
-};
-
-class IAnimStageData {
-public:
-    AnimStage forStage() { return _stage; }
-
-    float elapsed_time = 0.f;
-
-    void update(float delta) { elapsed_time += delta; }
-
-protected:
-    IAnimStageData(AnimStage stage) : _stage(stage) {}
-private:
-    AnimStage _stage;
-};
-
-class DarkStageData : public IAnimStageData {
-public:
-    DarkStageData() : IAnimStageData(AnimStage::kDark) {}
-
-    bool auto_reset = true;
-    float reset_time = 30.f;
-};
-
-class StartingStageData : public IAnimStageData {
-public:
-    StartingStageData() : IAnimStageData(AnimStage::kStarting) {}
-
-    float particle_position = 0.f;
-    float particle_speed = 1.f;
-    float particle_accel = 360.f / 15.0f;
-    float target_speed = 360.f;
-};
-
-class IdleStageData : public IAnimStageData {
-public:
-    IdleStageData() : IAnimStageData(AnimStage::kIdle) {}
-
-    float particle_position = 0.f;
-    float particle_speed = 360.f;
-    bool auto_advance = true;
-    float advance_time = 2.0f;
-};
-
-class WindupStageData : public IAnimStageData {
-public:
-    WindupStageData() : IAnimStageData(AnimStage::kWindup) {}
-
-    float first_particle_position = 0.f;
-    float first_particle_speed = 0.f;
-    float first_particle_accel = 360.f / 15.0f;
-    float second_particle_position = 0.f;
-    float second_particle_speed = 1.f;
-    float second_particle_accel = 360.f / 15.0f;
-    float target_speed = 355.0f;
+#include "SpscQueue.h"
+#include "Histogram.h"
+#include "OutputSinks.h"
+#include "BakeCache.h"
+#include "Timeline.h"
+#include "Compositor.h"
+#include "ColorCurve.h"
+#include "FrameScheduler.h"
+#include "TripleBuffer.h"
+
+enum class CommandType {
+    kAdvanceStage = 0,
+    // Starts pulsing, then advances the stage
+    kAdvanceStagePulsing = 1,
+    kSetPalette = 2,
+    kSetPulsing = 3,
+    kSetParameter = 4,
+    // Answered by the control thread, never queued to the render thread
+    kQueryLatency = 5,
 };
 
-class ExplosionStageData : public IAnimStageData {
-public:
-    ExplosionStageData() : IAnimStageData(AnimStage::kExplosion) {}
-
-    float fill_ratio = 0.4f;
-    float fill_rate = 0.2f;
-};
-
-class FadeStageData : public IAnimStageData {
-public:
-    FadeStageData() : IAnimStageData(AnimStage::kFade) {}
-    float target_time = 10.f;
+// A control request handed from the control thread to the render thread
+struct LedCommand {
+    CommandType type;
+    AnimStage stage;
+    color_t primary;
+    color_t secondary;
+    color_t fill;
+    bool pulsing;
+    ControlParameter parameter;
+    float value;
+    // Kernel receive time of the datagram carrying the command, CLOCK_REALTIME in nanoseconds
+    int64_t receivedNs;
 };
 
 class LedDriver
@@ -109,58 +54,169 @@ public:
     void addHole(uint32_t size);
     void finalize();
 
-    void advanceStage(AnimStage stage, bool force = false);
-    void applyConfig(const libconfig::Config &config);
+    // Queues a command for the render thread, which applies it at the start of the next frame.
+    // Safe to call from one control thread while the render thread runs, returns false when the queue is full.
+    bool postCommand(const LedCommand &command);
+
+    // The following are only safe on the render thread or before it starts
+    // Returns false when the switch was refused, tracedNs is the receive time of the command asking for it
+    bool advanceStage(AnimStage stage, bool force = false, int64_t tracedNs = 0);
+    // Applies an installation's settings group (the led_driver group in the single installation layout).
+    // Applies whatever is valid and returns false when any part of it had errors.
+    bool applyConfig(const libconfig::Setting &config);
+    // Hands the process wide node discovery to the Art-Net outputs, call after applyConfig
+    void setArtNetDiscovery(const ArtNetDiscovery *discovery);
+
+    // Hot reload, control thread only. prepareReload builds and opens everything the settings
+    // need beside the running state and returns false when the settings have any error or an
+    // output fails to open. Outputs that own hardware open at the switch instead. Follow it
+    // with commitReload, which has the render thread switch over at its next frame boundary,
+    // or with cancelReload. Stage progress, pulsing and queued commands carry over.
+    bool prepareReload(const libconfig::Setting &config);
+    void commitReload();
+    void cancelReload();
+    // Closes the replaced outputs once the render thread switched, false while that is pending.
+    // The outputs must not be inspected until it returns true.
+    bool reloadSettled();
+    // A committed reload whose replaced state reloadSettled has not collected yet
+    bool reloadPending() const { return _reloadCommitted; }
+    // Copies and persists the runs the render thread recorded since the last call and removes
+    // the files of dropped bakes, control thread only
+    void writeBakes();
 
     void setPulsing(bool pulsing);
     void setColorScheme(color_t primary, color_t secondary, color_t fill);
+    // Stage timing parameters take effect when the next stage starts
+    void setParameter(ControlParameter parameter, float value);
 
     bool getPulsing() const;
 
+    // Time from a control datagram arriving to the first frame reflecting it leaving, in nanoseconds.
+    // Recorded by the render thread, safe to read from any thread.
+    const AtomicHistogram &getControlLatency() const { return _controlLatency; }
+
+    // Render thread counters, safe to read from any thread
+    struct Metrics {
+        RelaxedCounter frames;
+        RelaxedCounter ignoredCommands;
+        AtomicHistogram updateTime;
+        AtomicHistogram renderTime;
+        AtomicHistogram sendTime;
+        // Composed frames replaced before the sender took them
+        RelaxedCounter droppedFrames;
+        std::atomic<int> stage{AnimStage::kDark};
+    };
+    const Metrics &getMetrics() const { return _metrics; }
+
+    // The outputs are fixed once finalize() returns, only then may other threads inspect them
+    bool isFinalized() const { return _finalized.load(std::memory_order_acquire); }
+    const std::vector<OutputSink> &getSinks() const { return _sinks; }
+
     void update(float deltaTime);
+    // compose() followed by transmit() on the calling thread
     void render();
+    // The frame loop split for a separate sender thread. compose() runs on the render thread
+    // after update() and turns the ring into output codes, transmit() runs on the sender and
+    // hands the newest composed frame to the outputs. Neither waits for the other.
+    void compose();
+    void transmit();
+    // The frame rate the ring needs, decided by the last render()
+    FrameRate frameRate() const { return _frameRate; }
     void clear();
 
 private:
-    void initDark();
-    void initStarting();
-    void initIdle();
-    void initWindup();
-    void initExplosion();
-    void initFade();
-
-    void updateDark(float deltaTime);
-    void updateStarting(float deltaTime);
-    void updateIdle(float deltaTime);
-    void updateWindup(float deltaTime);
-    void updateExplosion(float deltaTime);
-    void updateFade(float deltaTime);
-
-    void drawCWLine(float angleFrom, float angleTo, const color_t& color);
-    void drawCCWLine(float angleFrom, float angleTo, const color_t& color);
-    void drawFill(float fillRatio, const color_t& color);
-    void dimLeds(float multiplier, color_data_t addition);
+    // Headless benchmark, drives the stages and kernels directly (LedDriverBench.cpp)
+    friend class LedDriverBench;
+
+    void applyCommands();
+    // Takes over the settings of a committed reload, render thread
+    void adoptReload();
+    void traceCommand(int64_t receivedNs);
+
+    // Builds the stage in the slot that is not running, update() switches to it on the next frame
+    void enterStage(AnimStage stage);
+    // Runs one frame of the current stage's timeline program
+    void updateStage(StageState &state, float deltaTime);
+    TimelineParameters parameters() const;
+    // Palette colors in the ring's linear light
+    const color_t &paletteColor(PaletteColor color) const { return _palette[static_cast<size_t>(color)]; }
+    void updatePalette();
+    // Returns false when any sink failed to open. Sinks that own hardware, which cannot be opened
+    // twice, and capture files are skipped unless exclusive is set.
+    bool openOutputs(bool exclusive = true);
+    // Sender side of a reload switch, closes the replaced hardware sinks and opens their successors,
+    // a capture of the same file carries on in the new output
+    void handOverOutputs(LedDriver &replaced, size_t ringSize);
+    // Leaving sACN streams unterminated lets a reloaded output take them over
+    void closeOutputs(bool terminateStreams);
+    // Sizes the output code buffers for the ring and the sinks
+    void prepareOutputs();
+    // Sizes everything a frame needs for the configured ring, layers and outputs
+    void prepareFrame();
+    // Picks the frame rate from the stage and from how long the ring has been unchanged
+    void updateFrameRate(int64_t now);
+
+    StageState &currentStage() { return _stages[_currentStage]; }
+    const StageState &currentStage() const { return _stages[_currentStage]; }
+    StageState &nextStage() { return _stages[_currentStage ^ 1]; }
+    AnimStage currentStageType() const { return currentStage().stage; }
+
+    // Fingerprint of everything a bakeable stage run depends on, taken when the stage starts
+    uint64_t stageFingerprint(float deltaTime) const;
+
+    // Drawing goes into a compositor layer, update() composites the layers into the ring
+    void drawCWLine(size_t layer, float angleFrom, float angleTo, const color_t& color);
+    void drawCCWLine(size_t layer, float angleFrom, float angleTo, const color_t& color);
+    // Anti-aliased particle that moved from angleFrom to angleTo this frame
+    void drawSplat(const ParticleProgram &particle, float angleFrom, float angleTo, const color_t& color);
+    // Marks [begin, end) of a layer as drawn, the range may run past either end of the ring
+    void touchWrapped(size_t layer, long begin, long end);
+    color_t pulsedColor(const color_t &color) const;
+    void drawFill(size_t layer, float fillRatio, const color_t& color);
+    // Dims every layer when layer is negative
+    void dimLeds(int layer, float multiplier, color_data_t addition);
 
     inline float partialLedFromAngle(float angle);
 
     // Setup
     std::queue<int64_t> _ledSetupQueue;
 
+    // As configured or sent, in display values
     color_t _primary;
     color_t _secondary;
     color_t _fill;
+    // Indexed by PaletteColor
+    std::array<color_t, 3> _palette;
 
     // Runtime
     bool _running = false;
     bool _pulsing = false;
     float _pulseTime = 0.f;
     float _pulseValue = 1.f;
-    std::shared_ptr<IAnimStageData> _stageData;
-    std::shared_ptr<IAnimStageData> _nextStageData;
+    Timeline _timeline;
+    Compositor _compositor;
+    // The next stage is built in the other slot while the current one keeps running
+    std::array<StageState, 2> _stages;
+    size_t _currentStage = 0;
+    bool _stagePending = false;
 
     std::vector<color_t> _ledsRing;
 
-    std::mutex _stageMtx;
+    SpscQueue<LedCommand, 64> _commands;
+
+    int64_t _nextStageTraceNs = 0;
+    AtomicHistogram _controlLatency;
+    Metrics _metrics;
+    std::atomic<bool> _finalized{false};
+
+    // The reloaded settings until the render thread swaps them in, then the replaced ones
+    std::unique_ptr<LedDriver> _staged;
+    bool _reloadCommitted = false;
+    // Set by the control thread, taken by the render thread
+    std::atomic<LedDriver *> _reloadRequest{nullptr};
+    // Set by the sender once it switched to the reloaded outputs
+    std::atomic<bool> _reloadSwitched{false};
+    const ArtNetDiscovery *_artNetDiscovery = nullptr;
 
     struct {
         double starting_time = 1.0;
@@ -174,16 +230,43 @@ private:
     } _configuration;
 
     // Rendering
-#ifdef CONTROL_ARTNET
-    int _sockfd;
-    int _ledPaddingStart = 3;
-    int _ledCountStart = 38;
-    int _ledPaddingEnd = 3;
-    int _ledCountEnd = 38;
-    sockaddr_in _remote;
-    std::string _remoteAddress = "127.0.0.1";
-    void sendArtNet();
-#endif // CONTROL_ARTNET
+    // Stages that run at the active frame rate, and how long the ring has to stay unchanged
+    // before the keepalive rate takes over
+    std::array<bool, TIMELINE_STAGE_COUNT> _activeStages = {false, true, false, true, true, false};
+    double _idleAfter = 2.0;
+    FrameRate _frameRate = FrameRate::kNormal;
+    int64_t _lastChangeNs = 0;
+    // The ring as of the last change
+    std::vector<color_t> _ledsLast;
+    ColorCurve _colorCurve;
+    // The ring as output codes, handed from compose() to transmit()
+    struct OutputFrame {
+        // 8-bit codes, and 16-bit ones when a sink takes those
+        std::vector<color_t> narrow;
+        std::vector<color_t> wide;
+        // Receive times of the commands this frame is the first to show, resolved once it is sent
+        std::array<int64_t, 64> traces;
+        size_t traceCount = 0;
+        // Color curve time, the sender adds the encode
+        int64_t composeNs = 0;
+        // The layout the frame was composed for, counted up by every reload, and the driver
+        // holding its outputs while the sender may not have switched to them yet
+        uint64_t layout = 0;
+        LedDriver *reload = nullptr;
+    };
+    TripleBuffer<OutputFrame> _frames;
+    bool _wideOutput = false;
+    // Render thread side of a reload the sender has not switched to yet
+    uint64_t _layout = 0;
+    LedDriver *_pendingReload = nullptr;
+    // Only touched by the thread calling transmit()
+    std::vector<OutputSink> _sinks;
+    uint64_t _sinksLayout = 0;
+    BakeCache _bakeCache;
+    // Between the render thread's bake cache and writeBakes()
+    BakeChannel _bakeChannel;
+    // Cleared while the bake cache supplies the frame, the stage logic then only advances its state
+    bool _drawing = true;
 };
 
 #endif // _LED_DRIVER_H
\ No newline at end of file
@@ -0,0 +1,255 @@
+// Headless benchmark of the frame pipeline. Drives LedDriver with a synthetic
+// frame step through every animation stage and encodes the frames into an
+// Art-Net output whose socket is never opened.
+//
+// Usage: led_driver_bench [ring sizes...]   (default 70 1000 10000 100000)
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <libconfig.h++>
+
+#include "Clock.h"
+#include "LedDriver.h"
+#include "LedKernels.h"
+
+namespace
+{
+uint64_t allocationCount = 0;
+uint64_t allocationBytes = 0;
+
+const float kDeltaTime = 1.f / 30.f;
+// Frames per stage run, short enough for every stage to stay in place with the default timing
+const int kBurstFrames = 24;
+
+struct Sample {
+    uint64_t nanos = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+};
+
+// Swallows the driver's stage switch logging while measuring
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+};
+
+// Counts allocations and time between construction and stop()
+class Probe
+{
+public:
+    Probe(Sample &sample)
+        : _sample(sample), _allocations(allocationCount), _bytes(allocationBytes), _start(monotonicNanos())
+    {
+    }
+
+    void stop(uint64_t frames)
+    {
+        _sample.nanos += monotonicNanos() - _start;
+        _sample.allocations += allocationCount - _allocations;
+        _sample.bytes += allocationBytes - _bytes;
+        _sample.frames += frames;
+    }
+
+private:
+    Sample &_sample;
+    uint64_t _allocations;
+    uint64_t _bytes;
+    int64_t _start;
+};
+
+const char *const kStageNames[] = {"dark", "starting", "idle", "windup", "explosion", "fade"};
+}
+
+// Counting replacements of the global allocation functions. GCC pairs the replaced
+// operator new with these deletes and wrongly reports the free() as mismatched.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void *operator new(size_t size)
+{
+    ++allocationCount;
+    allocationBytes += size;
+    if (void *memory = malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+#pragma GCC diagnostic pop
+
+class LedDriverBench
+{
+public:
+    LedDriverBench(uint32_t ringSize)
+        : _ringSize(ringSize)
+    {
+        libconfig::Config config;
+        config.readString("led_count = " + std::to_string(ringSize) + ";\n"
+                          "outputs = ( { type = \"artnet\"; pixel_map = ( { universe = 0; count = " +
+                          std::to_string(ringSize) + "; } ); } );\n");
+        _driver.applyConfig(config.getRoot());
+        // Registers the universes without opening the socket, so render() encodes but never reaches sendmmsg
+        _artnet = &std::get<ArtNetSink>(_driver._sinks[0]);
+        _artnet->compile();
+        _driver.prepareOutputs();
+        _driver._compositor.configure(_driver._timeline.layers(), ringSize);
+        _driver.enterStage(AnimStage::kDark);
+        _driver.update(0.f);
+        _wireBytes = _artnet->output().universeCount() * ARTNET_FULL_PACKET_SIZE;
+    }
+
+    // Every run enters the stage from its natural predecessor, then steps kBurstFrames frames
+    Sample runStage(AnimStage stage, uint64_t frames)
+    {
+        Sample sample;
+        while (sample.frames < frames)
+        {
+            if (stage > AnimStage::kDark)
+            {
+                _driver.advanceStage(static_cast<AnimStage>(stage - 1), true);
+                _driver.update(kDeltaTime);
+            }
+            _driver.advanceStage(stage, true);
+
+            Probe probe(sample);
+            for (int i = 0; i < kBurstFrames; ++i)
+            {
+                _driver.update(kDeltaTime);
+                _driver.render();
+            }
+            probe.stop(kBurstFrames);
+        }
+        return sample;
+    }
+
+    template <typename Kernel>
+    Sample runKernel(uint64_t frames, Kernel kernel)
+    {
+        Sample sample;
+        Probe probe(sample);
+        for (uint64_t i = 0; i < frames; ++i)
+        {
+            kernel(i);
+        }
+        probe.stop(frames);
+        return sample;
+    }
+
+    void run(uint64_t frames, std::ostream &out)
+    {
+        for (int stage = AnimStage::kDark; stage <= AnimStage::kFade; ++stage)
+        {
+            report(out, kStageNames[stage], runStage(static_cast<AnimStage>(stage), frames), _wireBytes);
+        }
+
+        std::vector<color_t> &leds = _driver._ledsRing;
+        report(out, "dimLeds", runKernel(frames, [&](uint64_t) {
+                   dimLeds(leds.data(), leds.size(), 0.8f, 0);
+               }), 0);
+        report(out, "drawFill", runKernel(frames, [&](uint64_t i) {
+                   _driver.drawFill(0, 0.4f + (i % 60) * 0.01f, _driver._fill);
+               }), 0);
+        report(out, "drawCWLine", runKernel(frames, [&](uint64_t i) {
+                   float from = (i * 12) % 360;
+                   _driver.drawCWLine(0, from, from + 12.f, _driver._primary);
+               }), 0);
+        ParticleProgram splat;
+        splat.footprint = 3.f;
+        splat.blur = 1.f;
+        splat.splat.build(splat.footprint, splat.shape);
+        report(out, "drawSplat", runKernel(frames, [&](uint64_t i) {
+                   float from = (i * 12) % 360;
+                   _driver.drawSplat(splat, from, from + 12.f, _driver._primary);
+               }), 0);
+        report(out, "composite", runKernel(frames, [&](uint64_t) {
+                   _driver._compositor.invalidate();
+                   _driver._compositor.composite(leds.data());
+               }), 0);
+        std::vector<color_t> codes(leds.size());
+        report(out, "color curve", runKernel(frames, [&](uint64_t) {
+                   _driver._colorCurve.apply(leds.data(), codes.data(), nullptr, leds.size());
+               }), 0);
+        report(out, "artnet encode", runKernel(frames, [&](uint64_t) {
+                   _artnet->encode(codes.data(), codes.size());
+               }), _wireBytes);
+
+        // The unbatched per-universe encoder, kept for comparison with the pixel map encode
+        std::vector<uint8_t> packet(ARTNET_FULL_PACKET_SIZE);
+        size_t universes = _artnet->output().universeCount();
+        uint32_t ledsPerUniverse = DMX_UNIVERSE_SIZE / PIXEL_CHANNELS;
+        report(out, "constructArtNetPacket", runKernel(frames, [&](uint64_t) {
+                   for (size_t u = 0; u < universes; ++u)
+                   {
+                       uint32_t first = u * ledsPerUniverse;
+                       int32_t count = std::min<uint32_t>(ledsPerUniverse, _ringSize - first);
+                       constructArtNetPacket(packet.data(), codes.data() + first, count, u & 0xFF, (u >> 8) & 0x7F);
+                   }
+               }), _wireBytes);
+    }
+
+private:
+    void report(std::ostream &out, const char *name, const Sample &sample, size_t wireBytes)
+    {
+        char line[160];
+        snprintf(line, sizeof(line), "%8u  %-22s %12.0f %10.2f %12.1f %10zu\n", _ringSize, name,
+                 static_cast<double>(sample.nanos) / sample.frames,
+                 static_cast<double>(sample.allocations) / sample.frames,
+                 static_cast<double>(sample.bytes) / sample.frames, wireBytes);
+        out << line << std::flush;
+    }
+
+    uint32_t _ringSize;
+    size_t _wireBytes = 0;
+    LedDriver _driver;
+    ArtNetSink *_artnet = nullptr;
+};
+
+int main(int argc, char *argv[])
+{
+    std::vector<uint32_t> ringSizes;
+    for (int i = 1; i < argc; ++i)
+    {
+        ringSizes.push_back(strtoul(argv[i], nullptr, 10));
+    }
+    if (ringSizes.empty())
+    {
+        ringSizes = {70, 1000, 10000, 100000};
+    }
+
+    // Results go to stderr, the driver's own logging to stdout is muted
+    NullBuffer nullBuffer;
+    std::streambuf *coutBuffer = std::cout.rdbuf(&nullBuffer);
+    std::cerr << "    ring  stage/kernel               ns/frame  allocs/frame  alloc B/frame  wire B/frame" << std::endl;
+    for (uint32_t ringSize : ringSizes)
+    {
+        if (ringSize == 0)
+        {
+            continue;
+        }
+        // Roughly the same amount of pixel work for every ring size
+        uint64_t frames = std::max<uint64_t>(kBurstFrames * 10, 20000000ULL / ringSize);
+        frames = std::min<uint64_t>(frames, kBurstFrames * 1000);
+        LedDriverBench bench(ringSize);
+        bench.run(frames, std::cerr);
+    }
+    std::cout.rdbuf(coutBuffer);
+    return 0;
+}
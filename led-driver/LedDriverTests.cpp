@@ -0,0 +1,222 @@
+// Unit tests of the wire formats: control datagram parsing, the pixel map's universe
+// layout and the byte offsets of the sACN and ArtSync packets. Exits non-zero when any
+// check fails.
+//
+// Usage: led_driver_tests
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "ArtNet.h"
+#include "ControlProtocol.h"
+#include "PixelMap.h"
+#include "Sacn.h"
+
+namespace
+{
+int failures = 0;
+
+#define CHECK(condition)                                                                          \
+    do                                                                                            \
+    {                                                                                             \
+        if (!(condition))                                                                         \
+        {                                                                                         \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++failures;                                                                           \
+        }                                                                                         \
+    } while (0)
+
+uint16_t readU16(const uint8_t *field)
+{
+    return static_cast<uint16_t>(field[0] << 8 | field[1]);
+}
+
+// A binary control datagram header followed by the given command bytes
+std::vector<uint8_t> controlDatagram(uint8_t version, uint8_t count, const std::vector<uint8_t> &commands)
+{
+    std::vector<uint8_t> datagram = {'L', 'E', 'D', 'C', version, count, 0, 0};
+    datagram.insert(datagram.end(), commands.begin(), commands.end());
+    return datagram;
+}
+
+ControlParseResult parse(const std::vector<uint8_t> &datagram, size_t &commandCount, size_t capacity = CONTROL_MAX_COMMANDS)
+{
+    static LedCommand commands[CONTROL_MAX_COMMANDS];
+    return parseControlMessage(datagram.data(), datagram.size(), commands, capacity, commandCount);
+}
+
+void testControlDatagrams()
+{
+    size_t count = 0;
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x01, 1, AnimStage::kIdle}), count) == ControlParseResult::kOk);
+    CHECK(count == 1);
+
+    // Truncated: a header cut short, a missing command and a payload running past the end
+    std::vector<uint8_t> header = controlDatagram(CONTROL_PROTOCOL_VERSION, 0, {});
+    header.resize(CONTROL_HEADER_SIZE - 1);
+    CHECK(parse(header, count) == ControlParseResult::kMalformed);
+    CHECK(count == 0);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 2, {0x04, 1, 1}), count) == ControlParseResult::kMalformed);
+    CHECK(count == 1);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x03, 24, 0, 255}), count) == ControlParseResult::kMalformed);
+    CHECK(count == 0);
+
+    // Oversized: more commands than a datagram may carry or the caller has room for, and a
+    // datagram the receive buffer cut off at CONTROL_MAX_DATAGRAM
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, CONTROL_MAX_COMMANDS + 1, {}), count) ==
+          ControlParseResult::kTooManyCommands);
+    CHECK(count == 0);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 2, {0x04, 1, 1, 0x04, 1, 0}), count, 1) ==
+          ControlParseResult::kTooManyCommands);
+    std::vector<uint8_t> padded;
+    for (int i = 0; i < CONTROL_MAX_COMMANDS; ++i)
+    {
+        // Set pulsing with an appended 254 bytes, which newer senders may add
+        padded.push_back(0x04);
+        padded.push_back(255);
+        padded.insert(padded.end(), 255, 1);
+    }
+    std::vector<uint8_t> oversized = controlDatagram(CONTROL_PROTOCOL_VERSION, CONTROL_MAX_COMMANDS, padded);
+    oversized.resize(CONTROL_MAX_DATAGRAM);
+    CHECK(parse(oversized, count) == ControlParseResult::kMalformed);
+    CHECK(count == (CONTROL_MAX_DATAGRAM - CONTROL_HEADER_SIZE) / (CONTROL_COMMAND_HEADER_SIZE + 255));
+
+    // Parameter values: NaN and a zero ramp time are rejected, a negative speed is not
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x05, 5, 4, 0x3F, 0x80, 0, 0}), count) == ControlParseResult::kOk);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x05, 5, 4, 0, 0, 0, 0}), count) == ControlParseResult::kMalformed);
+    CHECK(count == 0);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x05, 5, 1, 0x7F, 0xC0, 0, 0}), count) == ControlParseResult::kMalformed);
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION, 1, {0x05, 5, 1, 0xBF, 0x80, 0, 0}), count) == ControlParseResult::kOk);
+
+    // Wrong version: nothing of the datagram is applied
+    CHECK(parse(controlDatagram(CONTROL_PROTOCOL_VERSION + 1, 1, {0x01, 1, AnimStage::kIdle}), count) ==
+          ControlParseResult::kUnsupportedVersion);
+    CHECK(count == 0);
+}
+
+void testPixelMapSplit()
+{
+    std::vector<color_t> leds(200);
+    for (size_t i = 0; i < leds.size(); ++i)
+    {
+        leds[i] = color_t{.r = static_cast<color_data_t>(i), .g = 1, .b = 2, .w = 3};
+    }
+
+    // 128 RGBW pixels fill a universe, the 129th starts the next one at channel 0
+    PixelMap map;
+    PixelSegment segment;
+    segment.universe = 3;
+    segment.count = 200;
+    CHECK(map.addSegment(segment));
+    ArtNetOutput artNet;
+    CHECK(map.compile(artNet));
+    CHECK(artNet.universeCount() == 2);
+    CHECK(artNet.portAddress(1) == 4);
+    map.scatter(leds.data(), artNet.packet(0));
+    CHECK(artNet.packet(0)[ARTNET_HEADER_SIZE + 127 * PIXEL_CHANNELS] == 127);
+    CHECK(artNet.packet(1)[ARTNET_HEADER_SIZE] == 128);
+    CHECK(artNet.packet(1)[ARTNET_HEADER_SIZE + 71 * PIXEL_CHANNELS] == 199);
+
+    // A pixel never straddles two universes
+    PixelMap offset;
+    segment.universe = 1;
+    segment.startChannel = 506;
+    segment.count = 2;
+    CHECK(offset.addSegment(segment));
+    SacnOutput sacn;
+    CHECK(offset.compile(sacn));
+    CHECK(sacn.universeCount() == 2);
+    CHECK(sacn.universe(1) == 2);
+    offset.scatter(leds.data(), sacn.packet(0));
+    CHECK(sacn.packet(0)[SACN_HEADER_SIZE + 506] == 0);
+    CHECK(sacn.packet(0)[SACN_HEADER_SIZE + 510] == 0);
+    CHECK(sacn.packet(1)[SACN_HEADER_SIZE] == 1);
+
+    // 16-bit pixels take 8 channels, 64 of them fill a universe
+    PixelMap wide;
+    CHECK(wide.setDepth(16));
+    segment.universe = 0;
+    segment.startChannel = 0;
+    segment.count = 65;
+    CHECK(wide.addSegment(segment));
+    ArtNetOutput wideOutput;
+    CHECK(wide.compile(wideOutput));
+    CHECK(wideOutput.universeCount() == 2);
+    wide.scatter(leds.data(), wideOutput.packet(0));
+    CHECK(wideOutput.packet(1)[ARTNET_HEADER_SIZE + 1] == 64);
+}
+
+void testSacnPacket()
+{
+    uint8_t cid[SACN_CID_SIZE];
+    for (size_t i = 0; i < SACN_CID_SIZE; ++i)
+    {
+        cid[i] = static_cast<uint8_t>(0xA0 + i);
+    }
+    uint8_t packet[SACN_FULL_PACKET_SIZE];
+    initSacnPacket(packet, 0x1234, cid, "leddriver", 150);
+
+    // Root layer
+    CHECK(readU16(&packet[0]) == 0x0010);
+    CHECK(memcmp(&packet[4], "ASC-E1.17\0\0\0", 12) == 0);
+    CHECK(readU16(&packet[16]) == (0x7000 | (SACN_FULL_PACKET_SIZE - 16)));
+    CHECK(readU16(&packet[18]) == 0 && readU16(&packet[20]) == 0x0004);
+    CHECK(memcmp(&packet[SACN_CID_OFFSET], cid, SACN_CID_SIZE) == 0);
+    CHECK(SACN_CID_OFFSET + SACN_CID_SIZE == 38);
+
+    // Framing layer
+    CHECK(readU16(&packet[38]) == (0x7000 | (SACN_FULL_PACKET_SIZE - 38)));
+    CHECK(readU16(&packet[40]) == 0 && readU16(&packet[42]) == 0x0002);
+    CHECK(strcmp(reinterpret_cast<const char *>(&packet[SACN_SOURCE_NAME_OFFSET]), "leddriver") == 0);
+    CHECK(SACN_SOURCE_NAME_OFFSET + SACN_SOURCE_NAME_SIZE == SACN_PRIORITY_OFFSET);
+    CHECK(packet[SACN_PRIORITY_OFFSET] == 150);
+    CHECK(readU16(&packet[109]) == 0);
+    CHECK(SACN_SEQUENCE_OFFSET == 111 && packet[SACN_SEQUENCE_OFFSET] == 0);
+    CHECK(SACN_OPTIONS_OFFSET == 112 && packet[SACN_OPTIONS_OFFSET] == 0);
+    CHECK(readU16(&packet[SACN_UNIVERSE_OFFSET]) == 0x1234);
+
+    // DMP layer, the slots follow the start code
+    CHECK(readU16(&packet[115]) == (0x7000 | (SACN_FULL_PACKET_SIZE - 115)));
+    CHECK(packet[117] == 0x02);
+    CHECK(packet[118] == 0xa1);
+    CHECK(readU16(&packet[119]) == 0);
+    CHECK(readU16(&packet[121]) == 1);
+    CHECK(readU16(&packet[123]) == SACN_PAYLOAD_SIZE + 1);
+    CHECK(packet[125] == 0);
+    CHECK(SACN_HEADER_SIZE == 126);
+
+    sockaddr_in group = sacnMulticastAddress(0x1234);
+    CHECK(ntohl(group.sin_addr.s_addr) == 0xEFFF1234);
+    CHECK(ntohs(group.sin_port) == SACN_PORT);
+}
+
+void testArtSyncPacket()
+{
+    uint8_t packet[ARTNET_SYNC_PACKET_SIZE + 1];
+    memset(packet, 0xFF, sizeof(packet));
+    initArtSyncPacket(packet);
+    CHECK(memcmp(packet, "Art-Net\0", ARTNET_ID_SIZE) == 0);
+    // The opcode is little endian, the protocol version big endian
+    CHECK(packet[ARTNET_OPCODE_OFFSET] == 0x00 && packet[ARTNET_OPCODE_OFFSET + 1] == 0x52);
+    CHECK(packet[ARTNET_VERSION_OFFSET] == 0x00 && packet[ARTNET_VERSION_OFFSET + 1] == 0x0e);
+    CHECK(packet[12] == 0 && packet[13] == 0);
+    CHECK(ARTNET_SYNC_PACKET_SIZE == 14);
+    CHECK(packet[ARTNET_SYNC_PACKET_SIZE] == 0xFF);
+}
+}
+
+int main()
+{
+    testControlDatagrams();
+    testPixelMapSplit();
+    testSacnPacket();
+    testArtSyncPacket();
+    if (failures > 0)
+    {
+        std::cout << failures << " check(s) failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}
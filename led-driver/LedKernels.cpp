@@ -0,0 +1,243 @@
+#include "LedKernels.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+// Fill ratios overshoot 1 at the end of a fill, the ring saturates instead of wrapping
+inline color_data_t scaleChannel(color_data_t value, float ratio)
+{
+    return static_cast<color_data_t>(std::min(value * ratio, static_cast<float>(COLOR_DATA_MAX)));
+}
+
+inline color_t scaleColor(const color_t &color, float ratio)
+{
+    return color_t{
+        .r = scaleChannel(color.r, ratio),
+        .g = scaleChannel(color.g, ratio),
+        .b = scaleChannel(color.b, ratio),
+        .w = scaleChannel(color.w, ratio)};
+}
+
+inline color_data_t dimChannel(color_data_t value, float multiplier, color_data_t addition)
+{
+    return static_cast<color_data_t>(
+        std::min<uint32_t>(static_cast<uint32_t>(value * multiplier) + addition, COLOR_DATA_MAX));
+}
+
+void dimLedsScalar(color_t *leds, size_t count, float multiplier, color_data_t addition)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        leds[i].r = dimChannel(leds[i].r, multiplier, addition);
+        leds[i].g = dimChannel(leds[i].g, multiplier, addition);
+        leds[i].b = dimChannel(leds[i].b, multiplier, addition);
+        leds[i].w = dimChannel(leds[i].w, multiplier, addition);
+    }
+}
+
+void maxFillScalar(color_t *leds, size_t count, const color_t &fill)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        leds[i].r = std::max(leds[i].r, fill.r);
+        leds[i].g = std::max(leds[i].g, fill.g);
+        leds[i].b = std::max(leds[i].b, fill.b);
+        leds[i].w = std::max(leds[i].w, fill.w);
+    }
+}
+
+void maxBlendScalar(color_t *out, const color_t *layer, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        out[i].r = std::max(out[i].r, layer[i].r);
+        out[i].g = std::max(out[i].g, layer[i].g);
+        out[i].b = std::max(out[i].b, layer[i].b);
+        out[i].w = std::max(out[i].w, layer[i].w);
+    }
+}
+
+inline color_data_t addChannel(color_data_t a, color_data_t b)
+{
+    return static_cast<color_data_t>(std::min<uint32_t>(static_cast<uint32_t>(a) + b, COLOR_DATA_MAX));
+}
+
+void addBlendScalar(color_t *out, const color_t *layer, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        out[i].r = addChannel(out[i].r, layer[i].r);
+        out[i].g = addChannel(out[i].g, layer[i].g);
+        out[i].b = addChannel(out[i].b, layer[i].b);
+        out[i].w = addChannel(out[i].w, layer[i].w);
+    }
+}
+}
+
+// Two RGBW quads fit into one 128-bit vector
+#define LEDS_PER_VECTOR 2
+
+void dimLeds(color_t *leds, size_t count, float multiplier, color_data_t addition)
+{
+    size_t vectorCount = count - count % LEDS_PER_VECTOR;
+#if defined(__SSE2__)
+    const __m128 mul = _mm_set1_ps(multiplier);
+    const __m128i add = _mm_set1_epi32(addition);
+    const __m128i zero = _mm_setzero_si128();
+    // SSE2 only packs with signed saturation, shifting by half the range makes it an unsigned one
+    const __m128i half = _mm_set1_epi32(0x8000);
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        __m128i *ptr = reinterpret_cast<__m128i *>(&leds[i]);
+        __m128i channels = _mm_loadu_si128(ptr);
+        __m128i lo = _mm_unpacklo_epi16(channels, zero);
+        __m128i hi = _mm_unpackhi_epi16(channels, zero);
+        lo = _mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), mul)), add);
+        hi = _mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), mul)), add);
+        lo = _mm_sub_epi32(lo, half);
+        hi = _mm_sub_epi32(hi, half);
+        _mm_storeu_si128(ptr, _mm_xor_si128(_mm_packs_epi32(lo, hi), bias));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t mul = vdupq_n_f32(multiplier);
+    const uint32x4_t add = vdupq_n_u32(addition);
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        uint16_t *ptr = reinterpret_cast<uint16_t *>(&leds[i]);
+        uint16x8_t channels = vld1q_u16(ptr);
+        uint32x4_t lo = vmovl_u16(vget_low_u16(channels));
+        uint32x4_t hi = vmovl_u16(vget_high_u16(channels));
+        lo = vaddq_u32(vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(lo), mul)), add);
+        hi = vaddq_u32(vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(hi), mul)), add);
+        vst1q_u16(ptr, vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi)));
+    }
+#else
+    vectorCount = 0;
+#endif
+    dimLedsScalar(leds + vectorCount, count - vectorCount, multiplier, addition);
+}
+
+void maxFill(color_t *leds, size_t count, const color_t &color, float ratio)
+{
+    const color_t fill = scaleColor(color, ratio);
+    size_t vectorCount = count - count % LEDS_PER_VECTOR;
+#if defined(__SSE2__)
+    // SSE2 only has a signed 16-bit max, flipping the sign bit turns it into an unsigned one
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    const __m128i fillVector = _mm_xor_si128(
+        _mm_set_epi16(fill.w, fill.b, fill.g, fill.r, fill.w, fill.b, fill.g, fill.r), bias);
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        __m128i *ptr = reinterpret_cast<__m128i *>(&leds[i]);
+        __m128i channels = _mm_xor_si128(_mm_loadu_si128(ptr), bias);
+        _mm_storeu_si128(ptr, _mm_xor_si128(_mm_max_epi16(channels, fillVector), bias));
+    }
+#elif defined(__ARM_NEON)
+    const uint16x4_t quad = vld1_u16(reinterpret_cast<const uint16_t *>(&fill));
+    const uint16x8_t fillVector = vcombine_u16(quad, quad);
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        uint16_t *ptr = reinterpret_cast<uint16_t *>(&leds[i]);
+        vst1q_u16(ptr, vmaxq_u16(vld1q_u16(ptr), fillVector));
+    }
+#else
+    vectorCount = 0;
+#endif
+    maxFillScalar(leds + vectorCount, count - vectorCount, fill);
+}
+
+void fillSpan(color_t *leds, size_t begin, size_t end, const color_t &color)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+    // A quad is 64 bits wide, so the compiler turns this into plain wide stores
+    std::fill(leds + begin, leds + end, color);
+}
+
+void maxBlend(color_t *out, const color_t *layer, size_t count)
+{
+    size_t vectorCount = count - count % LEDS_PER_VECTOR;
+#if defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        __m128i *ptr = reinterpret_cast<__m128i *>(&out[i]);
+        __m128i a = _mm_xor_si128(_mm_loadu_si128(ptr), bias);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&layer[i])), bias);
+        _mm_storeu_si128(ptr, _mm_xor_si128(_mm_max_epi16(a, b), bias));
+    }
+#elif defined(__ARM_NEON)
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        uint16_t *ptr = reinterpret_cast<uint16_t *>(&out[i]);
+        vst1q_u16(ptr, vmaxq_u16(vld1q_u16(ptr), vld1q_u16(reinterpret_cast<const uint16_t *>(&layer[i]))));
+    }
+#else
+    vectorCount = 0;
+#endif
+    maxBlendScalar(out + vectorCount, layer + vectorCount, count - vectorCount);
+}
+
+void addBlend(color_t *out, const color_t *layer, size_t count)
+{
+    size_t vectorCount = count - count % LEDS_PER_VECTOR;
+#if defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    const __m128i limit = _mm_xor_si128(_mm_set1_epi16(static_cast<short>(COLOR_DATA_MAX)), bias);
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        __m128i *ptr = reinterpret_cast<__m128i *>(&out[i]);
+        __m128i sum = _mm_adds_epu16(_mm_loadu_si128(ptr), _mm_loadu_si128(reinterpret_cast<const __m128i *>(&layer[i])));
+        _mm_storeu_si128(ptr, _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(sum, bias), limit), bias));
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t limit = vdupq_n_u16(COLOR_DATA_MAX);
+    for (size_t i = 0; i < vectorCount; i += LEDS_PER_VECTOR)
+    {
+        uint16_t *ptr = reinterpret_cast<uint16_t *>(&out[i]);
+        uint16x8_t sum = vqaddq_u16(vld1q_u16(ptr), vld1q_u16(reinterpret_cast<const uint16_t *>(&layer[i])));
+        vst1q_u16(ptr, vminq_u16(sum, limit));
+    }
+#else
+    vectorCount = 0;
+#endif
+    addBlendScalar(out + vectorCount, layer + vectorCount, count - vectorCount);
+}
+
+void alphaBlend(color_t *out, const color_t *layer, size_t count, float opacity)
+{
+    float keep = 1.f - opacity;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const color_t &source = layer[i];
+        if ((source.r | source.g | source.b | source.w) == 0)
+        {
+            continue;
+        }
+        out[i].r = static_cast<color_data_t>(out[i].r * keep + source.r * opacity);
+        out[i].g = static_cast<color_data_t>(out[i].g * keep + source.g * opacity);
+        out[i].b = static_cast<color_data_t>(out[i].b * keep + source.b * opacity);
+        out[i].w = static_cast<color_data_t>(out[i].w * keep + source.w * opacity);
+    }
+}
+
+void multiplyBlend(color_t *out, const color_t *layer, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        out[i].r = static_cast<color_data_t>(static_cast<uint32_t>(out[i].r) * layer[i].r / COLOR_DATA_MAX);
+        out[i].g = static_cast<color_data_t>(static_cast<uint32_t>(out[i].g) * layer[i].g / COLOR_DATA_MAX);
+        out[i].b = static_cast<color_data_t>(static_cast<uint32_t>(out[i].b) * layer[i].b / COLOR_DATA_MAX);
+        out[i].w = static_cast<color_data_t>(static_cast<uint32_t>(out[i].w) * layer[i].w / COLOR_DATA_MAX);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _LED_KERNELS_H
+#define _LED_KERNELS_H
+
+#include <stddef.h>
+
+#include "LedDefs.h"
+
+// Per-frame framebuffer passes. They are vectorized with SSE2 or NEON where
+// available and produce bit-identical results to the scalar fallback.
+
+// led = min(static_cast<color_data_t>(led * multiplier) + addition, COLOR_DATA_MAX), per channel
+void dimLeds(color_t *leds, size_t count, float multiplier, color_data_t addition);
+
+// led = max(led, min(color * ratio, COLOR_DATA_MAX)), per channel
+void maxFill(color_t *leds, size_t count, const color_t &color, float ratio);
+
+// Sets every LED in [begin, end) to the color
+void fillSpan(color_t *leds, size_t begin, size_t end, const color_t &color);
+
+// Layer blending, the layer is applied on top of out
+// out = max(out, layer), per channel
+void maxBlend(color_t *out, const color_t *layer, size_t count);
+
+// out = min(out + layer, COLOR_DATA_MAX), per channel
+void addBlend(color_t *out, const color_t *layer, size_t count);
+
+// out = out * (1 - opacity) + layer * opacity, black layer pixels are transparent
+void alphaBlend(color_t *out, const color_t *layer, size_t count, float opacity);
+
+// out = out * layer / COLOR_DATA_MAX, per channel
+void multiplyBlend(color_t *out, const color_t *layer, size_t count);
+
+#endif // _LED_KERNELS_H
@@ -0,0 +1,30 @@
+#include "MetricsWriter.h"
+
+#include <cstdio>
+
+void MetricsWriter::declare(const char *name, const char *type, const char *help)
+{
+    _text += "# HELP ";
+    _text += name;
+    _text += " ";
+    _text += help;
+    _text += "\n# TYPE ";
+    _text += name;
+    _text += " ";
+    _text += type;
+    _text += "\n";
+}
+
+void MetricsWriter::value(const char *name, const std::string &labels, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.9g", value);
+    _text += name;
+    if (!labels.empty())
+    {
+        _text += "{" + labels + "}";
+    }
+    _text += " ";
+    _text += number;
+    _text += "\n";
+}
@@ -0,0 +1,41 @@
+#ifndef _METRICS_WRITER_H
+#define _METRICS_WRITER_H
+
+#include <stdint.h>
+#include <string>
+
+#include "Histogram.h"
+
+// Builds a Prometheus text exposition document. Every metric family must be
+// written in one go, declare() emits its HELP/TYPE header once per family.
+class MetricsWriter
+{
+public:
+    void declare(const char *name, const char *type, const char *help);
+
+    // labels is the inner part of the label set, e.g. installation="hall",universe="3"
+    void value(const char *name, const std::string &labels, double value);
+
+    // Writes a summary with 0.5/0.9/0.99 quantiles, sum and count. Histogram values are
+    // nanoseconds, the summary is scaled to seconds.
+    template <typename Counter>
+    void summary(const char *name, const std::string &labels, const BasicHistogram<Counter> &histogram)
+    {
+        std::string separator = labels.empty() ? "" : ",";
+        static const char *const kQuantiles[] = {"0.5", "0.9", "0.99"};
+        for (const char *quantile : kQuantiles)
+        {
+            value(name, labels + separator + "quantile=\"" + quantile + "\"",
+                  histogram.percentile(std::stod(quantile) * 100) * 1e-9);
+        }
+        value((std::string(name) + "_sum").c_str(), labels, histogram.sum() * 1e-9);
+        value((std::string(name) + "_count").c_str(), labels, histogram.count());
+    }
+
+    const std::string &str() const { return _text; }
+
+private:
+    std::string _text;
+};
+
+#endif // _METRICS_WRITER_H
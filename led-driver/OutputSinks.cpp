@@ -0,0 +1,584 @@
+#include "OutputSinks.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+// refresh_interval in seconds, 0 keeps sending every universe every frame
+bool readRefreshInterval(const libconfig::Setting &settings, int64_t &intervalNs)
+{
+    double interval = 0.0;
+    settings.lookupValue("refresh_interval", interval);
+    if (interval < 0.0)
+    {
+        std::cout << "refresh_interval must not be negative." << std::endl;
+        return false;
+    }
+    intervalNs = static_cast<int64_t>(interval * NS_PER_SEC);
+    return true;
+}
+}
+
+ArtNetSink::ArtNetSink(bool network)
+    : _network(network)
+{
+    _ledCount = addLegacySegments(38, 3, 38, 3);
+}
+
+uint32_t ArtNetSink::addLegacySegments(int countStart, int paddingStart, int countEnd, int paddingEnd)
+{
+    // The original layout: the first strip goes forward on universes 0 and 1,
+    // the second strip runs backwards from the end of the ring on universes 2 and 3
+    uint32_t ringSize = countStart + countEnd;
+    for (uint16_t universe = 0; universe < 4; ++universe)
+    {
+        PixelSegment segment;
+        if (!_remoteAddress.empty())
+        {
+            segment.controllers.push_back(_remoteAddress);
+        }
+        segment.universe = universe;
+        if (universe < 2)
+        {
+            segment.firstLed = 0;
+            segment.count = countStart - paddingStart;
+        }
+        else
+        {
+            segment.firstLed = ringSize - countEnd;
+            segment.count = countEnd - paddingEnd;
+            segment.reverse = true;
+        }
+        _pixelMap.addSegment(segment);
+    }
+    return ringSize;
+}
+
+bool ArtNetSink::applyConfig(const libconfig::Setting &settings, const libconfig::Setting *pixelMap)
+{
+    settings.lookupValue(_network ? "capture" : "path", _capturePath);
+    if (!_network && _capturePath.empty())
+    {
+        std::cout << "A file output needs a path." << std::endl;
+        return false;
+    }
+    settings.lookupValue("controller_ip", _remoteAddress);
+    settings.lookupValue("sync", _sync);
+    settings.lookupValue("sync_address", _syncAddress);
+    settings.lookupValue("discovery", _discover);
+    int64_t refreshIntervalNs;
+    if (!readRefreshInterval(settings, refreshIntervalNs))
+    {
+        return false;
+    }
+    _output.setRefreshInterval(refreshIntervalNs);
+    in_addr syncAddress;
+    if (!_syncAddress.empty() && inet_aton(_syncAddress.c_str(), &syncAddress) == 0)
+    {
+        std::cout << "Invalid Art-Net sync_address: " << _syncAddress << std::endl;
+        return false;
+    }
+    uint32_t depth = 8;
+    settings.lookupValue("depth", depth);
+    if (!_pixelMap.setDepth(depth))
+    {
+        return false;
+    }
+    if (!pixelMap && settings.exists("pixel_map"))
+    {
+        pixelMap = &settings.lookup("pixel_map");
+    }
+
+    if (pixelMap)
+    {
+        bool valid = _pixelMap.applyConfig(*pixelMap, _remoteAddress);
+        _ledCount = _pixelMap.ledCount();
+        return valid;
+    }
+
+    int ledCountStart = 38;
+    int ledCountEnd = 38;
+    int ledPaddingStart = 3;
+    int ledPaddingEnd = 3;
+    settings.lookupValue("leds.start", ledCountStart);
+    settings.lookupValue("leds.end", ledCountEnd);
+    settings.lookupValue("padding.start", ledPaddingStart);
+    settings.lookupValue("padding.end", ledPaddingEnd);
+
+    _pixelMap.clear();
+    _ledCount = addLegacySegments(ledCountStart, ledPaddingStart, ledCountEnd, ledPaddingEnd);
+    return true;
+}
+
+bool ArtNetSink::compile()
+{
+    if (_output.universeCount() == 0)
+    {
+        _compiled = _pixelMap.compile(_output);
+    }
+    return _compiled;
+}
+
+bool ArtNetSink::open(size_t ringSize)
+{
+    if (!compile())
+    {
+        return false;
+    }
+    if (_discover && _network && !(_discovery && _discovery->enabled()))
+    {
+        std::cout << "Art-Net output wants discovered nodes, but artnet_discovery is not enabled." << std::endl;
+    }
+    if (_sync && _network)
+    {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(ARTNET_PORT);
+        inet_aton(_syncAddress.c_str(), &address.sin_addr);
+        _output.enableSync(_syncAddress.empty() ? nullptr : &address);
+    }
+    if (!_capturePath.empty() && !_captureDeferred && !_capture.open(_capturePath))
+    {
+        return false;
+    }
+    if (_network && !_output.open())
+    {
+        std::cerr << "Failed to create network socket to send ArtNet packets." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ArtNetSink::openCapture(ArtNetSink *replaced)
+{
+    _captureDeferred = false;
+    if (replaced && replaced->_capture.isOpen())
+    {
+        _capture.takeOver(replaced->_capture);
+        return true;
+    }
+    return _capturePath.empty() || _capture.open(_capturePath);
+}
+
+void ArtNetSink::flush()
+{
+    if (_output.isOpen())
+    {
+        // Picks up the nodes discovery found since the last frame, usually nothing to do
+        if (_discover && _discovery && _discovery->fetchRoutes(_routesVersion, _routes))
+        {
+            _output.route(_routes);
+        }
+        _output.send();
+    }
+    _capture.append(_output);
+}
+
+void ArtNetSink::close()
+{
+    _output.close();
+    _capture.close();
+}
+
+namespace
+{
+// Parses the 32 hex digits of a UUID, dashes may go anywhere
+bool parseCid(const std::string &text, uint8_t *cid)
+{
+    size_t digits = 0;
+    for (char c : text)
+    {
+        if (c == '-')
+        {
+            continue;
+        }
+        int value = isxdigit(static_cast<unsigned char>(c)) ? (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10)) : -1;
+        if (value < 0 || digits >= SACN_CID_SIZE * 2)
+        {
+            return false;
+        }
+        cid[digits / 2] = static_cast<uint8_t>(digits % 2 ? cid[digits / 2] | value : value << 4);
+        ++digits;
+    }
+    return digits == SACN_CID_SIZE * 2;
+}
+
+// Receivers tell sources apart by their CID, deriving it from the host and the source name
+// keeps it the same across restarts
+void deriveCid(const std::string &sourceName, uint8_t *cid)
+{
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+    std::string name = std::string(host) + "/" + sourceName;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < SACN_CID_SIZE; ++i)
+    {
+        for (char c : name)
+        {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ i) * 0x100000001b3ULL;
+        cid[i] = static_cast<uint8_t>(hash >> 56);
+    }
+    // A name based UUID of the custom version
+    cid[6] = static_cast<uint8_t>((cid[6] & 0x0F) | 0x80);
+    cid[8] = static_cast<uint8_t>((cid[8] & 0x3F) | 0x80);
+}
+}
+
+bool SacnSink::applyConfig(const libconfig::Setting &settings)
+{
+    settings.lookupValue("source_name", _sourceName);
+    std::string cid;
+    if (settings.lookupValue("cid", cid))
+    {
+        if (!parseCid(cid, _cid))
+        {
+            std::cout << "Invalid sACN cid, expected a UUID: " << cid << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        deriveCid(_sourceName, _cid);
+    }
+    uint32_t priority = SACN_DEFAULT_PRIORITY;
+    settings.lookupValue("priority", priority);
+    if (priority > SACN_MAX_PRIORITY)
+    {
+        std::cout << "sACN priority must be between 0 and " << SACN_MAX_PRIORITY << "." << std::endl;
+        return false;
+    }
+    _priority = static_cast<uint8_t>(priority);
+    settings.lookupValue("multicast", _multicast);
+    std::string interface = "0.0.0.0";
+    settings.lookupValue("interface", interface);
+    if (inet_aton(interface.c_str(), &_interface) == 0)
+    {
+        std::cout << "Invalid sACN interface address: " << interface << std::endl;
+        return false;
+    }
+    uint32_t ttl = _ttl;
+    settings.lookupValue("ttl", ttl);
+    _ttl = static_cast<uint8_t>(std::min<uint32_t>(ttl, 255));
+    int64_t refreshIntervalNs;
+    if (!readRefreshInterval(settings, refreshIntervalNs))
+    {
+        return false;
+    }
+    _output.setRefreshInterval(refreshIntervalNs);
+
+    uint32_t depth = 8;
+    settings.lookupValue("depth", depth);
+    if (!_pixelMap.setDepth(depth))
+    {
+        return false;
+    }
+    if (!settings.exists("pixel_map"))
+    {
+        std::cout << "An sACN output needs a pixel_map." << std::endl;
+        return false;
+    }
+    // Without a controller the universes only go to their multicast groups
+    std::string controller;
+    settings.lookupValue("controller_ip", controller);
+    bool valid = _pixelMap.applyConfig(settings.lookup("pixel_map"), controller);
+    _ledCount = _pixelMap.ledCount();
+    return valid;
+}
+
+bool SacnSink::open(size_t ringSize)
+{
+    _output.setSource(_cid, _sourceName, _priority);
+    if (!_pixelMap.compile(_output))
+    {
+        return false;
+    }
+    if (_multicast)
+    {
+        for (size_t i = 0; i < _output.universeCount(); ++i)
+        {
+            _output.addDestination(i, sacnMulticastAddress(_output.universe(i)));
+        }
+    }
+    if (!_output.open(_interface, _ttl))
+    {
+        std::cerr << "Failed to create network socket to send sACN packets." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void SacnSink::flush()
+{
+    if (_output.isOpen())
+    {
+        _output.send();
+    }
+}
+
+void SacnSink::close()
+{
+    _output.terminate();
+    _output.close();
+}
+
+#ifdef LED_DRIVER_WS281X
+bool Ws281xSink::applyConfig(const libconfig::Setting &settings)
+{
+    settings.lookupValue("gpio", _gpio);
+    settings.lookupValue("dma", _dma);
+    settings.lookupValue("brightness", _brightness);
+    settings.lookupValue("first_led", _firstLed);
+    settings.lookupValue("count", _count);
+    settings.lookupValue("reverse", _reverse);
+
+    std::string stripType = "grbw";
+    settings.lookupValue("strip_type", stripType);
+    if (stripType == "grbw")
+    {
+        _stripType = SK6812_STRIP_GRBW;
+    }
+    else if (stripType == "rgbw")
+    {
+        _stripType = SK6812_STRIP_RGBW;
+    }
+    else if (stripType == "grb")
+    {
+        _stripType = WS2811_STRIP_GRB;
+    }
+    else if (stripType == "rgb")
+    {
+        _stripType = WS2811_STRIP_RGB;
+    }
+    else
+    {
+        std::cout << "Unknown ws281x strip_type: " << stripType << std::endl;
+        return false;
+    }
+    if (_count == 0)
+    {
+        std::cout << "A ws281x output needs a count." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Ws281xSink::open(size_t ringSize)
+{
+    _ws.freq = WS2811_TARGET_FREQ;
+    _ws.dmanum = _dma;
+    _ws.channel[0].gpionum = _gpio;
+    _ws.channel[0].count = _count;
+    _ws.channel[0].invert = 0;
+    _ws.channel[0].brightness = static_cast<uint8_t>(std::min(std::max(_brightness, 0), 255));
+    _ws.channel[0].strip_type = _stripType;
+    ws2811_return_t result = ws2811_init(&_ws);
+    if (result != WS2811_SUCCESS)
+    {
+        std::cerr << "Failed to initialize the ws281x output: " << ws2811_get_return_t_str(result) << std::endl;
+        return false;
+    }
+    _open = true;
+    return true;
+}
+
+void Ws281xSink::encode(const color_t *leds, size_t count)
+{
+    if (!_open || count < ledCount())
+    {
+        return;
+    }
+    ws2811_led_t *out = _ws.channel[0].leds;
+    for (uint32_t i = 0; i < _count; ++i)
+    {
+        const color_t &color = leds[_firstLed + (_reverse ? _count - 1 - i : i)];
+        out[i] = (static_cast<uint32_t>(color.w) << 24) |
+                 (static_cast<uint32_t>(color.r) << 16) |
+                 (static_cast<uint32_t>(color.g) << 8) |
+                 static_cast<uint32_t>(color.b);
+    }
+}
+
+void Ws281xSink::flush()
+{
+    if (!_open)
+    {
+        return;
+    }
+    ws2811_return_t result = ws2811_render(&_ws);
+    if (result != WS2811_SUCCESS)
+    {
+        std::cout << "ws281x render failed: " << ws2811_get_return_t_str(result) << std::endl;
+    }
+}
+
+void Ws281xSink::close()
+{
+    if (_open)
+    {
+        ws2811_wait(&_ws);
+        ws2811_fini(&_ws);
+        _open = false;
+    }
+}
+#endif // LED_DRIVER_WS281X
+
+bool ShmSink::applyConfig(const libconfig::Setting &settings)
+{
+    settings.lookupValue("name", _name);
+    if (_name.empty() || _name[0] != '/')
+    {
+        _name = "/" + _name;
+    }
+    return true;
+}
+
+bool ShmSink::open(size_t ringSize)
+{
+    int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create the shared memory object " << _name << ": " << errno << std::endl;
+        return false;
+    }
+    _size = sizeof(Header) + ringSize * PIXEL_CHANNELS;
+    void *memory = MAP_FAILED;
+    // Only ever grows the object, a reload may open it while the replaced output still writes
+    struct stat status;
+    if (fstat(fd, &status) == 0 && (static_cast<size_t>(status.st_size) >= _size || ftruncate(fd, _size) == 0))
+    {
+        memory = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Failed to map the shared memory object " << _name << ": " << errno << std::endl;
+        return false;
+    }
+
+    _ledCount = ringSize;
+    _header = static_cast<Header *>(memory);
+    // Readers of an existing object keep its sequence, encode() writes the new LED count
+    // inside its first update
+    if (memcmp(_header->magic, "LEDS", 4) != 0 || _header->version != 1)
+    {
+        _header = new (memory) Header{{'L', 'E', 'D', 'S'}, 1, static_cast<uint32_t>(ringSize), {0}, 0};
+    }
+    _pixels = static_cast<uint8_t *>(memory) + sizeof(Header);
+    return true;
+}
+
+void ShmSink::encode(const color_t *leds, size_t count)
+{
+    if (!_header)
+    {
+        return;
+    }
+    // Odd while the frame is being written, a writer that died mid-frame may have left it odd
+    uint32_t sequence = _header->sequence.load(std::memory_order_relaxed) & ~1u;
+    _header->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _header->ledCount = static_cast<uint32_t>(_ledCount);
+    _header->timestampNs = realtimeNanos();
+    uint8_t *pixel = _pixels;
+    count = std::min(count, _ledCount);
+    for (size_t i = 0; i < count; ++i, pixel += PIXEL_CHANNELS)
+    {
+        pixel[0] = static_cast<uint8_t>(leds[i].r);
+        pixel[1] = static_cast<uint8_t>(leds[i].g);
+        pixel[2] = static_cast<uint8_t>(leds[i].b);
+        pixel[3] = static_cast<uint8_t>(leds[i].w);
+    }
+    _header->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void ShmSink::close()
+{
+    if (_header)
+    {
+        munmap(_header, _size);
+        _header = nullptr;
+        _pixels = nullptr;
+    }
+}
+
+void DebugSink::encode(const color_t *leds, size_t count)
+{
+    std::cout << std::hex << std::setfill('0');
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::cout << std::setw(2) << static_cast<uint32_t>(leds[i].r) << std::setw(2) << static_cast<uint32_t>(leds[i].g)
+                  << std::setw(2) << static_cast<uint32_t>(leds[i].b) << std::setw(2) << static_cast<uint32_t>(leds[i].w) << " ";
+    }
+    std::cout << std::endl
+              << std::dec << std::setfill(' ');
+}
+
+namespace
+{
+template <typename Sink, typename... Args>
+bool addSink(const libconfig::Setting &settings, std::vector<OutputSink> &sinks, Args... args)
+{
+    Sink sink(args...);
+    if (!sink.applyConfig(settings))
+    {
+        return false;
+    }
+    sinks.emplace_back(std::move(sink));
+    return true;
+}
+}
+
+bool makeOutputSink(const libconfig::Setting &settings, std::vector<OutputSink> &sinks)
+{
+    std::string type;
+    settings.lookupValue("type", type);
+    if (type == "artnet")
+    {
+        return addSink<ArtNetSink>(settings, sinks);
+    }
+    if (type == "sacn")
+    {
+        return addSink<SacnSink>(settings, sinks);
+    }
+    if (type == "ws281x")
+    {
+#ifdef LED_DRIVER_WS281X
+        return addSink<Ws281xSink>(settings, sinks);
+#else
+        std::cout << "This build has no ws281x support (LED_DRIVER_WS281X is off)." << std::endl;
+        return false;
+#endif // LED_DRIVER_WS281X
+    }
+    if (type == "file")
+    {
+        return addSink<ArtNetSink>(settings, sinks, false);
+    }
+    if (type == "shm")
+    {
+        return addSink<ShmSink>(settings, sinks);
+    }
+    if (type == "debug")
+    {
+        return addSink<DebugSink>(settings, sinks);
+    }
+    if (type == "null")
+    {
+        return addSink<NullSink>(settings, sinks);
+    }
+    std::cout << "Unknown output type: \"" << type << "\"" << std::endl;
+    return false;
+}
@@ -0,0 +1,232 @@
+#ifndef _OUTPUT_SINKS_H
+#define _OUTPUT_SINKS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <variant>
+#include <vector>
+#include <libconfig.h++>
+
+#include "LedDefs.h"
+#include "ArtNet.h"
+#include "ArtNetDiscovery.h"
+#include "Capture.h"
+#include "PixelMap.h"
+#include "Sacn.h"
+
+#ifdef LED_DRIVER_WS281X
+#include "rpi_ws281x/ws2811.h"
+#endif // LED_DRIVER_WS281X
+
+// Frame outputs. Every sink has the same shape, the driver calls them in this order:
+//   applyConfig(settings)       while loading the config, returns false on invalid settings
+//   ledCount()                  the ring size the sink needs, 0 when it takes whatever the ring is
+//   depth()                     8 or 16, the bits per color of the output codes it encodes
+//   open(ringSize)              once, from finalize() on the render thread
+//   encode(leds, count)         every frame, converts the output codes into the sink's own buffers,
+//                               never reading or writing past count LEDs
+//   flush()                     every frame after all sinks encoded, hands the buffers to the hardware
+//   close()                     after the final dark frame
+// Sinks are held in a std::variant so the per-frame calls are dispatched without virtual calls.
+// They are only moved while unopened.
+
+// Art-Net over UDP through a pixel map, optionally recording every frame to a capture file.
+// Without the network it only writes the capture, which is the "file" output.
+class ArtNetSink
+{
+public:
+    explicit ArtNetSink(bool network = true);
+
+    // Reads controller_ip plus either pixel_map or the legacy leds/padding counts, the depth,
+    // sync and sync_address, discovery, refresh_interval, and the capture path (path for the file output). The single
+    // installation layout keeps its pixel map next to the artnet group, so the map may be
+    // given separately.
+    bool applyConfig(const libconfig::Setting &settings, const libconfig::Setting *pixelMap = nullptr);
+    uint32_t ledCount() const { return _ledCount; }
+    uint32_t depth() const { return _pixelMap.depth(); }
+    // Where discovered nodes come from when the output has discovery enabled, set before open()
+    void setDiscovery(const ArtNetDiscovery *discovery) { _discovery = discovery; }
+
+    bool open(size_t ringSize);
+    // Registers the universes without opening the socket, encode() then works while flush() does nothing
+    bool compile();
+    // Keeps open() from touching the capture file, which a running output may still be writing.
+    // openCapture() then continues the replaced output's capture of the same file, or starts it.
+    void deferCapture() { _captureDeferred = true; }
+    bool openCapture(ArtNetSink *replaced);
+    bool captureDeferred() const { return _captureDeferred; }
+    const std::string &capturePath() const { return _capturePath; }
+    void encode(const color_t *leds, size_t count)
+    {
+        // The scatter table reads up to the last mapped LED
+        if (count >= _ledCount)
+        {
+            _pixelMap.scatter(leds, _output.packet(0));
+        }
+    }
+    void flush();
+    void close();
+
+    const ArtNetOutput &output() const { return _output; }
+
+private:
+    uint32_t addLegacySegments(int countStart, int paddingStart, int countEnd, int paddingEnd);
+
+    bool _network;
+    std::string _remoteAddress = "127.0.0.1";
+    bool _sync = false;
+    // Empty sends ArtSync to each controller instead of one broadcast
+    std::string _syncAddress;
+    // Also sends each universe to the discovered nodes that output it
+    bool _discover = false;
+    const ArtNetDiscovery *_discovery = nullptr;
+    uint64_t _routesVersion = 0;
+    ArtNetRoutes _routes;
+    std::string _capturePath;
+    bool _captureDeferred = false;
+    uint32_t _ledCount = 0;
+    PixelMap _pixelMap;
+    // Whether the pixel map compiled without errors, the universes stay registered either way
+    bool _compiled = false;
+    ArtNetOutput _output;
+    CaptureWriter _capture;
+};
+
+// E1.31 (sACN) through a pixel map. Every universe goes to its multicast group unless that is
+// turned off, plus any controllers the pixel map names. Closing the output terminates the
+// streams, so receivers release the universes at once instead of holding the last frame.
+class SacnSink
+{
+public:
+    // Reads source_name, cid, priority, multicast, interface, ttl, refresh_interval, controller_ip,
+    // depth and pixel_map
+    bool applyConfig(const libconfig::Setting &settings);
+    uint32_t ledCount() const { return _ledCount; }
+    uint32_t depth() const { return _pixelMap.depth(); }
+
+    bool open(size_t ringSize);
+    void encode(const color_t *leds, size_t count)
+    {
+        if (_output.universeCount() > 0 && count >= _ledCount)
+        {
+            _pixelMap.scatter(leds, _output.packet(0));
+        }
+    }
+    void flush();
+    void close();
+    // Closes the socket without terminating the streams, for an output replaced by a reload
+    void detach() { _output.close(); }
+
+    const SacnOutput &output() const { return _output; }
+
+private:
+    std::string _sourceName = "leddriver";
+    uint8_t _cid[SACN_CID_SIZE] = {};
+    uint8_t _priority = SACN_DEFAULT_PRIORITY;
+    bool _multicast = true;
+    in_addr _interface = {INADDR_ANY};
+    uint8_t _ttl = 1;
+    uint32_t _ledCount = 0;
+    PixelMap _pixelMap;
+    SacnOutput _output;
+};
+
+#ifdef LED_DRIVER_WS281X
+// A strip on the Raspberry Pi PWM/PCM/SPI outputs through rpi_ws281x
+class Ws281xSink
+{
+public:
+    bool applyConfig(const libconfig::Setting &settings);
+    uint32_t ledCount() const { return _firstLed + _count; }
+    uint32_t depth() const { return 8; }
+
+    bool open(size_t ringSize);
+    void encode(const color_t *leds, size_t count);
+    void flush();
+    void close();
+
+private:
+    int _gpio = 18;
+    int _dma = 10;
+    int _brightness = 255;
+    int _stripType = SK6812_STRIP_GRBW;
+    uint32_t _firstLed = 0;
+    uint32_t _count = 0;
+    bool _reverse = false;
+    bool _open = false;
+    ws2811_t _ws = {};
+};
+#endif // LED_DRIVER_WS281X
+
+// Publishes the latest frame in a POSIX shared memory object for local viewers. Readers
+// retry while the sequence number is odd or changed during their copy.
+class ShmSink
+{
+public:
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t ledCount;
+        std::atomic<uint32_t> sequence;
+        int64_t timestampNs;
+    };
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "the frame sequence is shared between processes");
+
+    bool applyConfig(const libconfig::Setting &settings);
+    uint32_t ledCount() const { return 0; }
+    uint32_t depth() const { return 8; }
+
+    bool open(size_t ringSize);
+    void encode(const color_t *leds, size_t count);
+    void flush() {}
+    void close();
+
+private:
+    std::string _name = "/leddriver";
+    size_t _size = 0;
+    // LEDs the mapping holds
+    size_t _ledCount = 0;
+    Header *_header = nullptr;
+    uint8_t *_pixels = nullptr;
+};
+
+// Prints every frame as hex RGBW values, replaces the old RENDER_DEBUG build
+class DebugSink
+{
+public:
+    bool applyConfig(const libconfig::Setting &settings) { return true; }
+    uint32_t ledCount() const { return 0; }
+    uint32_t depth() const { return 8; }
+
+    bool open(size_t ringSize) { return true; }
+    void encode(const color_t *leds, size_t count);
+    void flush() {}
+    void close() {}
+};
+
+// Discards frames, for dry runs and benchmarks
+class NullSink
+{
+public:
+    bool applyConfig(const libconfig::Setting &settings) { return true; }
+    uint32_t ledCount() const { return 0; }
+    uint32_t depth() const { return 8; }
+
+    bool open(size_t ringSize) { return true; }
+    void encode(const color_t *leds, size_t count) {}
+    void flush() {}
+    void close() {}
+};
+
+using OutputSink = std::variant<ArtNetSink, SacnSink,
+#ifdef LED_DRIVER_WS281X
+                                Ws281xSink,
+#endif // LED_DRIVER_WS281X
+                                ShmSink, DebugSink, NullSink>;
+
+// Creates a sink from an entry of an outputs list, selected by its type key
+// ("artnet", "sacn", "ws281x", "file", "shm", "debug" or "null")
+bool makeOutputSink(const libconfig::Setting &settings, std::vector<OutputSink> &sinks);
+
+#endif // _OUTPUT_SINKS_H
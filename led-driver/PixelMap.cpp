@@ -0,0 +1,250 @@
+#include "PixelMap.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <arpa/inet.h>
+
+void PixelMap::clear()
+{
+    _segments.clear();
+    _table.clear();
+}
+
+bool PixelMap::setDepth(uint32_t depth)
+{
+    if (depth != 8 && depth != 16)
+    {
+        std::cout << "Pixel map depth must be 8 or 16 bits, not " << depth << "." << std::endl;
+        return false;
+    }
+    _pixelChannels = depth == 16 ? PIXEL_CHANNELS_WIDE : PIXEL_CHANNELS;
+    return true;
+}
+
+bool PixelMap::addSegment(const PixelSegment &segment)
+{
+    if (segment.startChannel + _pixelChannels > DMX_UNIVERSE_SIZE)
+    {
+        std::cout << "Pixel map segment starts at channel " << segment.startChannel
+                  << ", which leaves no room for a pixel." << std::endl;
+        return false;
+    }
+    for (const auto &controller : segment.controllers)
+    {
+        in_addr address;
+        if (inet_aton(controller.c_str(), &address) == 0)
+        {
+            std::cout << "Pixel map segment has an invalid controller address: " << controller << std::endl;
+            return false;
+        }
+    }
+    _segments.push_back(segment);
+    return true;
+}
+
+bool PixelMap::applyConfig(const libconfig::Setting &segments, const std::string &defaultController)
+{
+    clear();
+    bool valid = true;
+    for (int i = 0; i < segments.getLength(); ++i)
+    {
+        const libconfig::Setting &setting = segments[i];
+        PixelSegment segment;
+        uint32_t universe = 0;
+        uint32_t startChannel = 0;
+        if (setting.exists("controller") && setting["controller"].isAggregate())
+        {
+            // A list mirrors the segment onto several controllers
+            const libconfig::Setting &controllers = setting["controller"];
+            for (int j = 0; j < controllers.getLength(); ++j)
+            {
+                segment.controllers.push_back(controllers[j].c_str());
+            }
+        }
+        else
+        {
+            std::string controller = defaultController;
+            setting.lookupValue("controller", controller);
+            if (!controller.empty())
+            {
+                segment.controllers.push_back(controller);
+            }
+        }
+        setting.lookupValue("universe", universe);
+        setting.lookupValue("start_channel", startChannel);
+        setting.lookupValue("first_led", segment.firstLed);
+        setting.lookupValue("count", segment.count);
+        setting.lookupValue("reverse", segment.reverse);
+        segment.universe = static_cast<uint16_t>(std::min<uint32_t>(universe, 0xFFFF));
+        segment.startChannel = static_cast<uint16_t>(std::min<uint32_t>(startChannel, 0xFFFF));
+        if (!addSegment(segment))
+        {
+            std::cout << "Skipping pixel map segment " << i << "." << std::endl;
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+uint32_t PixelMap::ledCount() const
+{
+    uint32_t count = 0;
+    for (const auto &segment : _segments)
+    {
+        count = std::max(count, segment.firstLed + segment.count);
+    }
+    return count;
+}
+
+namespace
+{
+sockaddr_in controllerAddress(in_addr_t controller, uint16_t port)
+{
+    sockaddr_in remote{};
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(port);
+    remote.sin_addr.s_addr = controller;
+    return remote;
+}
+}
+
+bool PixelMap::compile(ArtNetOutput &output)
+{
+    auto addUniverse = [&](const std::vector<in_addr_t> &controllers, uint16_t universe) {
+        size_t index = output.addUniverse(universe & 0xFF, (universe >> 8) & 0x7F);
+        for (in_addr_t controller : controllers)
+        {
+            output.addDestination(index, controllerAddress(controller, ARTNET_PORT));
+        }
+        return index;
+    };
+    bool valid = compileLayout(addUniverse, 0, ARTNET_MAX_PORT_ADDRESS, ARTNET_FULL_PACKET_SIZE, ARTNET_HEADER_SIZE);
+    std::cout << "Pixel map: " << _table.size() << " pixels in " << output.universeCount() << " universes." << std::endl;
+    return valid;
+}
+
+bool PixelMap::compile(SacnOutput &output)
+{
+    auto addUniverse = [&](const std::vector<in_addr_t> &controllers, uint16_t universe) {
+        size_t index = output.addUniverse(universe);
+        for (in_addr_t controller : controllers)
+        {
+            output.addDestination(index, controllerAddress(controller, SACN_PORT));
+        }
+        return index;
+    };
+    bool valid = compileLayout(addUniverse, SACN_MIN_UNIVERSE, SACN_MAX_UNIVERSE, SACN_FULL_PACKET_SIZE, SACN_HEADER_SIZE);
+    std::cout << "Pixel map: " << _table.size() << " pixels in " << output.universeCount() << " sACN universes." << std::endl;
+    return valid;
+}
+
+bool PixelMap::compileLayout(const std::function<size_t(const std::vector<in_addr_t> &, uint16_t)> &addUniverse,
+                             uint32_t firstUniverse, uint32_t lastUniverse, size_t packetSize, size_t headerSize)
+{
+    // Each distinct set of controllers and universe gets exactly one packet, which is
+    // encoded once and sent to all of them
+    std::map<std::tuple<std::vector<in_addr_t>, uint16_t>, size_t> packets;
+    auto packetFor = [&](const std::vector<in_addr_t> &controllers, uint16_t universe) {
+        auto key = std::make_tuple(controllers, universe);
+        auto it = packets.find(key);
+        if (it != packets.end())
+        {
+            return it->second;
+        }
+        size_t index = addUniverse(controllers, universe);
+        packets.emplace(key, index);
+        return index;
+    };
+
+    _table.clear();
+    bool valid = true;
+    for (const auto &segment : _segments)
+    {
+        std::vector<in_addr_t> controllers;
+        for (const auto &controller : segment.controllers)
+        {
+            in_addr address;
+            inet_aton(controller.c_str(), &address);
+            controllers.push_back(address.s_addr);
+        }
+        std::sort(controllers.begin(), controllers.end());
+        controllers.erase(std::unique(controllers.begin(), controllers.end()), controllers.end());
+
+        uint32_t universe = segment.universe;
+        uint32_t channel = segment.startChannel;
+        for (uint32_t i = 0; i < segment.count; ++i)
+        {
+            // Pixels never straddle universes, a pixel that does not fit starts the next one
+            if (channel + _pixelChannels > DMX_UNIVERSE_SIZE)
+            {
+                ++universe;
+                channel = 0;
+            }
+            if (universe < firstUniverse || universe > lastUniverse)
+            {
+                std::cout << "Pixel map segment at LED " << segment.firstLed << " leaves the universes " << firstUniverse
+                          << " to " << lastUniverse << "." << std::endl;
+                valid = false;
+                break;
+            }
+            uint32_t led = segment.reverse ? segment.firstLed + segment.count - 1 - i : segment.firstLed + i;
+            size_t packet = packetFor(controllers, static_cast<uint16_t>(universe));
+            _table.push_back(ScatterEntry{
+                .led = led,
+                .offset = static_cast<uint32_t>(packet * packetSize + headerSize + channel)});
+            channel += _pixelChannels;
+        }
+    }
+
+    // Segments sharing a packet must not write the same channels. Pixels never straddle
+    // packets, so overlapping byte ranges always lie in the same packet.
+    std::vector<ScatterEntry> byOffset = _table;
+    std::sort(byOffset.begin(), byOffset.end(), [](const ScatterEntry &a, const ScatterEntry &b) {
+        return a.offset < b.offset;
+    });
+    for (size_t i = 1; i < byOffset.size(); ++i)
+    {
+        if (byOffset[i - 1].offset + _pixelChannels > byOffset[i].offset)
+        {
+            std::cout << "Pixel map LEDs " << byOffset[i - 1].led << " and " << byOffset[i].led
+                      << " overlap at channel " << (byOffset[i].offset % packetSize - headerSize)
+                      << " of the same universe." << std::endl;
+            valid = false;
+            break;
+        }
+    }
+
+    // Visit the ring in order, the writes are scattered over the packets instead
+    std::stable_sort(_table.begin(), _table.end(), [](const ScatterEntry &a, const ScatterEntry &b) {
+        return a.led < b.led;
+    });
+    return valid;
+}
+
+void PixelMap::scatter(const color_t *leds, uint8_t *packets) const
+{
+    if (_pixelChannels == PIXEL_CHANNELS_WIDE)
+    {
+        for (const auto &entry : _table)
+        {
+            const color_t &color = leds[entry.led];
+            uint8_t *channels = packets + entry.offset;
+            artNetWideChannelValue(channels + 0, color.r);
+            artNetWideChannelValue(channels + 2, color.g);
+            artNetWideChannelValue(channels + 4, color.b);
+            artNetWideChannelValue(channels + 6, color.w);
+        }
+        return;
+    }
+    for (const auto &entry : _table)
+    {
+        const color_t &color = leds[entry.led];
+        uint8_t *channels = packets + entry.offset;
+        channels[0] = artNetChannelValue(color.r);
+        channels[1] = artNetChannelValue(color.g);
+        channels[2] = artNetChannelValue(color.b);
+        channels[3] = artNetChannelValue(color.w);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef _PIXEL_MAP_H
+#define _PIXEL_MAP_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include <libconfig.h++>
+
+#include "LedDefs.h"
+#include "ArtNet.h"
+#include "Sacn.h"
+
+// Number of DMX channels used by one RGBW pixel
+#define PIXEL_CHANNELS 4
+
+// Number of DMX channels used by one 16-bit RGBW pixel, a coarse and a fine channel per color
+#define PIXEL_CHANNELS_WIDE 8
+
+// Number of channels in one DMX universe
+#define DMX_UNIVERSE_SIZE 512
+
+// A run of consecutive ring LEDs mapped onto consecutive channels of a controller. Further
+// controllers receive copies of the same packets, with none only discovered nodes get them.
+struct PixelSegment {
+    std::vector<std::string> controllers;
+    // 15-bit Art-Net port address (net << 8 | subnet << 4 | universe), or an sACN universe from 1 to 63999
+    uint16_t universe = 0;
+    uint16_t startChannel = 0;
+    uint32_t firstLed = 0;
+    uint32_t count = 0;
+    bool reverse = false;
+};
+
+// Maps ring LEDs onto DMX channels. The segments are compiled once into a flat
+// scatter table, so encoding a frame is one linear pass over the ring.
+class PixelMap
+{
+public:
+    void clear();
+    // 8 or 16 bits per color, set before adding segments
+    bool setDepth(uint32_t depth);
+    uint32_t depth() const { return _pixelChannels == PIXEL_CHANNELS_WIDE ? 16 : 8; }
+    bool addSegment(const PixelSegment &segment);
+    // Loads a list of segment groups, segments without a controller use defaultController unless it is empty
+    bool applyConfig(const libconfig::Setting &segments, const std::string &defaultController);
+
+    // The number of ring LEDs needed to cover every segment
+    uint32_t ledCount() const;
+    const std::vector<PixelSegment> &segments() const { return _segments; }
+
+    // Registers all universes with the output and builds the scatter table, returns false when
+    // a segment leaves the protocol's universes or two segments write the same channels
+    bool compile(ArtNetOutput &output);
+    bool compile(SacnOutput &output);
+
+    // Writes the mapped LEDs into the packet arena starting at the output's first packet,
+    // the LEDs hold output codes of the map's depth
+    void scatter(const color_t *leds, uint8_t *packets) const;
+
+private:
+    // addUniverse registers a packet for a universe and its controllers and returns the packet's index
+    bool compileLayout(const std::function<size_t(const std::vector<in_addr_t> &, uint16_t)> &addUniverse,
+                       uint32_t firstUniverse, uint32_t lastUniverse, size_t packetSize, size_t headerSize);
+
+    struct ScatterEntry {
+        uint32_t led;
+        uint32_t offset;
+    };
+
+    uint32_t _pixelChannels = PIXEL_CHANNELS;
+    std::vector<PixelSegment> _segments;
+    std::vector<ScatterEntry> _table;
+};
+
+#endif // _PIXEL_MAP_H
@@ -0,0 +1,163 @@
+#include "Sacn.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <endian.h>
+#include <memory.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
+#include <arpa/inet.h>
+
+namespace
+{
+// ACN packet identifier of the root layer
+const uint8_t kPacketIdentifier[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+
+#define SACN_VECTOR_ROOT_DATA 0x00000004
+#define SACN_VECTOR_FRAMING_DATA 0x00000002
+#define SACN_VECTOR_DMP_SET_PROPERTY 0x02
+
+// Each layer starts with its length from there to the end of the packet, flagged with 0x7
+inline void writeFlagsAndLength(uint8_t *field, size_t offset)
+{
+    *((uint16_t *)field) = htobe16(0x7000 | (SACN_FULL_PACKET_SIZE - offset));
+}
+}
+
+void initSacnPacket(uint8_t *packet, uint16_t universe, const uint8_t *cid, const std::string &sourceName, uint8_t priority)
+{
+    memset(packet, 0, SACN_FULL_PACKET_SIZE);
+
+    // Root layer
+    *((uint16_t *)&packet[0]) = htobe16(0x0010);
+    memcpy(&packet[4], kPacketIdentifier, sizeof(kPacketIdentifier));
+    writeFlagsAndLength(&packet[16], 16);
+    *((uint32_t *)&packet[18]) = htobe32(SACN_VECTOR_ROOT_DATA);
+    memcpy(&packet[SACN_CID_OFFSET], cid, SACN_CID_SIZE);
+
+    // Framing layer
+    writeFlagsAndLength(&packet[38], 38);
+    *((uint32_t *)&packet[40]) = htobe32(SACN_VECTOR_FRAMING_DATA);
+    memcpy(&packet[SACN_SOURCE_NAME_OFFSET], sourceName.c_str(), std::min<size_t>(sourceName.size(), SACN_SOURCE_NAME_SIZE - 1));
+    packet[SACN_PRIORITY_OFFSET] = priority;
+    *((uint16_t *)&packet[SACN_UNIVERSE_OFFSET]) = htobe16(universe);
+
+    // DMP layer: one property list starting at address 0 with a start code and 512 slots
+    writeFlagsAndLength(&packet[115], 115);
+    packet[117] = SACN_VECTOR_DMP_SET_PROPERTY;
+    packet[118] = 0xa1;
+    *((uint16_t *)&packet[121]) = htobe16(1);
+    *((uint16_t *)&packet[123]) = htobe16(SACN_PAYLOAD_SIZE + 1);
+}
+
+sockaddr_in sacnMulticastAddress(uint16_t universe)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SACN_PORT);
+    address.sin_addr.s_addr = htonl(0xEFFF0000 | universe);
+    return address;
+}
+
+SacnOutput::~SacnOutput()
+{
+    close();
+}
+
+bool SacnOutput::open(const in_addr &interface, uint8_t ttl)
+{
+    _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_sockfd < 0)
+    {
+        return false;
+    }
+    if (setsockopt(_sockfd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0 ||
+        setsockopt(_sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+    {
+        std::cout << "Failed to set up sACN multicast! Error: " << errno << std::endl;
+    }
+    return true;
+}
+
+void SacnOutput::close()
+{
+    if (_sockfd >= 0)
+    {
+        ::close(_sockfd);
+        _sockfd = -1;
+    }
+}
+
+void SacnOutput::setSource(const uint8_t *cid, const std::string &sourceName, uint8_t priority)
+{
+    memcpy(_cid, cid, SACN_CID_SIZE);
+    _sourceName = sourceName;
+    _priority = priority;
+}
+
+size_t SacnOutput::addUniverse(uint16_t universe)
+{
+    size_t index = _sequence.size();
+    _destinations.emplace_back();
+    _sequence.push_back(0);
+    _packets.resize(_sequence.size() * SACN_FULL_PACKET_SIZE);
+    initSacnPacket(packet(index), universe, _cid, _sourceName, _priority);
+    _batch.rebuild(_packets.data(), {&_destinations});
+    return index;
+}
+
+void SacnOutput::addDestination(size_t index, const sockaddr_in &remote)
+{
+    _destinations[index].push_back(remote);
+    _batch.rebuild(_packets.data(), {&_destinations});
+}
+
+size_t SacnOutput::send()
+{
+    return sendUniverses(!_batch.refreshEnabled());
+}
+
+size_t SacnOutput::sendUniverses(bool all)
+{
+    _batch.select(all, monotonicNanos());
+    for (size_t i = 0; i < _sequence.size(); ++i)
+    {
+        if (_batch.selected(i))
+        {
+            // Unlike Art-Net every value is a valid sequence number
+            packet(i)[SACN_SEQUENCE_OFFSET] = ++_sequence[i];
+        }
+    }
+    return _batch.send(_sockfd, [this](size_t index, const sockaddr_in &remote, bool partial) {
+        if (partial)
+        {
+            std::cout << "Partial sACN packet sent for universe " << universe(index) << "!" << std::endl;
+        }
+        else
+        {
+            std::cout << "Failed to send sACN packet for universe " << universe(index) << " to "
+                      << inet_ntoa(remote.sin_addr) << "! Error: " << errno << std::endl;
+        }
+    });
+}
+
+void SacnOutput::terminate()
+{
+    if (_sockfd < 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < _sequence.size(); ++i)
+    {
+        packet(i)[SACN_OPTIONS_OFFSET] |= SACN_OPTION_STREAM_TERMINATED;
+    }
+    for (int i = 0; i < SACN_TERMINATE_PACKETS; ++i)
+    {
+        sendUniverses(true);
+    }
+    for (size_t i = 0; i < _sequence.size(); ++i)
+    {
+        packet(i)[SACN_OPTIONS_OFFSET] &= ~SACN_OPTION_STREAM_TERMINATED;
+    }
+}
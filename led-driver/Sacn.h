@@ -0,0 +1,116 @@
+#ifndef _SACN_H
+#define _SACN_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "LedDefs.h"
+#include "Histogram.h"
+#include "UniverseBatch.h"
+
+// E1.31 (Streaming ACN) data packets, all fields are big endian
+
+// The size of the component identifier, a UUID naming the source
+#define SACN_CID_SIZE 16
+
+// The size of the source name field, a null terminated UTF-8 string
+#define SACN_SOURCE_NAME_SIZE 64
+
+// The size of the root, framing and DMP layer headers including the DMX start code
+#define SACN_HEADER_SIZE 126
+
+// The number of DMX slots carried by a full data packet
+#define SACN_PAYLOAD_SIZE 512
+
+// The size of a data packet carrying all 512 slots
+#define SACN_FULL_PACKET_SIZE (SACN_HEADER_SIZE + SACN_PAYLOAD_SIZE)
+
+// The byte offsets of the fields the sender changes after building the header
+#define SACN_CID_OFFSET 22
+#define SACN_SOURCE_NAME_OFFSET 44
+#define SACN_PRIORITY_OFFSET 108
+#define SACN_SEQUENCE_OFFSET 111
+#define SACN_OPTIONS_OFFSET 112
+#define SACN_UNIVERSE_OFFSET 113
+
+// Options bit telling receivers the source stops sending this universe
+#define SACN_OPTION_STREAM_TERMINATED 0x40
+
+// Universes 1 to 63999 carry data, each has its own multicast group 239.255.hi.lo
+#define SACN_MIN_UNIVERSE 1
+#define SACN_MAX_UNIVERSE 63999
+
+// Priorities go from 0 to 200, receivers take the highest source of a universe
+#define SACN_MAX_PRIORITY 200
+#define SACN_DEFAULT_PRIORITY 100
+
+// E1.31 port number
+#define SACN_PORT 5568
+
+// Number of terminating packets a source sends when it stops, per the standard
+#define SACN_TERMINATE_PACKETS 3
+
+// Fills in the headers of a full size data packet and zeroes its slots
+void initSacnPacket(uint8_t *packet, uint16_t universe, const uint8_t *cid, const std::string &sourceName, uint8_t priority);
+
+// The multicast group receivers of a universe join
+sockaddr_in sacnMulticastAddress(uint16_t universe);
+
+// Keeps one prebuilt E1.31 data packet per universe and flushes all of them with a single
+// sendmmsg call, to the universe's multicast group and any unicast receivers. Only the slots
+// and the sequence number change from frame to frame.
+class SacnOutput
+{
+public:
+    ~SacnOutput();
+
+    // Multicast leaves from the interface with the given address (INADDR_ANY lets the kernel pick)
+    bool open(const in_addr &interface, uint8_t ttl);
+    void close();
+    bool isOpen() const { return _sockfd >= 0; }
+
+    // Sets the fields shared by every packet, call before adding universes
+    void setSource(const uint8_t *cid, const std::string &sourceName, uint8_t priority);
+    // Registers a universe and returns its index, invalidates previously returned payload pointers
+    size_t addUniverse(uint16_t universe);
+    void addDestination(size_t index, const sockaddr_in &remote);
+    size_t universeCount() const { return _sequence.size(); }
+
+    uint8_t *packet(size_t index) { return &_packets[index * SACN_FULL_PACKET_SIZE]; }
+    uint16_t universe(size_t index) const
+    {
+        const uint8_t *field = &_packets[index * SACN_FULL_PACKET_SIZE + SACN_UNIVERSE_OFFSET];
+        return static_cast<uint16_t>(field[0] << 8 | field[1]);
+    }
+
+    // Only sends universes whose payload changed, plus every universe once per interval, 0 sends all every frame
+    void setRefreshInterval(int64_t intervalNs) { _batch.setRefreshInterval(intervalNs); }
+
+    // Sends all due universes to all their destinations, returns the number of packets that failed
+    size_t send();
+    // Sends the current frame with the stream terminated flag, receivers then drop this source at once
+    void terminate();
+
+    // Readable from any thread once all universes are registered
+    uint64_t failures(size_t index) const { return _batch.failures(index); }
+    uint64_t sentPackets() const { return _batch.sentPackets(); }
+    // Universes held back because nothing changed
+    uint64_t suppressedUniverses() const { return _batch.suppressedUniverses(); }
+
+private:
+    size_t sendUniverses(bool all);
+
+    int _sockfd = -1;
+    uint8_t _cid[SACN_CID_SIZE] = {};
+    std::string _sourceName;
+    uint8_t _priority = SACN_DEFAULT_PRIORITY;
+    std::vector<uint8_t> _packets;
+    std::vector<std::vector<sockaddr_in>> _destinations;
+    std::vector<uint8_t> _sequence;
+    UniverseBatch _batch{SACN_FULL_PACKET_SIZE, SACN_HEADER_SIZE, SACN_PAYLOAD_SIZE};
+};
+
+#endif // _SACN_H
@@ -0,0 +1,70 @@
+#include "SenderThread.h"
+
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+SenderThread::~SenderThread()
+{
+    stop();
+}
+
+bool SenderThread::start(std::function<void()> transmit)
+{
+    _eventfd = eventfd(0, EFD_CLOEXEC);
+    if (_eventfd < 0)
+    {
+        std::cout << "Failed to create the sender wake-up eventfd! Error: " << errno << std::endl;
+        return false;
+    }
+    _transmit = std::move(transmit);
+    _running = true;
+    _thread = std::thread(&SenderThread::loop, this);
+    return true;
+}
+
+void SenderThread::stop()
+{
+    if (_eventfd < 0)
+    {
+        return;
+    }
+    _running = false;
+    frameReady();
+    _thread.join();
+    close(_eventfd);
+    _eventfd = -1;
+}
+
+void SenderThread::frameReady()
+{
+    uint64_t one = 1;
+    (void)write(_eventfd, &one, sizeof(one));
+}
+
+void SenderThread::loop()
+{
+    while (true)
+    {
+        uint64_t signals = 0;
+        if (read(_eventfd, &signals, sizeof(signals)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cout << "Sender thread failed to wait for frames! Error: " << errno << std::endl;
+            return;
+        }
+        if (!_running)
+        {
+            return;
+        }
+        if (signals > 1)
+        {
+            _lateWakeups += signals - 1;
+        }
+        _transmit();
+    }
+}
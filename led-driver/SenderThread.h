@@ -0,0 +1,40 @@
+#ifndef _SENDER_THREAD_H
+#define _SENDER_THREAD_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "Histogram.h"
+
+// Runs the transmit stage of the frame loop on its own thread, so a stalled send never delays
+// the next simulation step. The render thread signals every composed frame through an eventfd,
+// the sender then sends whatever is newest. Signals arriving while it sends are merged into
+// one wake-up.
+class SenderThread
+{
+public:
+    ~SenderThread();
+
+    bool start(std::function<void()> transmit);
+    void stop();
+    bool isRunning() const { return _eventfd >= 0; }
+
+    // Render thread, after the frames of all installations are published
+    void frameReady();
+
+    // Frame signals merged because the sender was still busy
+    uint64_t lateWakeups() const { return _lateWakeups; }
+
+private:
+    void loop();
+
+    std::function<void()> _transmit;
+    int _eventfd = -1;
+    std::atomic<bool> _running{false};
+    std::thread _thread;
+    RelaxedCounter _lateWakeups;
+};
+
+#endif // _SENDER_THREAD_H
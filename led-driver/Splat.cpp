@@ -0,0 +1,153 @@
+#include "Splat.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+// Both shapes reach zero at the radius, distance is relative to it
+float shapeWeight(SplatShape shape, float distance)
+{
+    if (distance >= 1.f)
+    {
+        return 0.f;
+    }
+    if (shape == SplatShape::kGaussian)
+    {
+        // Three standard deviations across the radius
+        return expf(-4.5f * distance * distance);
+    }
+    return 1.f - distance;
+}
+
+inline size_t wrapLed(long led, size_t count)
+{
+    long wrapped = led % static_cast<long>(count);
+    return static_cast<size_t>(wrapped < 0 ? wrapped + static_cast<long>(count) : wrapped);
+}
+
+inline void blendLed(color_t &led, const color_t &color, float weight)
+{
+    weight = std::min(weight, 1.f);
+    led.r = std::max(led.r, static_cast<color_data_t>(color.r * weight));
+    led.g = std::max(led.g, static_cast<color_data_t>(color.g * weight));
+    led.b = std::max(led.b, static_cast<color_data_t>(color.b * weight));
+    led.w = std::max(led.w, static_cast<color_data_t>(color.w * weight));
+}
+}
+
+void SplatKernel::build(float footprint, SplatShape shape)
+{
+    _taps = 0;
+    if (!(footprint > 0.f))
+    {
+        return;
+    }
+    footprint = std::min<float>(footprint, SPLAT_MAX_FOOTPRINT);
+    _radius = footprint / 2.f;
+    _taps = std::min<int>(static_cast<int>(ceilf(footprint)) + 1, SPLAT_MAX_TAPS);
+
+    for (int phase = 0; phase < SPLAT_PHASES; ++phase)
+    {
+        // The middle of the phase, relative to the start of its LED
+        float position = (phase + 0.5f) / SPLAT_PHASES;
+        _first[phase] = static_cast<int32_t>(floorf(position - _radius - 0.5f)) + 1;
+        float *weights = &_weights[phase * SPLAT_MAX_TAPS];
+        float sum = 0.f;
+        for (int tap = 0; tap < _taps; ++tap)
+        {
+            float center = _first[phase] + tap + 0.5f;
+            weights[tap] = shapeWeight(shape, fabsf(center - position) / _radius);
+            sum += weights[tap];
+        }
+        for (int tap = 0; tap < _taps; ++tap)
+        {
+            weights[tap] = sum > 0.f ? weights[tap] / sum : 0.f;
+        }
+    }
+
+    // Running integral across the footprint, normalized to unit area
+    _cdf[0] = 0.f;
+    float step = 2.f * _radius / SPLAT_CDF_SIZE;
+    float previous = shapeWeight(shape, 1.f);
+    for (int i = 1; i <= SPLAT_CDF_SIZE; ++i)
+    {
+        float current = shapeWeight(shape, fabsf(-_radius + i * step) / _radius);
+        _cdf[i] = _cdf[i - 1] + (previous + current) * 0.5f * step;
+        previous = current;
+    }
+    float area = _cdf[SPLAT_CDF_SIZE];
+    for (float &value : _cdf)
+    {
+        value /= area;
+    }
+}
+
+float SplatKernel::cumulative(float offset) const
+{
+    float index = (offset + _radius) / (2.f * _radius) * SPLAT_CDF_SIZE;
+    if (index <= 0.f)
+    {
+        return 0.f;
+    }
+    if (index >= SPLAT_CDF_SIZE)
+    {
+        return 1.f;
+    }
+    int lower = static_cast<int>(index);
+    float fraction = index - lower;
+    return _cdf[lower] + (_cdf[lower + 1] - _cdf[lower]) * fraction;
+}
+
+void SplatKernel::splat(color_t *leds, size_t count, float position, const color_t &color, float brightness) const
+{
+    if (empty() || count == 0)
+    {
+        return;
+    }
+    float base = floorf(position);
+    int phase = std::min(static_cast<int>((position - base) * SPLAT_PHASES), SPLAT_PHASES - 1);
+    const float *weights = &_weights[phase * SPLAT_MAX_TAPS];
+    long first = static_cast<long>(base) + _first[phase];
+    for (int tap = 0; tap < _taps; ++tap)
+    {
+        if (weights[tap] > 0.f)
+        {
+            blendLed(leds[wrapLed(first + tap, count)], color, weights[tap] * brightness);
+        }
+    }
+}
+
+void SplatKernel::sweep(color_t *leds, size_t count, float from, float to, const color_t &color, float brightness) const
+{
+    float length = to - from;
+    if (length < 1.f / SPLAT_PHASES)
+    {
+        splat(leds, count, (from + to) * 0.5f, color, brightness);
+        return;
+    }
+    if (empty() || count == 0)
+    {
+        return;
+    }
+    // Each LED center gets the time the footprint spent over it, the streak can span the whole ring
+    long first = static_cast<long>(floorf(from - _radius - 0.5f)) + 1;
+    long last = std::min(static_cast<long>(floorf(to + _radius - 0.5f)), first + static_cast<long>(count) - 1);
+    float scale = brightness / length;
+    // LEDs the whole footprint passed over share the plateau weight, only the ends need the table
+    long plateauFirst = static_cast<long>(ceilf(from + _radius - 0.5f));
+    long plateauLast = static_cast<long>(floorf(to - _radius - 0.5f));
+    for (long led = first; led <= last; ++led)
+    {
+        float weight = scale;
+        if (led < plateauFirst || led > plateauLast)
+        {
+            float center = led + 0.5f;
+            weight = (cumulative(center - from) - cumulative(center - to)) * scale;
+        }
+        if (weight > 0.f)
+        {
+            blendLed(leds[wrapLed(led, count)], color, weight);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _SPLAT_H
+#define _SPLAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+
+#include "LedDefs.h"
+
+// Sub-LED positions are quantized to this many phases per LED
+#define SPLAT_PHASES 32
+#define SPLAT_MAX_TAPS 8
+// Widest footprint in LEDs, a splat then touches SPLAT_MAX_TAPS LEDs at any phase
+#define SPLAT_MAX_FOOTPRINT (SPLAT_MAX_TAPS - 1)
+#define SPLAT_CDF_SIZE 256
+
+enum class SplatShape {
+    kTent = 0,
+    kGaussian = 1,
+};
+
+// Precomputed weights for drawing an anti-aliased particle at any sub-LED position.
+// Positions are in LEDs along the ring, LED i covers [i, i + 1). Every phase's weights
+// add up to one, so a particle keeps its brightness as it moves between LEDs. Colors are
+// max-blended into the ring, brightness scales the weights and each LED saturates at the
+// full color.
+class SplatKernel
+{
+public:
+    void build(float footprint, SplatShape shape);
+    bool empty() const { return _taps == 0; }
+    float radius() const { return _radius; }
+
+    // The particle standing at position
+    void splat(color_t *leds, size_t count, float position, const color_t &color, float brightness) const;
+    // The particle moving from one end of [from, to] to the other during the exposure, its light
+    // spread evenly along the way. Falls back to splat() for distances below one phase.
+    void sweep(color_t *leds, size_t count, float from, float to, const color_t &color, float brightness) const;
+
+private:
+    // Integral of the unit area kernel from -radius to offset
+    float cumulative(float offset) const;
+
+    float _radius = 0.f;
+    int _taps = 0;
+    std::array<int32_t, SPLAT_PHASES> _first{};
+    std::array<float, SPLAT_PHASES * SPLAT_MAX_TAPS> _weights{};
+    std::array<float, SPLAT_CDF_SIZE + 1> _cdf{};
+};
+
+#endif // _SPLAT_H
@@ -0,0 +1,73 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <array>
+#include <utility>
+
+// Bounded lock-free ring for exactly one producer and one consumer thread.
+// Neither side ever blocks, push fails when the ring is full.
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    bool push(const T &item)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        _items[head & (Capacity - 1)] = item;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Moves the item in, it is left untouched when the ring is full
+    bool push(T &&item)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        _items[head & (Capacity - 1)] = std::move(item);
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        // Moved out, so the slot does not keep what the item owns alive
+        item = std::move(_items[tail & (Capacity - 1)]);
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
+    }
+
+    // Producer side, whether push would fail
+    bool full() const
+    {
+        return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire) == Capacity;
+    }
+
+private:
+    std::array<T, Capacity> _items;
+    // Keep the indices on separate cache lines so the two threads do not fight over one
+    alignas(64) std::atomic<size_t> _head{0};
+    alignas(64) std::atomic<size_t> _tail{0};
+};
+
+#endif // _SPSC_QUEUE_H
@@ -0,0 +1,542 @@
+#include "Timeline.h"
+#include "BakeCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+// The animation the driver has always played, leddriver.conf carries the same timeline
+const char *kDefaultTimeline = R"(
+layers: ( { name: "base"; blend: "max"; } );
+dark: {
+    transitions: ( { to: "starting"; after: "reset_time"; } );
+};
+starting: {
+    dim: 0.8;
+    particles: ( { color: "primary"; speed: 1.0; max_speed: "idle_speed"; ramp_time: "starting_time"; } );
+    transitions: ( { to: "idle"; when: "top_speed"; } );
+};
+idle: {
+    dim: 0.8;
+    particles: ( { color: "primary"; position: "inherit"; speed: "idle_speed"; } );
+    transitions: ( { to: "windup"; after: 2.0; automatic: true; } );
+};
+windup: {
+    dim: 0.8;
+    particles: (
+        { color: "primary"; position: "inherit"; speed: "inherit";
+          max_speed: "collision_speed"; ramp_time: "collision_time"; clamp: true; },
+        { color: "secondary"; direction: "ccw"; speed_of: 0; speed_scale: 0.5;
+          max_speed: "collision_speed"; ramp_time: "collision_time"; clamp: true; }
+    );
+    transitions: ( { to: "explosion"; when: "collision"; gap: 5.0; margin: 30.0; cut: true; } );
+};
+explosion: {
+    fill: { color: "fill"; from: 0.4; rate: 0.2; easing: "linear"; };
+    transitions: ( { to: "fade"; when: "filled"; } );
+};
+fade: {
+    dim: 0.97;
+    transitions: ( { to: "dark"; after: 10.0; force: true; } );
+};
+)";
+
+const char *const kStageNames[TIMELINE_STAGE_COUNT] = {"dark", "starting", "idle", "windup", "explosion", "fade"};
+
+const char *const kParameterNames[static_cast<size_t>(ControlParameter::kCount)] = {
+    "blink_rate", "idle_speed", "starting_time", "collision_speed", "collision_time", "reset_time", "auto_advance"};
+
+bool fail(const libconfig::Setting &setting, const std::string &message)
+{
+    std::cout << "Timeline " << setting.getPath() << ": " << message << std::endl;
+    return false;
+}
+
+bool readNumber(const libconfig::Setting &setting, double &value)
+{
+    switch (setting.getType())
+    {
+    case libconfig::Setting::TypeFloat:
+        value = static_cast<double>(setting);
+        return true;
+    case libconfig::Setting::TypeInt:
+    case libconfig::Setting::TypeInt64:
+        value = static_cast<double>(static_cast<long long>(setting));
+        return true;
+    default:
+        return fail(setting, "expected a number");
+    }
+}
+
+bool readFloat(const libconfig::Setting &settings, const char *name, float &value)
+{
+    if (!settings.exists(name))
+    {
+        return true;
+    }
+    double number;
+    if (!readNumber(settings.lookup(name), number))
+    {
+        return false;
+    }
+    value = static_cast<float>(number);
+    return true;
+}
+
+bool readValue(const libconfig::Setting &settings, const char *name, TimelineValue &value, bool inheritable = false)
+{
+    if (!settings.exists(name))
+    {
+        return true;
+    }
+    const libconfig::Setting &setting = settings.lookup(name);
+    if (setting.getType() != libconfig::Setting::TypeString)
+    {
+        return readNumber(setting, value.constant);
+    }
+    std::string text = setting;
+    if (inheritable && text == "inherit")
+    {
+        value.inherit = true;
+        return true;
+    }
+    for (size_t i = 0; i < static_cast<size_t>(ControlParameter::kCount); ++i)
+    {
+        if (text == kParameterNames[i])
+        {
+            value.parameter = static_cast<int>(i);
+            return true;
+        }
+    }
+    return fail(setting, "unknown parameter \"" + text + "\"");
+}
+
+template <typename T, size_t N>
+bool readChoice(const libconfig::Setting &settings, const char *name, const char *const (&names)[N], T &value)
+{
+    if (!settings.exists(name))
+    {
+        return true;
+    }
+    const libconfig::Setting &setting = settings.lookup(name);
+    std::string text;
+    if (setting.getType() == libconfig::Setting::TypeString)
+    {
+        text = static_cast<std::string>(setting);
+        for (size_t i = 0; i < N; ++i)
+        {
+            if (text == names[i])
+            {
+                value = static_cast<T>(i);
+                return true;
+            }
+        }
+    }
+    return fail(setting, "unknown value \"" + text + "\"");
+}
+
+const char *const kColorNames[] = {"primary", "secondary", "fill"};
+const char *const kDirectionNames[] = {"ccw", "cw"};
+const char *const kEasingNames[] = {"linear", "ease_in", "ease_out", "ease_in_out", "smoothstep"};
+const char *const kConditionNames[] = {"after", "top_speed", "collision", "filled"};
+const char *const kBlendNames[] = {"max", "add", "alpha", "multiply"};
+const char *const kShapeNames[] = {"tent", "gaussian"};
+
+bool readLayer(const libconfig::Setting &settings, const char *name, const std::vector<std::string> &layers, int &layer)
+{
+    if (!settings.exists(name))
+    {
+        return true;
+    }
+    const libconfig::Setting &setting = settings.lookup(name);
+    std::string text;
+    if (setting.getType() == libconfig::Setting::TypeString)
+    {
+        text = static_cast<std::string>(setting);
+        for (size_t i = 0; i < layers.size(); ++i)
+        {
+            if (text == layers[i])
+            {
+                layer = static_cast<int>(i);
+                return true;
+            }
+        }
+    }
+    return fail(setting, "unknown layer \"" + text + "\"");
+}
+
+bool compileParticle(const libconfig::Setting &settings, size_t index, const std::vector<std::string> &layers,
+                     ParticleProgram &particle)
+{
+    int clockwise = 1;
+    int layer = 0;
+    if (!readChoice(settings, "color", kColorNames, particle.color) ||
+        !readLayer(settings, "layer", layers, layer) ||
+        !readChoice(settings, "direction", kDirectionNames, clockwise) ||
+        !readValue(settings, "position", particle.position, true) ||
+        !readValue(settings, "speed", particle.speed, true) ||
+        !readFloat(settings, "speed_scale", particle.speedScale) ||
+        !readValue(settings, "max_speed", particle.maxSpeed) ||
+        !readValue(settings, "accel", particle.accel) ||
+        !readValue(settings, "ramp_time", particle.rampTime) ||
+        !readFloat(settings, "footprint", particle.footprint) ||
+        !readChoice(settings, "shape", kShapeNames, particle.shape) ||
+        !readFloat(settings, "blur", particle.blur) ||
+        !readFloat(settings, "brightness", particle.brightness))
+    {
+        return false;
+    }
+    if (particle.footprint < 0.f || particle.footprint > SPLAT_MAX_FOOTPRINT)
+    {
+        return fail(settings, "footprint must be between 0 and " + std::to_string(SPLAT_MAX_FOOTPRINT) + " LEDs");
+    }
+    if (particle.blur < 0.f || particle.blur > 1.f)
+    {
+        return fail(settings, "blur must be between 0 and 1");
+    }
+    particle.splat.build(particle.footprint, particle.shape);
+    particle.clockwise = clockwise != 0;
+    particle.layer = static_cast<uint8_t>(layer);
+    settings.lookupValue("clamp", particle.clamp);
+    particle.ramp = settings.exists("ramp_time");
+    if (settings.exists("speed_of"))
+    {
+        settings.lookupValue("speed_of", particle.speedOf);
+        if (particle.speedOf < 0 || static_cast<size_t>(particle.speedOf) >= index)
+        {
+            return fail(settings, "speed_of must name an earlier particle");
+        }
+    }
+    return true;
+}
+
+bool compileTransition(const libconfig::Setting &settings, const StageProgram &stage, TransitionProgram &transition)
+{
+    if (!settings.exists("to"))
+    {
+        return fail(settings, "a transition needs a target stage");
+    }
+    if (!readChoice(settings, "to", kStageNames, transition.to) ||
+        !readChoice(settings, "when", kConditionNames, transition.condition) ||
+        !readValue(settings, "after", transition.after) ||
+        !readFloat(settings, "gap", transition.gap) ||
+        !readFloat(settings, "margin", transition.margin))
+    {
+        return false;
+    }
+    settings.lookupValue("force", transition.force);
+    settings.lookupValue("automatic", transition.automatic);
+    settings.lookupValue("cut", transition.cut);
+    int particle = 0;
+    settings.lookupValue("particle", particle);
+    transition.particle = static_cast<uint8_t>(particle);
+
+    switch (transition.condition)
+    {
+    case TransitionProgram::Condition::kAfter:
+        if (!settings.exists("after"))
+        {
+            return fail(settings, "an after transition needs an after value");
+        }
+        break;
+    case TransitionProgram::Condition::kTopSpeed:
+        if (particle < 0 || static_cast<size_t>(particle) >= stage.particles.size())
+        {
+            return fail(settings, "top_speed needs an existing particle");
+        }
+        break;
+    case TransitionProgram::Condition::kCollision:
+        if (stage.particles.size() < 2)
+        {
+            return fail(settings, "collision needs two particles");
+        }
+        break;
+    case TransitionProgram::Condition::kFilled:
+        if (!stage.fill)
+        {
+            return fail(settings, "filled needs a fill");
+        }
+        break;
+    }
+    return true;
+}
+
+uint64_t fingerprintProgram(const StageProgram &stage)
+{
+    // Field by field, the structs have padding
+    auto add = [](uint64_t hash, auto value) { return fingerprint(&value, sizeof(value), hash); };
+    uint64_t hash = add(add(add(fingerprint(&stage.dim, sizeof(stage.dim)), stage.dimFactor), stage.dimAddition), stage.fill);
+    hash = add(add(hash, stage.fillColor), stage.fillEasing);
+    hash = add(add(hash, stage.dimLayer), stage.fillLayer);
+    for (const ParticleProgram &particle : stage.particles)
+    {
+        hash = add(add(add(add(hash, particle.color), particle.layer), particle.clockwise), particle.clamp);
+        hash = add(add(add(add(hash, particle.footprint), particle.shape), particle.blur), particle.brightness);
+    }
+    for (const TransitionProgram &transition : stage.transitions)
+    {
+        hash = add(add(add(add(hash, transition.condition), transition.to), transition.force), transition.automatic);
+        hash = add(add(add(add(hash, transition.cut), transition.particle), transition.gap), transition.margin);
+    }
+    return hash;
+}
+
+bool compileStage(const libconfig::Setting &settings, const std::vector<std::string> &layers, StageProgram &stage)
+{
+    stage = StageProgram();
+    if (settings.exists("dim"))
+    {
+        stage.dim = true;
+        if (!readLayer(settings, "dim_layer", layers, stage.dimLayer))
+        {
+            return false;
+        }
+        int addition = 0;
+        settings.lookupValue("dim_add", addition);
+        stage.dimAddition = static_cast<color_data_t>(std::min(std::max(addition, 0), 255) * COLOR_DATA_STEP);
+        if (!readFloat(settings, "dim", stage.dimFactor))
+        {
+            return false;
+        }
+    }
+    if (settings.exists("fill"))
+    {
+        const libconfig::Setting &fill = settings.lookup("fill");
+        stage.fill = true;
+        int layer = 0;
+        if (!readLayer(fill, "layer", layers, layer) ||
+            !readChoice(fill, "color", kColorNames, stage.fillColor) ||
+            !readValue(fill, "from", stage.fillFrom) ||
+            !readValue(fill, "rate", stage.fillRate) ||
+            !readChoice(fill, "easing", kEasingNames, stage.fillEasing))
+        {
+            return false;
+        }
+        stage.fillLayer = static_cast<uint8_t>(layer);
+    }
+    if (settings.exists("particles"))
+    {
+        const libconfig::Setting &particles = settings.lookup("particles");
+        if (particles.getLength() > TIMELINE_MAX_PARTICLES)
+        {
+            return fail(particles, "at most " + std::to_string(TIMELINE_MAX_PARTICLES) + " particles per stage");
+        }
+        stage.particles.resize(particles.getLength());
+        for (int i = 0; i < particles.getLength(); ++i)
+        {
+            if (!compileParticle(particles[i], i, layers, stage.particles[i]))
+            {
+                return false;
+            }
+        }
+    }
+    if (settings.exists("transitions"))
+    {
+        const libconfig::Setting &transitions = settings.lookup("transitions");
+        if (transitions.getLength() > TIMELINE_MAX_TRANSITIONS)
+        {
+            return fail(transitions, "at most " + std::to_string(TIMELINE_MAX_TRANSITIONS) + " transitions per stage");
+        }
+        stage.transitions.resize(transitions.getLength());
+        for (int i = 0; i < transitions.getLength(); ++i)
+        {
+            if (!compileTransition(transitions[i], stage, stage.transitions[i]))
+            {
+                return false;
+            }
+        }
+    }
+
+    bool draws = stage.dim || stage.fill || !stage.particles.empty();
+    bool leaves = false;
+    for (const TransitionProgram &transition : stage.transitions)
+    {
+        leaves = leaves || !transition.automatic;
+    }
+    stage.bakeable = draws && leaves;
+    stage.fingerprint = fingerprintProgram(stage);
+    return true;
+}
+}
+
+Timeline::Timeline()
+{
+    libconfig::Config config;
+    config.readString(kDefaultTimeline);
+    applyStages(config.getRoot());
+}
+
+const char *Timeline::stageName(AnimStage stage)
+{
+    return stage >= 0 && stage < TIMELINE_STAGE_COUNT ? kStageNames[stage] : "unknown";
+}
+
+bool Timeline::applyConfig(const libconfig::Setting &settings)
+{
+    if (settings.getType() != libconfig::Setting::TypeString)
+    {
+        return applyStages(settings);
+    }
+
+    // A sidecar file holding the stage groups at its top level
+    std::string path = settings;
+    libconfig::Config config;
+    try
+    {
+        config.readFile(path.c_str());
+    }
+    catch (const libconfig::FileIOException &)
+    {
+        std::cout << "Failed to read the timeline file " << path << std::endl;
+        return false;
+    }
+    catch (const libconfig::ParseException &exception)
+    {
+        std::cout << "Parse error in the timeline file " << path << " at line " << exception.getLine() << ": "
+                  << exception.getError() << std::endl;
+        return false;
+    }
+    return applyStages(config.getRoot());
+}
+
+bool Timeline::applyStages(const libconfig::Setting &settings)
+{
+    std::vector<LayerSettings> layers = _layers;
+    std::vector<std::string> layerNames = _layerNames;
+    std::array<StageProgram, TIMELINE_STAGE_COUNT> stages = _stages;
+    bool valid = true;
+    if (settings.exists("layers"))
+    {
+        const libconfig::Setting &list = settings.lookup("layers");
+        layers.assign(list.getLength(), LayerSettings());
+        layerNames.assign(list.getLength(), std::string());
+        if (list.getLength() == 0 || list.getLength() > COMPOSITOR_MAX_LAYERS)
+        {
+            valid = fail(list, "between 1 and " + std::to_string(COMPOSITOR_MAX_LAYERS) + " layers");
+        }
+        for (int i = 0; valid && i < list.getLength(); ++i)
+        {
+            list[i].lookupValue("name", layerNames[i]);
+            valid = readChoice(list[i], "blend", kBlendNames, layers[i].blend) &&
+                    readFloat(list[i], "opacity", layers[i].opacity);
+        }
+    }
+    for (size_t i = 0; valid && i < TIMELINE_STAGE_COUNT; ++i)
+    {
+        if (settings.exists(kStageNames[i]))
+        {
+            valid = compileStage(settings.lookup(kStageNames[i]), layerNames, stages[i]);
+        }
+    }
+
+    // Stages kept from before may draw into layers a new stack no longer has
+    for (size_t i = 0; valid && i < TIMELINE_STAGE_COUNT; ++i)
+    {
+        int highest = std::max(stages[i].dimLayer, stages[i].fill ? static_cast<int>(stages[i].fillLayer) : 0);
+        for (const ParticleProgram &particle : stages[i].particles)
+        {
+            highest = std::max(highest, static_cast<int>(particle.layer));
+        }
+        if (static_cast<size_t>(highest) >= layers.size())
+        {
+            std::cout << "Timeline stage " << kStageNames[i] << " draws into a missing layer." << std::endl;
+            valid = false;
+        }
+    }
+    if (!valid)
+    {
+        std::cout << "Keeping the previous timeline." << std::endl;
+        return false;
+    }
+    _layers = std::move(layers);
+    _layerNames = std::move(layerNames);
+    _stages = std::move(stages);
+    return true;
+}
+
+void Timeline::enter(AnimStage stage, const StageState &previous, const TimelineParameters &parameters,
+                     StageState &state) const
+{
+    const StageProgram &program = _stages[stage];
+    state = StageState();
+    state.stage = stage;
+    state.auto_advance = parameters[ControlParameter::kAutoAdvance] != 0.0;
+    state.fill_ratio = static_cast<float>(program.fillFrom.resolve(parameters));
+    state.fill_rate = static_cast<float>(program.fillRate.resolve(parameters));
+
+    state.particleCount = program.particles.size();
+    for (size_t i = 0; i < program.particles.size(); ++i)
+    {
+        const ParticleProgram &source = program.particles[i];
+        ParticleState &particle = state.particles[i];
+        bool carried = i < previous.particleCount;
+
+        particle.position = source.position.inherit && carried ? previous.particles[i].position
+                                                               : static_cast<float>(source.position.resolve(parameters));
+        if (source.speedOf >= 0)
+        {
+            particle.speed = state.particles[source.speedOf].speed;
+        }
+        else
+        {
+            particle.speed = source.speed.inherit && carried ? previous.particles[i].speed
+                                                             : static_cast<float>(source.speed.resolve(parameters));
+        }
+        particle.speed *= source.speedScale;
+
+        double maxSpeed = source.maxSpeed.resolve(parameters);
+        particle.maxSpeed = static_cast<float>(maxSpeed);
+        particle.accel = static_cast<float>(source.ramp ? maxSpeed / source.rampTime.resolve(parameters)
+                                                        : source.accel.resolve(parameters));
+    }
+
+    for (size_t i = 0; i < program.transitions.size(); ++i)
+    {
+        state.after[i] = static_cast<float>(program.transitions[i].after.resolve(parameters));
+    }
+}
+
+const TransitionProgram *Timeline::firedTransition(const StageState &state) const
+{
+    const StageProgram &program = _stages[state.stage];
+    for (size_t i = 0; i < program.transitions.size(); ++i)
+    {
+        const TransitionProgram &transition = program.transitions[i];
+        if (transition.automatic && !state.auto_advance)
+        {
+            continue;
+        }
+        bool fired = false;
+        switch (transition.condition)
+        {
+        case TransitionProgram::Condition::kAfter:
+            fired = state.elapsed_time > state.after[i];
+            break;
+        case TransitionProgram::Condition::kTopSpeed:
+        {
+            const ParticleState &particle = state.particles[transition.particle];
+            fired = particle.speed > particle.maxSpeed;
+            break;
+        }
+        case TransitionProgram::Condition::kCollision:
+        {
+            const ParticleState &first = state.particles[0];
+            const ParticleState &second = state.particles[1];
+            fired = second.speed >= second.maxSpeed && (first.position - second.position) < transition.gap &&
+                    ((first.position > transition.margin && first.position < 180.f - transition.margin) ||
+                     (first.position < 360.f - transition.margin && first.position > 180.f + transition.margin));
+            break;
+        }
+        case TransitionProgram::Condition::kFilled:
+            fired = state.fill_ratio > 1.0f;
+            break;
+        }
+        if (fired)
+        {
+            return &transition;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,239 @@
+#ifndef _TIMELINE_H
+#define _TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <array>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <libconfig.h++>
+
+#include "LedDefs.h"
+#include "Compositor.h"
+#include "Splat.h"
+
+// The stages the control protocol addresses, a timeline describes how each of them looks
+enum AnimStage {
+    kDark = 0,
+    kStarting = 1,
+    kIdle = 2,
+    kWindup = 3,
+    kExplosion = 4,
+    kFade = 5,
+};
+
+#define TIMELINE_STAGE_COUNT 6
+#define TIMELINE_MAX_PARTICLES 4
+#define TIMELINE_MAX_TRANSITIONS 4
+
+// Configuration values that can be overridden at runtime
+enum class ControlParameter {
+    kBlinkRate = 0,
+    kIdleSpeed = 1,
+    kStartingTime = 2,
+    kCollisionSpeed = 3,
+    kCollisionTime = 4,
+    kResetTime = 5,
+    kAutoAdvance = 6,
+    kCount
+};
+
+// Whether a parameter may take the value, the ramp times divide the speeds so times must be positive
+inline bool validParameterValue(ControlParameter parameter, double value)
+{
+    switch (parameter)
+    {
+    case ControlParameter::kStartingTime:
+    case ControlParameter::kCollisionTime:
+    case ControlParameter::kResetTime:
+        return std::isfinite(value) && value > 0.0;
+    default:
+        return std::isfinite(value);
+    }
+}
+
+// The control parameters as they are when a stage starts
+struct TimelineParameters {
+    std::array<double, static_cast<size_t>(ControlParameter::kCount)> values{};
+
+    double &operator[](ControlParameter parameter) { return values[static_cast<size_t>(parameter)]; }
+    double operator[](ControlParameter parameter) const { return values[static_cast<size_t>(parameter)]; }
+};
+
+// A number in the timeline: a constant, a control parameter or a value carried over from the previous stage
+struct TimelineValue {
+    double constant = 0.0;
+    int parameter = -1;
+    bool inherit = false;
+
+    double resolve(const TimelineParameters &parameters) const
+    {
+        return parameter < 0 ? constant : parameters.values[parameter];
+    }
+};
+
+enum class PaletteColor {
+    kPrimary = 0,
+    kSecondary = 1,
+    kFill = 2,
+};
+
+enum class Easing {
+    kLinear = 0,
+    kEaseIn = 1,
+    kEaseOut = 2,
+    kEaseInOut = 3,
+    kSmoothStep = 4,
+};
+
+// Linear leaves the value untouched, the curves map [0, 1] onto itself
+inline float ease(Easing easing, float x)
+{
+    if (easing == Easing::kLinear)
+    {
+        return x;
+    }
+    x = x < 0.f ? 0.f : (x > 1.f ? 1.f : x);
+    switch (easing)
+    {
+    case Easing::kEaseIn:
+        return x * x;
+    case Easing::kEaseOut:
+        return x * (2.f - x);
+    case Easing::kEaseInOut:
+        return x < 0.5f ? 2.f * x * x : -1.f + (4.f - 2.f * x) * x;
+    case Easing::kSmoothStep:
+        return x * x * (3.f - 2.f * x);
+    default:
+        return x;
+    }
+}
+
+struct ParticleProgram {
+    PaletteColor color = PaletteColor::kPrimary;
+    uint8_t layer = 0;
+    bool clockwise = true;
+    // Stops accelerating at max_speed instead of passing it
+    bool clamp = false;
+    TimelineValue position;
+    TimelineValue speed;
+    // Starts at the speed of an earlier particle of the same stage, times speed_scale
+    int speedOf = -1;
+    float speedScale = 1.f;
+    TimelineValue maxSpeed;
+    TimelineValue accel;
+    // Reaches max_speed from standstill in this many seconds, replaces accel when set
+    TimelineValue rampTime;
+    bool ramp = false;
+
+    // Width in LEDs of the anti-aliased splat, 0 draws the classic solid line
+    float footprint = 0.f;
+    SplatShape shape = SplatShape::kTent;
+    // Share of the frame's travel the splat is smeared over
+    float blur = 0.f;
+    float brightness = 1.f;
+    SplatKernel splat;
+};
+
+struct TransitionProgram {
+    enum class Condition {
+        // The stage ran longer than the after value
+        kAfter = 0,
+        // The particle's speed passed its max_speed
+        kTopSpeed = 1,
+        // The second particle reached its max_speed while the first is less than gap degrees ahead,
+        // with the first at least margin degrees away from the 0 and 180 degree marks
+        kCollision = 2,
+        // The fill ratio passed 1
+        kFilled = 3,
+    };
+
+    Condition condition = Condition::kAfter;
+    AnimStage to = AnimStage::kDark;
+    bool force = false;
+    // Only fires when auto_advance was on as the stage started
+    bool automatic = false;
+    // The frame the transition fires on is not drawn
+    bool cut = false;
+    TimelineValue after;
+    uint8_t particle = 0;
+    float gap = 5.f;
+    float margin = 30.f;
+};
+
+// A stage compiled from the timeline configuration, evaluated every frame by LedDriver::updateStage
+struct StageProgram {
+    bool dim = false;
+    float dimFactor = 1.f;
+    color_data_t dimAddition = 0;
+    // Dims every layer when negative
+    int dimLayer = -1;
+
+    bool fill = false;
+    PaletteColor fillColor = PaletteColor::kFill;
+    uint8_t fillLayer = 0;
+    TimelineValue fillFrom;
+    TimelineValue fillRate;
+    Easing fillEasing = Easing::kLinear;
+
+    std::vector<ParticleProgram> particles;
+    std::vector<TransitionProgram> transitions;
+
+    // Draws something and leaves on its own, so a run only depends on how it started
+    bool bakeable = false;
+    uint64_t fingerprint = 0;
+};
+
+struct ParticleState {
+    float position;
+    float speed;
+    float accel;
+    float maxSpeed;
+};
+
+// The state of one stage run, the values a program reads from parameters are resolved when it starts
+struct StageState {
+    AnimStage stage = AnimStage::kDark;
+    float elapsed_time = 0.f;
+    float fill_ratio = 0.f;
+    float fill_rate = 0.f;
+    bool auto_advance = false;
+    uint32_t particleCount = 0;
+    std::array<ParticleState, TIMELINE_MAX_PARTICLES> particles{};
+    std::array<float, TIMELINE_MAX_TRANSITIONS> after{};
+};
+
+// The stages of an installation's animation. Built from the default timeline and replaced
+// stage by stage from the timeline group of the configuration, or the file it names.
+// A layers list replaces the layer stack, stages name the layers they draw into.
+class Timeline
+{
+public:
+    Timeline();
+
+    // Returns false and keeps the current stages when the configuration has errors
+    bool applyConfig(const libconfig::Setting &settings);
+
+    const StageProgram &program(AnimStage stage) const { return _stages[stage]; }
+    // The compositor layers the stages draw into, bottom first
+    const std::vector<LayerSettings> &layers() const { return _layers; }
+
+    // Starts a run of the stage, carrying particles over from the previous run where the program asks
+    void enter(AnimStage stage, const StageState &previous, const TimelineParameters &parameters,
+               StageState &state) const;
+
+    // The first transition of the current stage whose condition holds, nullptr when there is none
+    const TransitionProgram *firedTransition(const StageState &state) const;
+
+    static const char *stageName(AnimStage stage);
+
+private:
+    bool applyStages(const libconfig::Setting &settings);
+
+    std::array<StageProgram, TIMELINE_STAGE_COUNT> _stages;
+    std::vector<LayerSettings> _layers;
+    std::vector<std::string> _layerNames;
+};
+
+#endif // _TIMELINE_H
@@ -0,0 +1,52 @@
+#ifndef _TRIPLE_BUFFER_H
+#define _TRIPLE_BUFFER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <array>
+
+// Hands the newest of a stream of values from exactly one producer thread to exactly one
+// consumer thread. The producer fills the back slot and publishes it, the consumer takes the
+// most recently published slot. Neither side ever blocks, values the consumer did not take in
+// time are overwritten.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Producer side
+    T &back() { return _slots[_back]; }
+    // Returns true when the previously published value was never taken, back() then holds it again
+    bool publish()
+    {
+        uint8_t previous = _middle.exchange(_back | kFresh, std::memory_order_acq_rel);
+        _back = previous & kIndex;
+        return (previous & kFresh) != 0;
+    }
+
+    // Consumer side, returns false when nothing was published since the last take
+    bool take()
+    {
+        if ((_middle.load(std::memory_order_relaxed) & kFresh) == 0)
+        {
+            return false;
+        }
+        _front = _middle.exchange(_front, std::memory_order_acq_rel) & kIndex;
+        return true;
+    }
+    T &front() { return _slots[_front]; }
+
+    // Only while neither thread uses the buffer
+    std::array<T, 3> &slots() { return _slots; }
+
+private:
+    static constexpr uint8_t kIndex = 0x3;
+    static constexpr uint8_t kFresh = 0x4;
+
+    std::array<T, 3> _slots;
+    uint8_t _back = 0;
+    // Keep the shared index away from the slots the two threads write
+    alignas(64) std::atomic<uint8_t> _middle{1};
+    alignas(64) uint8_t _front = 2;
+};
+
+#endif // _TRIPLE_BUFFER_H
@@ -0,0 +1,64 @@
+#include "UniverseBatch.h"
+
+#include <cstring>
+
+void UniverseBatch::rebuild(uint8_t *packets, std::initializer_list<const std::vector<std::vector<sockaddr_in>> *> destinations)
+{
+    _packets = packets;
+    _universeCount = destinations.size() > 0 ? (*destinations.begin())->size() : 0;
+    _iovecs.resize(_universeCount);
+    _failures.resize(_universeCount);
+    _remotes.clear();
+    _universes.clear();
+    for (size_t i = 0; i < _universeCount; ++i)
+    {
+        _iovecs[i].iov_base = packets + i * _packetSize;
+        _iovecs[i].iov_len = _packetSize;
+        for (const auto *list : destinations)
+        {
+            const std::vector<sockaddr_in> &remotes = (*list)[i];
+            _remotes.insert(_remotes.end(), remotes.begin(), remotes.end());
+            _universes.insert(_universes.end(), remotes.size(), i);
+        }
+    }
+    _messages.resize(_remotes.size());
+    for (size_t i = 0; i < _messages.size(); ++i)
+    {
+        memset(&_messages[i], 0, sizeof(mmsghdr));
+        _messages[i].msg_hdr.msg_name = &_remotes[i];
+        _messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        _messages[i].msg_hdr.msg_iov = &_iovecs[_universes[i]];
+        _messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+size_t UniverseBatch::select(bool all, int64_t now)
+{
+    _all = all;
+    if (all)
+    {
+        // Sending everything uses the prebuilt list as is
+        return _messages.size();
+    }
+    _refresh.resize(_universeCount, _payloadSize);
+    _due.resize(_universeCount);
+    for (size_t i = 0; i < _universeCount; ++i)
+    {
+        _due[i] = _refresh.due(i, _packets + i * _packetSize + _headerSize, now);
+        if (!_due[i])
+        {
+            ++_suppressed;
+        }
+    }
+    _batch.clear();
+    _batchMessages.clear();
+    for (size_t i = 0; i < _messages.size(); ++i)
+    {
+        if (_due[_universes[i]])
+        {
+            _batch.push_back(_messages[i]);
+            _batchMessages.push_back(i);
+        }
+    }
+    return _batch.size();
+}
@@ -0,0 +1,116 @@
+#ifndef _UNIVERSE_BATCH_H
+#define _UNIVERSE_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <initializer_list>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "Histogram.h"
+#include "UniverseRefresh.h"
+
+// The sendmmsg message list of a DMX output: one prebuilt packet per universe, sent to each
+// of the universe's destinations. The messages of a universe share its iovec, so a packet is
+// encoded once however many destinations it has. With a refresh interval only the universes
+// UniverseRefresh finds due go out, copied into a batch of their own.
+class UniverseBatch
+{
+public:
+    UniverseBatch(size_t packetSize, size_t headerSize, size_t payloadSize)
+        : _packetSize(packetSize), _headerSize(headerSize), _payloadSize(payloadSize)
+    {
+    }
+
+    // Rebuilds the messages for packets laid out back to back, each universe is sent to the
+    // destinations it has in every list, in list order
+    void rebuild(uint8_t *packets, std::initializer_list<const std::vector<std::vector<sockaddr_in>> *> destinations);
+
+    void setRefreshInterval(int64_t intervalNs) { _refresh.setInterval(intervalNs); }
+    bool refreshEnabled() const { return _refresh.enabled(); }
+
+    // Picks the messages of the next send(), everything or the universes due at now, and
+    // returns their number
+    size_t select(bool all, int64_t now);
+    // Whether the universe is part of the selected messages
+    bool selected(size_t universe) const { return _all || _due[universe]; }
+
+    // Sends the selected messages, returns the number that failed. A message the kernel refused
+    // is skipped and the rest still go out. report(universe, remote, partial) is called for
+    // every failure.
+    template <typename Report>
+    size_t send(int sockfd, Report report)
+    {
+        mmsghdr *messages = _all ? _messages.data() : _batch.data();
+        size_t count = _all ? _messages.size() : _batch.size();
+        size_t failed = 0;
+        size_t next = 0;
+        while (next < count)
+        {
+            int sent = sendmmsg(sockfd, &messages[next], count - next, 0);
+            if (sent <= 0)
+            {
+                // The first unsent message is the one that failed
+                fail(messageIndex(next), false, report);
+                ++failed;
+                ++next;
+                continue;
+            }
+            for (int i = 0; i < sent; ++i)
+            {
+                if (messages[next + i].msg_len != _packetSize)
+                {
+                    fail(messageIndex(next + i), true, report);
+                    ++failed;
+                }
+            }
+            next += sent;
+        }
+        _sentPackets += count - failed;
+        return failed;
+    }
+
+    // Messages sent per frame without a refresh interval, one per universe and destination
+    size_t messageCount() const { return _messages.size(); }
+    const std::vector<sockaddr_in> &remotes() const { return _remotes; }
+
+    // Readable from any thread once all universes are registered
+    uint64_t failures(size_t universe) const { return _failures[universe]; }
+    uint64_t sentPackets() const { return _sentPackets; }
+    // Universes held back because nothing changed
+    uint64_t suppressedUniverses() const { return _suppressed; }
+
+private:
+    size_t messageIndex(size_t selected) const { return _all ? selected : _batchMessages[selected]; }
+
+    template <typename Report>
+    void fail(size_t message, bool partial, Report &report)
+    {
+        ++_failures[_universes[message]];
+        report(_universes[message], _remotes[message], partial);
+    }
+
+    size_t _packetSize;
+    size_t _headerSize;
+    size_t _payloadSize;
+    size_t _universeCount = 0;
+    uint8_t *_packets = nullptr;
+    std::vector<iovec> _iovecs;
+    // Per message, its destination and its universe
+    std::vector<sockaddr_in> _remotes;
+    std::vector<size_t> _universes;
+    std::vector<mmsghdr> _messages;
+    std::vector<RelaxedCounter> _failures;
+    RelaxedCounter _sentPackets;
+
+    UniverseRefresh _refresh;
+    RelaxedCounter _suppressed;
+    bool _all = true;
+    std::vector<bool> _due;
+    // Copies of the due messages and their index in _messages
+    std::vector<mmsghdr> _batch;
+    std::vector<size_t> _batchMessages;
+};
+
+#endif // _UNIVERSE_BATCH_H
@@ -0,0 +1,58 @@
+#ifndef _UNIVERSE_REFRESH_H
+#define _UNIVERSE_REFRESH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+// Frames a changed universe is sent again, so one lost packet does not leave a node behind
+#define UNIVERSE_REFRESH_REPEATS 3
+
+// Decides per universe whether a frame has to go out. A universe is sent when its payload
+// changed, for a few frames after that, and at least once per interval so nodes do not
+// time out. Without an interval every universe is sent every frame.
+class UniverseRefresh
+{
+public:
+    void setInterval(int64_t intervalNs) { _intervalNs = intervalNs; }
+    bool enabled() const { return _intervalNs > 0; }
+
+    void resize(size_t universes, size_t payloadSize)
+    {
+        _payloadSize = payloadSize;
+        _payloads.resize(universes * payloadSize);
+        _sentNs.resize(universes, INT64_MIN / 2);
+        _repeats.resize(universes, 0);
+    }
+
+    // Remembers the payload when it changed
+    bool due(size_t index, const uint8_t *payload, int64_t now)
+    {
+        uint8_t *last = &_payloads[index * _payloadSize];
+        if (memcmp(last, payload, _payloadSize) != 0)
+        {
+            memcpy(last, payload, _payloadSize);
+            _repeats[index] = UNIVERSE_REFRESH_REPEATS - 1;
+        }
+        else if (_repeats[index] > 0)
+        {
+            --_repeats[index];
+        }
+        else if (now - _sentNs[index] < _intervalNs)
+        {
+            return false;
+        }
+        _sentNs[index] = now;
+        return true;
+    }
+
+private:
+    int64_t _intervalNs = 0;
+    size_t _payloadSize = 0;
+    std::vector<uint8_t> _payloads;
+    std::vector<int64_t> _sentNs;
+    std::vector<uint8_t> _repeats;
+};
+
+#endif // _UNIVERSE_REFRESH_H
@@ -0,0 +1,127 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(size_t threadCount)
+{
+    for (size_t i = 0; i <= threadCount; ++i)
+    {
+        _queues.push_back(std::make_unique<TaskQueue>());
+    }
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        _threads.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_mtx);
+        _stopping = true;
+    }
+    _wake.notify_all();
+    for (auto &thread : _threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)> &task)
+{
+    size_t self = _threads.size();
+    if (self == 0 || count < 2)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    // Publish the task before any of its indices becomes visible in a queue
+    {
+        std::lock_guard<std::mutex> guard(_mtx);
+        _task = &task;
+        _remaining = count;
+    }
+    // Deal the tasks round robin, the stealing evens out whatever imbalance is left
+    for (size_t i = 0; i < count; ++i)
+    {
+        TaskQueue &queue = *_queues[i % _queues.size()];
+        std::lock_guard<std::mutex> guard(queue.mtx);
+        queue.tasks.push_back(i);
+    }
+    {
+        std::lock_guard<std::mutex> guard(_mtx);
+        ++_generation;
+    }
+    _wake.notify_all();
+
+    while (runOne(self))
+    {
+    }
+
+    std::unique_lock<std::mutex> lock(_mtx);
+    _done.wait(lock, [this] { return _remaining == 0; });
+    _task = nullptr;
+}
+
+bool WorkerPool::runOne(size_t self)
+{
+    size_t index = 0;
+    bool found = false;
+    {
+        // Own work is taken from the front
+        TaskQueue &own = *_queues[self];
+        std::lock_guard<std::mutex> guard(own.mtx);
+        if (!own.tasks.empty())
+        {
+            index = own.tasks.front();
+            own.tasks.pop_front();
+            found = true;
+        }
+    }
+    for (size_t i = 1; !found && i < _queues.size(); ++i)
+    {
+        // Stolen work is taken from the back of the victim's queue
+        TaskQueue &victim = *_queues[(self + i) % _queues.size()];
+        std::lock_guard<std::mutex> guard(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            index = victim.tasks.back();
+            victim.tasks.pop_back();
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        return false;
+    }
+
+    (*_task)(index);
+    if (--_remaining == 0)
+    {
+        std::lock_guard<std::mutex> guard(_mtx);
+        _done.notify_all();
+    }
+    return true;
+}
+
+void WorkerPool::workerLoop(size_t self)
+{
+    uint64_t seenGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _wake.wait(lock, [&] { return _stopping || _generation != seenGeneration; });
+            if (_stopping)
+            {
+                return;
+            }
+            seenGeneration = _generation;
+        }
+        while (runOne(self))
+        {
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads running batches of indexed tasks. Every worker
+// owns a task queue and steals from the others once its own runs dry, so one
+// slow task only delays the worker that runs it. The calling thread helps too.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(size_t threadCount);
+    ~WorkerPool();
+
+    // Runs task(i) for every i in [0, count) and returns once all of them finished
+    void run(size_t count, const std::function<void(size_t)> &task);
+
+    size_t threadCount() const { return _threads.size(); }
+
+private:
+    struct TaskQueue {
+        std::mutex mtx;
+        std::deque<size_t> tasks;
+    };
+
+    void workerLoop(size_t self);
+    bool runOne(size_t self);
+
+    std::vector<std::thread> _threads;
+    // One queue per worker plus the last one for the calling thread
+    std::vector<std::unique_ptr<TaskQueue>> _queues;
+
+    std::mutex _mtx;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    const std::function<void(size_t)> *_task = nullptr;
+    uint64_t _generation = 0;
+    std::atomic<size_t> _remaining{0};
+    bool _stopping = false;
+};
+
+#endif // _WORKER_POOL_H
@@ -1,34 +1,80 @@
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <thread>
 #include <atomic>
-#include <chrono>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <csignal>
 #include <cstring>
+#include <vector>
 
 #include <libconfig.h++>
 
 #include "LedDriver.h"
+#include "ArtNetDiscovery.h"
+#include "Capture.h"
+#include "ControlLoop.h"
+#include "ControlProtocol.h"
+#include "FrameScheduler.h"
+#include "MetricsWriter.h"
+#include "SenderThread.h"
+#include "WorkerPool.h"
 
-std::unique_ptr<LedDriver> ledDriver;
+// One independently controlled ring
+struct Installation {
+    std::string name;
+    std::unique_ptr<LedDriver> driver;
+    // Commands that did not fit into the driver's queue since the last housekeeping run
+    uint64_t droppedCommands = 0;
+    // Control totals, only touched by the control thread
+    uint64_t datagrams = 0;
+    uint64_t acceptedCommands = 0;
+    uint64_t rejectedMessages = 0;
+    uint64_t droppedTotal = 0;
+};
+
+std::vector<Installation> installations;
+std::unique_ptr<WorkerPool> workerPool;
 std::unique_ptr<std::thread> driverThread;
+FrameScheduler frameScheduler;
+SenderThread senderThread;
+ControlLoop controlLoop;
+ArtNetDiscovery artNetDiscovery;
 std::atomic_bool driverThreadRunning(true);
-std::atomic_bool canExit(false);
-int sockfd = 0;
+std::atomic_bool replayRunning(true);
+std::string configPath;
+// Set by SIGHUP or a change of the config file, housekeeping runs the reload
+std::atomic_bool reloadRequested(false);
+int configWatch = -1;
+std::string configName;
 
 void exitHandler(int signal)
+{
+    // Only wake the control loop here, the shutdown itself runs on the main thread
+    replayRunning = false;
+    controlLoop.stop();
+}
+
+void reloadHandler(int signal)
+{
+    reloadRequested = true;
+}
+
+void shutdown()
 {
     std::cout << "Exiting..." << std::endl;
-    if (sockfd > 0)
+    std::cout << "Stopping the control sockets...";
+    controlLoop.close();
+    artNetDiscovery.close();
+    if (configWatch >= 0)
     {
-        std::cout << "Stopping the control socket...";
-        close(sockfd);
-        std::cout << "DONE" << std::endl;
+        close(configWatch);
     }
+    std::cout << "DONE" << std::endl;
     if (driverThread)
     {
         std::cout << "Stopping the rendering thread...";
@@ -36,13 +82,19 @@ void exitHandler(int signal)
         driverThread->join();
         std::cout << "DONE" << std::endl;
     }
-    if (ledDriver)
+    if (senderThread.isRunning())
+    {
+        std::cout << "Stopping the sender thread...";
+        senderThread.stop();
+        std::cout << "DONE" << std::endl;
+    }
+    for (auto &installation : installations)
     {
-        std::cout << "Clearing leds...";
-        ledDriver->clear();
+        std::cout << "Clearing leds of " << installation.name << "...";
+        installation.driver->clear();
+        installation.driver->writeBakes();
         std::cout << "DONE" << std::endl;
     }
-    canExit = true;
 }
 
 inline color_t colorFromInteger(uint32_t src)
@@ -54,146 +106,593 @@ inline color_t colorFromInteger(uint32_t src)
         .w = static_cast<uint8_t>(src & 0x000000FF)};
 }
 
-void printPalette(color_t primary, color_t secondary, color_t fill, const char *prefix = "")
+void postCommand(Installation &installation, const LedCommand &command)
 {
-    std::cout << prefix;
-    std::cout << "Primary RGBW: " << primary.r << " " << primary.g << " " << primary.b << " " << primary.w << std::endl;
-
-    std::cout << prefix;
-    std::cout << "Secondary RGBW: " << secondary.r << " " << secondary.g << " " << secondary.b << " " << secondary.w << std::endl;
+    if (!installation.driver->postCommand(command))
+    {
+        ++installation.droppedCommands;
+        ++installation.droppedTotal;
+        return;
+    }
+    ++installation.acceptedCommands;
+    // An idle render thread would otherwise only see the command on its next keepalive frame
+    frameScheduler.wake();
+}
 
-    std::cout << prefix;
-    std::cout << "Fill RGBW: " << fill.r << " " << fill.g << " " << fill.b << " " << fill.w << std::endl;
+void replyLatency(Installation &installation, int fd, const sockaddr_in &remote)
+{
+    const AtomicHistogram &latency = installation.driver->getControlLatency();
+    char reply[128];
+    int length = snprintf(reply, sizeof(reply), "Latency count=%llu p50_us=%llu p99_us=%llu max_us=%llu\n",
+                          static_cast<unsigned long long>(latency.count()),
+                          static_cast<unsigned long long>(latency.percentile(50) / 1000),
+                          static_cast<unsigned long long>(latency.percentile(99) / 1000),
+                          static_cast<unsigned long long>(latency.max() / 1000));
+    if (sendto(fd, reply, length, 0, (const sockaddr *)&remote, sizeof(remote)) < 0)
+    {
+        std::cout << "[" << installation.name << "] Failed to answer a latency query: " << errno << std::endl;
+    }
 }
 
-void receiveControl()
+void receiveControl(Installation &installation, int fd, const uint8_t *data, size_t length, const sockaddr_in &remote, int64_t receivedNs)
 {
-    char buffer[512];
-    sockaddr_in remote;
-    socklen_t remoteSize = sizeof(remote);
-    ssize_t bytes = recvfrom(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&remote, &remoteSize);
+    LedCommand commands[CONTROL_MAX_COMMANDS];
+    size_t commandCount = 0;
+    ControlParseResult result = parseControlMessage(data, length, commands, CONTROL_MAX_COMMANDS, commandCount);
+    // Accepted datagrams only show in the counters, logging each one would stall the receive loop
+    ++installation.datagrams;
+    if (result != ControlParseResult::kOk)
+    {
+        ++installation.rejectedMessages;
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &remote.sin_addr, address, sizeof(address));
+        std::cout << "[" << installation.name << "] Rejected control message content from " << address << ": "
+                  << controlParseResultName(result) << std::endl;
+    }
 
-    if (bytes < 0)
+    for (size_t i = 0; i < commandCount; ++i)
     {
-        if (errno == EBADF)
+        if (commands[i].type == CommandType::kQueryLatency)
         {
-            // Socket got closed. Just exit.
-            return;
+            replyLatency(installation, fd, remote);
+            continue;
         }
-        std::cout << "Error receiving a control message: " << errno << std::endl;
-        exitHandler(SIGINT);
-        return;
+        commands[i].receivedNs = receivedNs;
+        postCommand(installation, commands[i]);
     }
-    std::cout << "Received a control message from " << inet_ntoa(remote.sin_addr) << std::endl;
+}
 
-    std::string message(buffer, strnlen(buffer, sizeof(buffer)));
+// Where the settings of each installation live, in configuration order
+struct InstallationLayout {
+    std::string name;
+    const libconfig::Setting *settings;
+    // Holds control_address, control_port and control_listeners
+    const libconfig::Setting *control;
+    uint32_t defaultControlPort;
+};
+
+std::vector<InstallationLayout> installationLayout(const libconfig::Config &config)
+{
+    std::vector<InstallationLayout> layout;
+    if (config.exists("installations"))
+    {
+        // Multi-installation layout, every list entry is a led_driver group with its own control address
+        const libconfig::Setting &list = config.lookup("installations");
+        for (int i = 0; i < list.getLength(); ++i)
+        {
+            std::string name = "installation" + std::to_string(i);
+            list[i].lookupValue("name", name);
+            layout.push_back({name, &list[i], &list[i], 13798u + i});
+        }
+    }
+    else
+    {
+        const libconfig::Setting &settings = config.exists("led_driver") ? config.lookup("led_driver") : config.getRoot();
+        layout.push_back({"led_driver", &settings, &config.getRoot(), 13798});
+    }
+    return layout;
+}
 
-    std::string cmd = message.substr(0, message.find_first_of(' '));
-    std::string arg = message.substr(cmd.length() + 1);
-    std::cout << "Command: " << cmd << std::endl
-              << "Argument: " << arg << std::endl;
+// Watches the directory of the config file, editors often replace the file instead of writing to it
+void watchConfig()
+{
+    size_t slash = configPath.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : configPath.substr(0, slash + 1);
+    configName = configPath.substr(slash == std::string::npos ? 0 : slash + 1);
+    configWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (configWatch < 0 || inotify_add_watch(configWatch, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        std::cout << "Failed to watch " << directory << " for config changes! Error: " << errno << std::endl;
+    }
+}
 
-    if (cmd == "AdvanceStagePulsing")
+bool configChanged()
+{
+    if (configWatch < 0)
     {
-        int num = atoi(arg.c_str());
-        if (num <= AnimStage::kFade && num >= AnimStage::kDark)
+        return false;
+    }
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t length;
+    while ((length = read(configWatch, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *next = buffer; next < buffer + length;)
         {
-            std::cout << "Starting pulsing." << std::endl;
-            ledDriver->setPulsing(true);
-            ledDriver->advanceStage(static_cast<AnimStage>(num));
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(next);
+            changed = changed || (event->len > 0 && configName == event->name);
+            next += sizeof(inotify_event) + event->len;
         }
     }
-    if (cmd == "AdvanceStage")
+    return changed;
+}
+
+// Prepares the new settings of every installation before any of them switches, so a broken
+// file changes nothing. The installations themselves, their control listeners and the render
+// group are only read at startup.
+void reloadConfig()
+{
+    std::cout << "Reloading config file " << configPath << "..." << std::endl;
+    libconfig::Config config;
+    try
+    {
+        config.readFile(configPath.c_str());
+    }
+    catch (const libconfig::ParseException &pe)
+    {
+        std::cout << "Reload FAILED! parsing error at line " << pe.getLine() << ": " << pe.getError() << std::endl;
+        return;
+    }
+    catch (const libconfig::FileIOException &ioe)
+    {
+        std::cout << "Reload FAILED! i/o error: " << ioe.what() << std::endl;
+        return;
+    }
+
+    std::vector<InstallationLayout> layout = installationLayout(config);
+    bool sameInstallations = layout.size() == installations.size();
+    for (size_t i = 0; sameInstallations && i < layout.size(); ++i)
+    {
+        sameInstallations = layout[i].name == installations[i].name;
+    }
+    if (!sameInstallations)
+    {
+        std::cout << "Reload FAILED! The installations changed, restart to apply." << std::endl;
+        return;
+    }
+    for (size_t i = 0; i < layout.size(); ++i)
     {
-        if (ledDriver->getPulsing())
+        if (!installations[i].driver->prepareReload(*layout[i].settings))
         {
-            std::cout << "Ignoring non-pulsing state change until the pulsing cycle finishes." << std::endl;
+            std::cout << "Reload FAILED! The settings of " << installations[i].name << " have errors or an output did not open." << std::endl;
+            for (size_t j = 0; j < i; ++j)
+            {
+                installations[j].driver->cancelReload();
+            }
             return;
         }
-        int num = atoi(arg.c_str());
-        if (num <= AnimStage::kFade && num >= AnimStage::kDark)
+    }
+    for (auto &installation : installations)
+    {
+        installation.driver->commitReload();
+    }
+    frameScheduler.wake();
+    std::cout << "Reload prepared, switching on the next frame." << std::endl;
+}
+
+void housekeeping()
+{
+    artNetDiscovery.poll();
+    if (configChanged())
+    {
+        reloadRequested = true;
+    }
+    // A reload waits until the previous one finished switching
+    bool settled = true;
+    for (auto &installation : installations)
+    {
+        settled = installation.driver->reloadSettled() && settled;
+    }
+    if (settled && reloadRequested.exchange(false))
+    {
+        if (configPath.empty())
+        {
+            std::cout << "No config file to reload." << std::endl;
+        }
+        else
         {
-            ledDriver->advanceStage(static_cast<AnimStage>(num));
+            reloadConfig();
         }
     }
-    else if (cmd == "Palette")
+    for (auto &installation : installations)
     {
-        std::stringstream ss(arg);
-        int r, g, b, w;
-        ss >> r;
-        ss >> g;
-        ss >> b;
-        ss >> w;
-        color_t primary = {
-            .r = static_cast<uint8_t>(r),
-            .g = static_cast<uint8_t>(g),
-            .b = static_cast<uint8_t>(b),
-            .w = static_cast<uint8_t>(w)};
+        installation.driver->writeBakes();
+        if (installation.droppedCommands > 0)
+        {
+            std::cout << "[" << installation.name << "] Command queue was full, dropped "
+                      << installation.droppedCommands << " command(s)." << std::endl;
+            installation.droppedCommands = 0;
+        }
+    }
+}
 
-        ss >> r;
-        ss >> g;
-        ss >> b;
-        ss >> w;
-        color_t secondary = {
-            .r = static_cast<uint8_t>(r),
-            .g = static_cast<uint8_t>(g),
-            .b = static_cast<uint8_t>(b),
-            .w = static_cast<uint8_t>(w)};
+// Calls fn(outputIndex, output) for the network outputs of one kind (ArtNetSink or SacnSink)
+// of a finalized installation
+template <typename Sink, typename Fn>
+void forEachOutput(const Installation &installation, Fn fn)
+{
+    // A reload swaps the outputs on the sender, they are skipped until housekeeping collected the replaced ones
+    if (!installation.driver->isFinalized() || installation.driver->reloadPending())
+    {
+        return;
+    }
+    const std::vector<OutputSink> &sinks = installation.driver->getSinks();
+    for (size_t i = 0; i < sinks.size(); ++i)
+    {
+        if (const Sink *sink = std::get_if<Sink>(&sinks[i]))
+        {
+            fn(i, sink->output());
+        }
+    }
+}
 
-        ss >> r;
-        ss >> g;
-        ss >> b;
-        ss >> w;
-        color_t fill = {
-            .r = static_cast<uint8_t>(r),
-            .g = static_cast<uint8_t>(g),
-            .b = static_cast<uint8_t>(b),
-            .w = static_cast<uint8_t>(w)};
+// Prometheus text dump served on the metrics port. Runs on the control thread and only
+// reads counters the render thread publishes with relaxed atomics, so it never stalls a frame.
+std::string renderMetrics()
+{
+    MetricsWriter writer;
+    const FrameScheduler::Metrics &scheduler = frameScheduler.getMetrics();
+    writer.declare("leddriver_frames_total", "counter", "Frame deadlines reached by the render thread.");
+    writer.value("leddriver_frames_total", "", scheduler.frames);
+    writer.declare("leddriver_frame_overruns_total", "counter", "Frames that started after their deadline.");
+    writer.value("leddriver_frame_overruns_total", "", scheduler.overruns);
+    writer.declare("leddriver_frames_skipped_total", "counter", "Frame deadlines dropped to catch up.");
+    writer.value("leddriver_frames_skipped_total", "", scheduler.skippedFrames);
+    writer.declare("leddriver_frame_lateness_seconds", "summary", "Wake-up time after the frame deadline.");
+    writer.summary("leddriver_frame_lateness_seconds", "", scheduler.lateness);
+    writer.declare("leddriver_frame_jitter_seconds", "summary", "Deviation of the frame interval from the period.");
+    writer.summary("leddriver_frame_jitter_seconds", "", scheduler.jitter);
+    writer.declare("leddriver_frames_idle_total", "counter", "Frames rendered at the idle frame rate.");
+    writer.value("leddriver_frames_idle_total", "", scheduler.idleFrames);
+    writer.declare("leddriver_frame_wakeups_total", "counter", "Idle waits cut short by a control command.");
+    writer.value("leddriver_frame_wakeups_total", "", scheduler.wakeups);
+    if (senderThread.isRunning())
+    {
+        writer.declare("leddriver_sender_late_wakeups_total", "counter", "Frames composed while the sender thread was still sending.");
+        writer.value("leddriver_sender_late_wakeups_total", "", senderThread.lateWakeups());
+    }
+    if (artNetDiscovery.enabled())
+    {
+        writer.declare("leddriver_artnet_nodes", "gauge", "Art-Net nodes that answered the recent polls.");
+        writer.value("leddriver_artnet_nodes", "", artNetDiscovery.nodeCount());
+        writer.declare("leddriver_artnet_poll_replies_total", "counter", "ArtPollReply packets received.");
+        writer.value("leddriver_artnet_poll_replies_total", "", artNetDiscovery.repliesReceived());
+    }
 
-        std::cout << "Setting palette to: " << std::endl;
-        printPalette(primary, secondary, fill, "\t");
-        ledDriver->setColorScheme(primary, secondary, fill);
+    struct Family {
+        const char *name;
+        const char *type;
+        const char *help;
+        std::function<void(const std::string &labels, const Installation &installation)> write;
+    };
+    const Family families[] = {
+        {"leddriver_stage", "gauge", "Current animation stage.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_stage", labels, installation.driver->getMetrics().stage.load(std::memory_order_relaxed));
+         }},
+        {"leddriver_updates_total", "counter", "Animation updates.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_updates_total", labels, installation.driver->getMetrics().frames);
+         }},
+        {"leddriver_update_seconds", "summary", "Animation update time per frame.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.summary("leddriver_update_seconds", labels, installation.driver->getMetrics().updateTime);
+         }},
+        {"leddriver_render_seconds", "summary", "Color curve, pixel map scatter and encode time per frame.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.summary("leddriver_render_seconds", labels, installation.driver->getMetrics().renderTime);
+         }},
+        {"leddriver_frames_dropped_total", "counter", "Composed frames replaced before the sender thread sent them.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_frames_dropped_total", labels, installation.driver->getMetrics().droppedFrames);
+         }},
+        {"leddriver_send_seconds", "summary", "Network send time per frame.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.summary("leddriver_send_seconds", labels, installation.driver->getMetrics().sendTime);
+         }},
+        {"leddriver_control_latency_seconds", "summary", "Control datagram receive to first frame sent.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.summary("leddriver_control_latency_seconds", labels, installation.driver->getControlLatency());
+         }},
+        {"leddriver_control_datagrams_total", "counter", "Control datagrams received.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_control_datagrams_total", labels, installation.datagrams);
+         }},
+        {"leddriver_control_rejected_total", "counter", "Control datagrams with malformed or unsupported content.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_control_rejected_total", labels, installation.rejectedMessages);
+         }},
+        {"leddriver_commands_accepted_total", "counter", "Commands queued for the render thread.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_commands_accepted_total", labels, installation.acceptedCommands);
+         }},
+        {"leddriver_commands_dropped_total", "counter", "Commands dropped because the queue was full.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_commands_dropped_total", labels, installation.droppedTotal);
+         }},
+        {"leddriver_commands_ignored_total", "counter", "Queued commands the animation refused to apply.",
+         [&](const std::string &labels, const Installation &installation) {
+             writer.value("leddriver_commands_ignored_total", labels, installation.driver->getMetrics().ignoredCommands);
+         }},
+        {"leddriver_artnet_packets_total", "counter", "Art-Net packets handed to the kernel per output.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 writer.value("leddriver_artnet_packets_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                              output.sentPackets());
+             });
+         }},
+        {"leddriver_artnet_destinations", "gauge", "Art-Net packets sent per frame, one per universe and destination.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 writer.value("leddriver_artnet_destinations", labels + ",output=\"" + std::to_string(index) + "\"",
+                              output.destinationCount());
+             });
+         }},
+        {"leddriver_artnet_send_errors_total", "counter", "Failed Art-Net packet sends per universe.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 for (size_t i = 0; i < output.universeCount(); ++i)
+                 {
+                     writer.value("leddriver_artnet_send_errors_total",
+                                  labels + ",output=\"" + std::to_string(index) + "\",universe=\"" +
+                                      std::to_string(output.portAddress(i)) + "\"",
+                                  output.failures(i));
+                 }
+             });
+         }},
+        {"leddriver_artnet_sync_packets_total", "counter", "ArtSync packets sent per output.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 if (output.syncEnabled())
+                 {
+                     writer.value("leddriver_artnet_sync_packets_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                                  output.syncPackets());
+                 }
+             });
+         }},
+        {"leddriver_artnet_sync_errors_total", "counter", "Failed ArtSync sends per output.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 if (output.syncEnabled())
+                 {
+                     writer.value("leddriver_artnet_sync_errors_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                                  output.syncFailures());
+                 }
+             });
+         }},
+        {"leddriver_artnet_sync_delay_seconds", "summary", "First ArtDmx packet of a frame to its ArtSync.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 if (output.syncEnabled())
+                 {
+                     writer.summary("leddriver_artnet_sync_delay_seconds", labels + ",output=\"" + std::to_string(index) + "\"",
+                                    output.syncDelay());
+                 }
+             });
+         }},
+        {"leddriver_artnet_suppressed_total", "counter", "Art-Net universes not sent because they did not change.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<ArtNetSink>(installation, [&](size_t index, const ArtNetOutput &output) {
+                 writer.value("leddriver_artnet_suppressed_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                              output.suppressedUniverses());
+             });
+         }},
+        {"leddriver_sacn_suppressed_total", "counter", "sACN universes not sent because they did not change.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<SacnSink>(installation, [&](size_t index, const SacnOutput &output) {
+                 writer.value("leddriver_sacn_suppressed_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                              output.suppressedUniverses());
+             });
+         }},
+        {"leddriver_sacn_packets_total", "counter", "sACN packets handed to the kernel per output.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<SacnSink>(installation, [&](size_t index, const SacnOutput &output) {
+                 writer.value("leddriver_sacn_packets_total", labels + ",output=\"" + std::to_string(index) + "\"",
+                              output.sentPackets());
+             });
+         }},
+        {"leddriver_sacn_send_errors_total", "counter", "Failed sACN packet sends per universe.",
+         [&](const std::string &labels, const Installation &installation) {
+             forEachOutput<SacnSink>(installation, [&](size_t index, const SacnOutput &output) {
+                 for (size_t i = 0; i < output.universeCount(); ++i)
+                 {
+                     writer.value("leddriver_sacn_send_errors_total",
+                                  labels + ",output=\"" + std::to_string(index) + "\",universe=\"" +
+                                      std::to_string(output.universe(i)) + "\"",
+                                  output.failures(i));
+                 }
+             });
+         }},
+    };
+    for (const auto &family : families)
+    {
+        writer.declare(family.name, family.type, family.help);
+        for (const auto &installation : installations)
+        {
+            family.write("installation=\"" + installation.name + "\"", installation);
+        }
     }
+    return writer.str();
 }
 
 void renderThread()
 {
-    ledDriver->finalize();
+    for (auto &installation : installations)
+    {
+        installation.driver->finalize();
+    }
+
+    float deltaTime = 0.f;
+    const std::function<void(size_t)> renderInstallation = [&deltaTime](size_t index) {
+        LedDriver *ledDriver = installations[index].driver.get();
+        ledDriver->update(deltaTime);
+        if (senderThread.isRunning())
+        {
+            ledDriver->compose();
+        }
+        else
+        {
+            ledDriver->render();
+        }
+    };
 
-    const float targetFrameRate = 30.0f;
-    const std::chrono::duration<float> targetFrameTime(1.0f / targetFrameRate);
+    // Start the update loop, every ring is stepped on the same tick so they never drift apart
+    frameScheduler.start();
+    while (driverThreadRunning)
+    {
+        deltaTime = frameScheduler.waitNextFrame();
+        workerPool->run(installations.size(), renderInstallation);
+        if (senderThread.isRunning())
+        {
+            senderThread.frameReady();
+        }
 
-    // Variables for tracking time
-    std::chrono::high_resolution_clock::time_point previousTime = std::chrono::high_resolution_clock::now();
-    std::chrono::high_resolution_clock::time_point currentTime;
+        // The busiest ring sets the pace of the shared tick
+        FrameRate rate = FrameRate::kIdle;
+        for (const auto &installation : installations)
+        {
+            rate = std::max(rate, installation.driver->frameRate());
+        }
+        frameScheduler.setRate(rate);
+    }
+}
+
+bool parseListener(const std::string &controlAddress, uint32_t controlPort, sockaddr_in &address)
+{
+    address = sockaddr_in{
+        .sin_family = AF_INET,
+        .sin_port = htons(controlPort),
+        .sin_addr = {.s_addr = INADDR_ANY}};
+    if (inet_aton(controlAddress.c_str(), &address.sin_addr) == 0)
+    {
+        std::cout << "Invalid control address: " << controlAddress << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    // Start the update loop
-    while (ledDriver && driverThreadRunning)
+// Reads control_address/control_port plus any extra control_listeners entries of an installation
+bool addInstallation(const std::string &name, const libconfig::Setting &settings, const libconfig::Setting &controlSettings,
+                     uint32_t defaultControlPort)
+{
+    std::vector<sockaddr_in> listeners(1);
+    std::string controlAddress = "0.0.0.0";
+    uint32_t controlPort = defaultControlPort;
+    controlSettings.lookupValue("control_address", controlAddress);
+    controlSettings.lookupValue("control_port", controlPort);
+    if (!parseListener(controlAddress, controlPort, listeners[0]))
     {
-        // Calculate delta time
-        currentTime = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<float> deltaTime = currentTime - previousTime;
-        previousTime = currentTime;
+        return false;
+    }
+    if (controlSettings.exists("control_listeners"))
+    {
+        const libconfig::Setting &list = controlSettings.lookup("control_listeners");
+        for (int i = 0; i < list.getLength(); ++i)
+        {
+            controlAddress = "0.0.0.0";
+            list[i].lookupValue("address", controlAddress);
+            if (!list[i].lookupValue("port", controlPort))
+            {
+                std::cout << "Control listener " << i << " of " << name << " has no port." << std::endl;
+                return false;
+            }
+            listeners.emplace_back();
+            if (!parseListener(controlAddress, controlPort, listeners.back()))
+            {
+                return false;
+            }
+        }
+    }
 
-        ledDriver->update(deltaTime.count());
-        ledDriver->render();
+    for (const auto &address : listeners)
+    {
+        std::cout << "Creating an UDP control socket for " << name << " on port " << ntohs(address.sin_port) << "...";
+        if (!controlLoop.addUdpListener(address, installations.size()))
+        {
+            return false;
+        }
+        std::cout << "DONE" << std::endl;
+    }
 
-        // Delay to achieve desired frame rate
-        std::this_thread::sleep_for(targetFrameTime - (currentTime - std::chrono::high_resolution_clock::now()));
+    Installation installation;
+    installation.name = name;
+    installation.driver = std::make_unique<LedDriver>();
+    if (!installation.driver->applyConfig(settings))
+    {
+        std::cout << "Settings of " << name << " have errors, running with the parts that could be applied." << std::endl;
     }
+    installation.driver->setArtNetDiscovery(&artNetDiscovery);
+    installations.push_back(std::move(installation));
+    return true;
 }
 
+// Usage: led_driver [config] [--replay capture [--fast] [--loops n] [--target address]]
 int main(int argc, char *argv[])
 {
+    std::string replayPath;
+    ReplayOptions replayOptions;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--replay" && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+        }
+        else if (arg == "--fast")
+        {
+            replayOptions.fast = true;
+        }
+        else if (arg == "--loops" && i + 1 < argc)
+        {
+            replayOptions.loops = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--target" && i + 1 < argc)
+        {
+            replayOptions.target = argv[++i];
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+        else
+        {
+            configPath = arg;
+        }
+    }
+
     std::signal(SIGINT, exitHandler);
+    std::signal(SIGTERM, exitHandler);
+    std::signal(SIGHUP, reloadHandler);
+
+    // Replay mode only streams the capture, no animation and no control sockets
+    if (!replayPath.empty())
+    {
+        return replayCapture(replayPath, replayOptions, replayRunning) ? 0 : 1;
+    }
+
+    if (!controlLoop.open())
+    {
+        return 0;
+    }
 
     libconfig::Config config;
-    if (argc >= 2)
+    if (!configPath.empty())
     {
         std::cout << "Reading config file...";
         try
         {
-            config.readFile(argv[1]);
+            config.readFile(configPath.c_str());
         }
         catch (libconfig::ParseException pe)
         {
@@ -206,41 +705,91 @@ int main(int argc, char *argv[])
         std::cout << "DONE" << std::endl;
     }
 
-    std::cout << "Creating an UDP control socket...";
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    if (config.exists("artnet_discovery"))
     {
-        std::cout << "FAIL! error creating a socket: " << errno << std::endl;
-        return 0;
+        if (!artNetDiscovery.applyConfig(config.lookup("artnet_discovery")))
+        {
+            return 0;
+        }
+        if (artNetDiscovery.enabled())
+        {
+            std::cout << "Starting Art-Net node discovery...";
+            if (!artNetDiscovery.open(controlLoop))
+            {
+                return 0;
+            }
+            std::cout << "DONE" << std::endl;
+        }
     }
-    uint32_t control_port = 13798;
-    config.lookupValue("control_port", control_port);
-    sockaddr_in address{
-        .sin_family = AF_INET,
-        .sin_port = htons(control_port),
-        .sin_addr = {.s_addr = INADDR_ANY}};
-    if (bind(sockfd, (struct sockaddr *)(&address), sizeof(address)) < 0)
+
+    for (const auto &entry : installationLayout(config))
     {
-        std::cout << "FAIL! error in bind: " << errno << std::endl;
-        close(sockfd);
+        if (!addInstallation(entry.name, *entry.settings, *entry.control, entry.defaultControlPort))
+        {
+            return 0;
+        }
+    }
+    if (installations.empty())
+    {
+        std::cout << "No installations configured." << std::endl;
         return 0;
     }
-    std::cout << "DONE" << std::endl;
 
-    std::cout << "Starting the rendering thread...";
-    ledDriver = std::make_unique<LedDriver>();
-    ledDriver->applyConfig(config);
+    // The render thread works too, so one worker less than rings is enough
+    uint32_t workerThreads = std::min<uint32_t>(std::max(1u, std::thread::hardware_concurrency()), installations.size()) - 1;
+    config.lookupValue("render.worker_threads", workerThreads);
+    workerPool = std::make_unique<WorkerPool>(workerThreads);
+
+    std::cout << "Starting the rendering thread for " << installations.size() << " installation(s) on "
+              << workerPool->threadCount() + 1 << " thread(s)...";
+    frameScheduler.applyConfig(config);
+    bool sender = false;
+    config.lookupValue("render.sender_thread", sender);
+    if (sender)
+    {
+        senderThread.start([] {
+            for (auto &installation : installations)
+            {
+                installation.driver->transmit();
+            }
+        });
+    }
     driverThread = std::make_unique<std::thread>(renderThread);
     std::cout << "DONE" << std::endl;
 
-    std::cout << "Now listening for control messages." << std::endl;
-    while (driverThreadRunning)
+    controlLoop.setDatagramHandler([](size_t tag, int fd, const uint8_t *data, size_t length, const sockaddr_in &remote, int64_t receivedNs) {
+        if (tag == ARTNET_DISCOVERY_TAG)
+        {
+            artNetDiscovery.receive(data, length, remote);
+            return;
+        }
+        receiveControl(installations[tag], fd, data, length, remote, receivedNs);
+    });
+    double housekeepingInterval = 1.0;
+    config.lookupValue("housekeeping_interval", housekeepingInterval);
+    controlLoop.setHousekeeping(housekeepingInterval, housekeeping);
+    bool watch = false;
+    config.lookupValue("watch_config", watch);
+    if (watch && !configPath.empty())
     {
-        receiveControl();
+        watchConfig();
     }
 
-    while (!canExit)
+    uint32_t metricsPort = 0;
+    std::string metricsAddress = "127.0.0.1";
+    config.lookupValue("metrics_port", metricsPort);
+    config.lookupValue("metrics_address", metricsAddress);
+    sockaddr_in metricsListener;
+    if (metricsPort != 0 && parseListener(metricsAddress, metricsPort, metricsListener))
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::cout << "Serving metrics on " << metricsAddress << ":" << metricsPort << "...";
+        if (controlLoop.addTcpResponder(metricsListener, renderMetrics))
+        {
+            std::cout << "DONE" << std::endl;
+        }
     }
-}
\ No newline at end of file
+
+    std::cout << "Now listening for control messages." << std::endl;
+    controlLoop.run();
+    shutdown();
+}